@@ -0,0 +1,314 @@
+#include "simulator.hpp"
+#include "dependencies.hpp"
+#include "circuit_simulator.hpp"
+#include "circuit_simulator.h"
+
+using namespace std;
+using namespace Eigen;
+
+// Library interface: the same transient analysis as the command line program, with the netlist and the results in memory.
+// Calls only share the (locked) in-memory cache of fill-reducing orderings, so several simulations may run at the same time
+// on different threads, and a sweep over one design orders its sparse matrix only once.
+
+// Value in the notation the netlist parser accepts everywhere (.tran does not take exponents): 12.5u, 3.3k, 0
+static string format_value(double value) {
+  static const char *suffixes[] = {"p", "n", "u", "m", "", "k", "Meg", "G"};
+  if(value == 0.0) {
+    return "0";
+  }
+  int suffix = 4;
+  double mantissa = value;
+  while(fabs(mantissa) < 1.0 && suffix > 0) {
+    mantissa *= 1000.0;
+    suffix--;
+  }
+  while(fabs(mantissa) >= 1000.0 && suffix < 7) {
+    mantissa /= 1000.0;
+    suffix++;
+  }
+  stringstream text;
+  text.precision(12);
+  text << mantissa << suffixes[suffix];
+  return text.str();
+}
+
+static string source_line(string name, string node0, string node1, double dc, double amplitude, double frequency) {
+  if(amplitude == 0.0) {
+    return name + " " + node0 + " " + node1 + " " + format_value(dc);
+  }
+  return name + " " + node0 + " " + node1 + " SINE(" + format_value(dc) + " " + format_value(amplitude) + " " + format_value(frequency) + ")";
+}
+
+netlist_builder &netlist_builder::transient(double stop_time, double timestep) {
+  lines.push_back(".tran 0 " + format_value(stop_time) + "s 0 " + format_value(timestep) + "s");
+  return *this;
+}
+
+netlist_builder &netlist_builder::resistor(string name, string node0, string node1, double resistance) {
+  lines.push_back(name + " " + node0 + " " + node1 + " " + format_value(resistance));
+  return *this;
+}
+
+netlist_builder &netlist_builder::capacitor(string name, string node0, string node1, double capacitance) {
+  lines.push_back(name + " " + node0 + " " + node1 + " " + format_value(capacitance));
+  return *this;
+}
+
+netlist_builder &netlist_builder::inductor(string name, string node0, string node1, double inductance) {
+  lines.push_back(name + " " + node0 + " " + node1 + " " + format_value(inductance));
+  return *this;
+}
+
+netlist_builder &netlist_builder::voltage_source(string name, string node0, string node1, double dc, double amplitude, double frequency) {
+  lines.push_back(source_line(name, node0, node1, dc, amplitude, frequency));
+  return *this;
+}
+
+netlist_builder &netlist_builder::current_source(string name, string node0, string node1, double dc, double amplitude, double frequency) {
+  lines.push_back(source_line(name, node0, node1, dc, amplitude, frequency));
+  return *this;
+}
+
+netlist_builder &netlist_builder::option(string key, string value) {
+  lines.push_back(".options " + key + "=" + value);
+  return *this;
+}
+
+netlist_builder &netlist_builder::line(string netlist_line) {
+  lines.push_back(netlist_line);
+  return *this;
+}
+
+string netlist_builder::str() const {
+  string text;
+  for(const string &netlist_line: lines) {
+    text += netlist_line + "\n";
+  }
+  return text + ".end\n";
+}
+
+const double *simulation_results::signal(const string &name) const {
+  for(int s = 0; s < signal_names.size(); s++) {
+    if(signal_names[s] == name) {
+      return signals[s].data();
+    }
+  }
+  return nullptr;
+}
+
+int simulation_results::timesteps() const {
+  return time.size();
+}
+
+// Messages.
+// The simulator prints its [ERROR] and [WARNING] lines to cout. During a library call they are collected in
+// results.messages instead: cout gets a buffer that appends to the capture of the printing thread, and passes everything
+// else on to stdout. The capture is per thread, so simulations on other threads (and the program itself) are not affected.
+// Worker threads of a simulation (parareal) take over the capture of the thread that started them. The capture itself
+// (thread_message_capture) is in transient_analysis.cpp, as the command line program links the simulation code without this file.
+
+class message_capture_buffer : public streambuf {
+  public:
+    explicit message_capture_buffer(streambuf *stdout_buffer) : stdout_buffer(stdout_buffer) {}
+
+  protected:
+    int overflow(int c) override {
+      if(c == traits_type::eof()) {
+        return 0;
+      }
+      string *capture = thread_message_capture();
+      if(capture != nullptr) {
+        capture->push_back(char(c));
+        return c;
+      }
+      return stdout_buffer->sputc(char(c));
+    }
+
+    streamsize xsputn(const char *text, streamsize count) override {
+      string *capture = thread_message_capture();
+      if(capture != nullptr) {
+        capture->append(text, count);
+        return count;
+      }
+      return stdout_buffer->sputn(text, count);
+    }
+
+    int sync() override {
+      return thread_message_capture() != nullptr ? 0 : stdout_buffer->pubsync();
+    }
+
+  private:
+    streambuf *stdout_buffer;
+};
+
+// Captures cout on this thread while it exists
+class message_capture {
+  public:
+    explicit message_capture(string &messages) {
+      static message_capture_buffer buffer(cout.rdbuf());
+      static bool installed = []() { cout.flush(); cout.rdbuf(&buffer); return true; }();
+      (void)installed;
+      previous = thread_message_capture();
+      thread_message_capture() = &messages;
+    }
+    ~message_capture() {
+      thread_message_capture() = previous;
+    }
+
+  private:
+    string *previous;
+};
+
+static int run_netlist(const string &netlist, simulation_results &results) {
+  network_simulation sim;
+  sim.verbose = false;
+  if(parse_netlist_text(sim, netlist) != 0) {
+    cout << "[ERROR] Netlist has subcircuit instances that can't be expanded" << endl;
+    return 1;
+  }
+  if(find_if(sim.analysis_directives.begin(), sim.analysis_directives.end(), [](const string &directive) { return directive.compare(0, 5, ".tran") == 0; }) == sim.analysis_directives.end()) {
+    cout << "[ERROR] The netlist has no .tran line" << endl;
+    return 1;
+  }
+
+  // One array per signal, grown by one value per timestep
+  network_solver solver;
+  int status = run_transient_analysis(sim, solver, "",
+    [&](const vector<string> &column_names) {
+      results.signal_names = column_names;
+      results.signals.assign(column_names.size(), vector<double>());
+      long expected_steps = sim.timestep > 0.0 ? sim.stop_time / sim.timestep + 2 : 0;
+      results.time.reserve(expected_steps);
+      for(vector<double> &values: results.signals) {
+        values.reserve(expected_steps);
+      }
+    },
+    [&](int variant, double simulation_progress, const vector<double> &row_values) {
+      // .stimulus variants are only written by the command line program
+      if(variant != 0) {
+        return;
+      }
+      results.time.push_back(simulation_progress);
+      for(int s = 0; s < row_values.size(); s++) {
+        results.signals[s].push_back(row_values[s]);
+      }
+    });
+  if(status != 0) {
+    return 1;
+  }
+
+  for(const measurement &meas: sim.measurements) {
+    double value;
+    if(measurement_value(meas, value)) {
+      results.measurements[meas.name] = value;
+    }
+  }
+  return 0;
+}
+
+int simulate_netlist(const string &netlist, simulation_results &results) {
+  results = simulation_results();
+  message_capture capture(results.messages);
+  try {
+    return run_netlist(netlist, results);
+  } catch(const exception &error) {
+    cout << "[ERROR] " << error.what() << endl;
+  } catch(...) {
+    cout << "[ERROR] Unknown error" << endl;
+  }
+  return 1;
+}
+
+int simulate_netlist(const netlist_builder &netlist, simulation_results &results) {
+  return simulate_netlist(netlist.str(), results);
+}
+
+
+// C interface
+
+struct circuit_results {
+  simulation_results results;
+  int status;
+};
+
+// Returned when not even the results object can be allocated, it is never freed
+static circuit_results out_of_memory_results = {simulation_results(), 1};
+
+circuit_results *circuit_simulate(const char *netlist) {
+  circuit_results *results = nullptr;
+  try {
+    results = new circuit_results();
+    results->status = 1;
+    if(netlist == nullptr) {
+      results->results.messages = "[ERROR] No netlist\n";
+      return results;
+    }
+    results->status = simulate_netlist(string(netlist), results->results);
+  } catch(...) {
+    // Allocation failures outside of the simulation itself
+    if(results == nullptr) {
+      return &out_of_memory_results;
+    }
+    results->status = 1;
+  }
+  return results;
+}
+
+int circuit_results_status(const circuit_results *results) {
+  return results->status;
+}
+
+const char *circuit_results_messages(const circuit_results *results) {
+  return results->results.messages.c_str();
+}
+
+int circuit_results_timesteps(const circuit_results *results) {
+  return results->results.timesteps();
+}
+
+const double *circuit_results_time(const circuit_results *results) {
+  return results->results.time.data();
+}
+
+int circuit_results_signal_count(const circuit_results *results) {
+  return results->results.signals.size();
+}
+
+const char *circuit_results_signal_name(const circuit_results *results, int signal) {
+  if(signal < 0 || signal >= results->results.signal_names.size()) {
+    return nullptr;
+  }
+  return results->results.signal_names[signal].c_str();
+}
+
+int circuit_results_find_signal(const circuit_results *results, const char *name) {
+  for(int s = 0; s < results->results.signal_names.size(); s++) {
+    if(results->results.signal_names[s] == name) {
+      return s;
+    }
+  }
+  return -1;
+}
+
+const double *circuit_results_signal(const circuit_results *results, int signal) {
+  if(signal < 0 || signal >= results->results.signals.size()) {
+    return nullptr;
+  }
+  return results->results.signals[signal].data();
+}
+
+int circuit_results_measurement(const circuit_results *results, const char *name, double *value) {
+  auto found = results->results.measurements.find(name);
+  if(found == results->results.measurements.end()) {
+    return 1;
+  }
+  *value = found->second;
+  return 0;
+}
+
+void circuit_results_free(circuit_results *results) {
+  if(results == &out_of_memory_results) {
+    return;
+  }
+  delete results;
+}
@@ -0,0 +1,40 @@
+#ifndef circuit_simulator_h
+#define circuit_simulator_h
+
+/* Plain C interface of the simulator library, for use through FFI.
+   All arrays stay owned by the results object and are valid until circuit_results_free. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct circuit_results circuit_results;
+
+/* Runs the transient analysis of a netlist given as text. Never returns NULL; check circuit_results_status. */
+circuit_results *circuit_simulate(const char *netlist);
+
+/* 0 on success, 1 if the netlist is invalid or the simulation failed */
+int circuit_results_status(const circuit_results *results);
+
+/* The [ERROR] and [WARNING] lines of the simulation, one per line (empty string if there were none) */
+const char *circuit_results_messages(const circuit_results *results);
+
+int circuit_results_timesteps(const circuit_results *results);
+const double *circuit_results_time(const circuit_results *results);
+
+int circuit_results_signal_count(const circuit_results *results);
+const char *circuit_results_signal_name(const circuit_results *results, int signal);
+/* Index of a signal by name (node index such as "3", or component name), -1 if it does not exist */
+int circuit_results_find_signal(const circuit_results *results, const char *name);
+const double *circuit_results_signal(const circuit_results *results, int signal);
+
+/* Result of a .meas line. Returns 0 and sets value on success, 1 if there is no such result. */
+int circuit_results_measurement(const circuit_results *results, const char *name, double *value);
+
+void circuit_results_free(circuit_results *results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef circuit_simulator_hpp
+#define circuit_simulator_hpp
+
+// C++ interface for using the simulator as a library, without netlist.txt and output.csv.
+// Only standard headers are needed here; Eigen stays internal to the library.
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Builds a netlist in memory. Node names are written as in a netlist file ("N001", "0").
+class netlist_builder {
+  public:
+    netlist_builder &transient(double stop_time, double timestep);
+    netlist_builder &resistor(std::string name, std::string node0, std::string node1, double resistance);
+    netlist_builder &capacitor(std::string name, std::string node0, std::string node1, double capacitance);
+    netlist_builder &inductor(std::string name, std::string node0, std::string node1, double inductance);
+    // dc + amplitude*sin(2*pi*frequency*t); a DC source if amplitude is 0
+    netlist_builder &voltage_source(std::string name, std::string node0, std::string node1, double dc, double amplitude = 0.0, double frequency = 0.0);
+    netlist_builder &current_source(std::string name, std::string node0, std::string node1, double dc, double amplitude = 0.0, double frequency = 0.0);
+    netlist_builder &option(std::string key, std::string value);
+    // Any other netlist line (.subckt, X instances, .meas, ...)
+    netlist_builder &line(std::string netlist_line);
+
+    // The netlist text, terminated by .end
+    std::string str() const;
+
+  private:
+    std::vector<std::string> lines;
+};
+
+// Results of one transient analysis. Every signal is a contiguous array with one value per timestep,
+// so it can be used directly (signal(...), signals[i].data()) without copying.
+class simulation_results {
+  public:
+    std::vector<double> time;
+    std::vector<std::string> signal_names; // the CSV column names: node index ("3") for voltages, component name for currents
+    std::vector<std::vector<double>> signals;
+    std::map<std::string, double> measurements; // .meas results that could be measured
+    std::string messages; // what the simulation printed: its [ERROR] and [WARNING] lines
+
+    // The values of a signal, nullptr if there is no signal with that name
+    const double *signal(const std::string &name) const;
+    int timesteps() const;
+};
+
+// Runs the transient analysis of a netlist held in memory. The results are replaced.
+// Returns 0 on success, 1 if the netlist is invalid or the simulation failed (the reason is in results.messages).
+// Nothing is printed to stdout, and no exception leaves the call.
+int simulate_netlist(const std::string &netlist, simulation_results &results);
+int simulate_netlist(const netlist_builder &netlist, simulation_results &results);
+
+#endif
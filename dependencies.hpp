@@ -8,9 +8,11 @@
 
 // Types
 #include <cctype>
+#include <cstdint>
 #include <string>
 #include <regex>
 #include <vector>
+#include <deque>
 #include <complex>
 #include <fstream>
 #include <sstream>
@@ -18,6 +20,12 @@
 #include <type_traits>
 #include <typeinfo>
 #include <map>
+#include <set>
+#include <tuple>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <memory>
 
 
 // Mathematical Helpers
@@ -26,6 +34,7 @@
 
 #include <algorithm>
 #include <Eigen/Dense> // This must be included in the compile path (g++ -I eigen/ ...)
+#include <Eigen/Sparse> // Sparse matrices and iterative solvers, part of the same Eigen directory
 
 using namespace std;
 using namespace Eigen;
@@ -0,0 +1,270 @@
+#include "simulator.hpp"
+#include "dependencies.hpp"
+
+#include <thread>
+
+using namespace std;
+using namespace Eigen;
+
+// Harmonic balance: the periodic steady state, solved in the frequency domain without any time stepping.
+// Every signal is a sum of harmonics of the fundamental f0, x(t) = Re(sum_k X_k e^(j k w t)) with w = 2 pi f0.
+// The sources are evaluated in the time domain at N points of one period and transformed with an FFT, which gives their X_k
+// (also for waveforms with more than one harmonic). The circuit equations are then balanced harmonic by harmonic, in modified
+// nodal form with the voltage source and inductor currents as additional unknowns:
+//    R: 1/R    C: j k w C    L: V0 - V1 - j k w L i = 0    V: V0 - V1 = E_k    I: J_k into terminal 1
+// The elements of this simulator are linear, so they don't couple different harmonics: the Jacobian is block diagonal with
+// one block per harmonic, and each block is factorised and solved on its own (on several threads). One pass is exact.
+// At k = 0 capacitors are open, so every node gets hb_gmin to ground, which puts nodes only connected through capacitors at 0V.
+
+static const double hb_gmin = 1e-12;
+
+// Radix-2 FFT, the size must be a power of two
+static void fft(vector<complex<double>> &values) {
+  int n = values.size();
+  for(int i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for(; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if(i < j) {
+      swap(values[i], values[j]);
+    }
+  }
+  for(int length = 2; length <= n; length <<= 1) {
+    for(int start = 0; start < n; start += length) {
+      for(int k = 0; k < length/2; k++) {
+        complex<double> even = values[start+k];
+        complex<double> odd = values[start+k+length/2] * polar(1.0, -2*M_PI*k/length);
+        values[start+k] = even + odd;
+        values[start+k+length/2] = even - odd;
+      }
+    }
+  }
+}
+
+// X_0 ... X_harmonics of a source, from its value at samples points of one period
+static vector<complex<double>> source_spectrum(const component &cmp, double period, int samples, int harmonics) {
+  vector<complex<double>> values(samples);
+  for(int n = 0; n < samples; n++) {
+    values[n] = source_value(cmp, n*period/samples);
+  }
+  fft(values);
+  vector<complex<double>> spectrum(harmonics+1);
+  spectrum[0] = values[0] / double(samples);
+  for(int k = 1; k <= harmonics; k++) {
+    spectrum[k] = 2.0 * values[k] / double(samples);
+  }
+  return spectrum;
+}
+
+// The unknowns: node voltages in the order of create_v_matrix, then one current per V source and inductor
+class hb_layout {
+  public:
+    vector<node> nodes;
+    map<int,int> row_of_node;
+    vector<int> terminal_rows; // two per component, -1 for ground
+    vector<int> branch_rows; // per component, -1 if it has no branch current
+    int size;
+};
+
+// Solves one harmonic block. Returns false if the block is singular.
+static bool solve_harmonic(const network_simulation &sim, const hb_layout &layout, const vector<vector<complex<double>>> &spectra,
+                           int k, double omega, VectorXcd &solution) {
+  typedef complex<double> phasor;
+  vector<Triplet<phasor>> entries;
+  VectorXcd rhs = VectorXcd::Zero(layout.size);
+  auto stamp = [&entries](int row0, int row1, phasor admittance) {
+    if(row0 != -1) { entries.push_back(Triplet<phasor>(row0, row0, admittance)); }
+    if(row1 != -1) { entries.push_back(Triplet<phasor>(row1, row1, admittance)); }
+    if(row0 != -1 && row1 != -1) {
+      entries.push_back(Triplet<phasor>(row0, row1, -admittance));
+      entries.push_back(Triplet<phasor>(row1, row0, -admittance));
+    }
+  };
+  // Branch row: V0 - V1 (- impedance*i); the branch current leaves terminal 0 with the given sign
+  auto stamp_branch = [&entries](int row0, int row1, int branch, double sign, phasor impedance) {
+    if(row0 != -1) {
+      entries.push_back(Triplet<phasor>(row0, branch, sign));
+      entries.push_back(Triplet<phasor>(branch, row0, 1.0));
+    }
+    if(row1 != -1) {
+      entries.push_back(Triplet<phasor>(row1, branch, -sign));
+      entries.push_back(Triplet<phasor>(branch, row1, -1.0));
+    }
+    entries.push_back(Triplet<phasor>(branch, branch, -impedance));
+  };
+
+  phasor jw(0.0, k*omega);
+  for(int c = 0; c < sim.network_components.size(); c++) {
+    const component &cmp = sim.network_components[c];
+    int row0 = layout.terminal_rows[2*c];
+    int row1 = layout.terminal_rows[2*c+1];
+    switch(cmp.component_name[0]) {
+      case 'R':
+        stamp(row0, row1, 1.0/cmp.component_value[0]);
+        break;
+      case 'C':
+        stamp(row0, row1, jw*cmp.component_value[0]);
+        break;
+      case 'L':
+        // Current from terminal 0 to terminal 1 through the inductor, a short circuit at k = 0
+        stamp_branch(row0, row1, layout.branch_rows[c], 1.0, jw*cmp.component_value[0]);
+        break;
+      case 'V':
+        // Current driven out of terminal 0 into the circuit
+        stamp_branch(row0, row1, layout.branch_rows[c], -1.0, 0.0);
+        rhs(layout.branch_rows[c]) = spectra[c][k];
+        break;
+      case 'I':
+        if(row0 != -1) { rhs(row0) -= spectra[c][k]; }
+        if(row1 != -1) { rhs(row1) += spectra[c][k]; }
+        break;
+    }
+  }
+  if(k == 0) {
+    for(int row = 0; row < layout.nodes.size(); row++) {
+      entries.push_back(Triplet<phasor>(row, row, hb_gmin));
+    }
+  }
+
+  SparseMatrix<phasor> Y(layout.size, layout.size);
+  Y.setFromTriplets(entries.begin(), entries.end());
+  Y.makeCompressed();
+  SparseLU<SparseMatrix<phasor>> lu;
+  lu.analyzePattern(Y);
+  lu.factorize(Y);
+  if(lu.info() != Success) {
+    return false;
+  }
+  solution = lu.solve(rhs);
+  return solution.allFinite();
+}
+
+// Phasor of the current through a component, with the directions of output.csv
+static complex<double> component_current(const component &cmp, int c, const hb_layout &layout, const VectorXcd &solution,
+                                         const vector<vector<complex<double>>> &spectra, int k, double omega) {
+  int row0 = layout.terminal_rows[2*c];
+  int row1 = layout.terminal_rows[2*c+1];
+  complex<double> voltage = (row0 == -1 ? 0.0 : solution(row0)) - (row1 == -1 ? 0.0 : solution(row1));
+  switch(cmp.component_name[0]) {
+    case 'R':
+      return voltage / cmp.component_value[0];
+    case 'C':
+      // Like the capacitor's source equivalent: the current it drives out of terminal 0
+      return -complex<double>(0.0, k*omega*cmp.component_value[0]) * voltage;
+    case 'L':
+    case 'V':
+      return solution(layout.branch_rows[c]);
+    case 'I':
+      return spectra[c][k];
+  }
+  return 0.0;
+}
+
+int run_harmonic_balance(const network_simulation &sim, string filename) {
+  double fundamental = sim.hb_frequency > 0.0 ? sim.hb_frequency : lowest_sine_frequency(sim);
+  if(fundamental <= 0.0) {
+    cout << "[ERROR] .hb needs a frequency or a SINE source" << endl;
+    return 1;
+  }
+  int harmonics = sim.hb_harmonics;
+  double period = 1.0 / fundamental;
+  double omega = 2*M_PI*fundamental;
+
+  // The sources must be periodic with the fundamental; enough samples that none of their harmonics aliases
+  double highest_ratio = harmonics;
+  for(const component &cmp: sim.network_components) {
+    char type = cmp.component_name[0];
+    if(type != 'R' && type != 'C' && type != 'L' && type != 'V' && type != 'I') {
+      cout << "[WARNING] .hb ignores " << cmp.component_name << endl;
+    }
+    if((type == 'V' || type == 'I') && cmp.component_value[1] != 0.0) {
+      double ratio = cmp.component_value[2] / fundamental;
+      if(fabs(ratio - round(ratio)) > 1e-9 * max(1.0, ratio)) {
+        cout << "[WARNING] " << cmp.component_name << ": " << cmp.component_value[2] << "Hz is not a harmonic of " << fundamental << "Hz" << endl;
+      } else if(ratio > harmonics) {
+        cout << "[WARNING] " << cmp.component_name << ": " << cmp.component_value[2] << "Hz is above the highest harmonic, raise the harmonic count" << endl;
+      }
+      highest_ratio = max(highest_ratio, ratio);
+    }
+  }
+  int samples = 1;
+  while(samples <= 2*highest_ratio) {
+    samples *= 2;
+  }
+
+  hb_layout layout;
+  layout.nodes = create_v_matrix(sim);
+  for(int row = 0; row < layout.nodes.size(); row++) {
+    layout.row_of_node[layout.nodes[row].index] = row;
+  }
+  layout.size = layout.nodes.size();
+  vector<vector<complex<double>>> spectra(sim.network_components.size());
+  for(int c = 0; c < sim.network_components.size(); c++) {
+    const component &cmp = sim.network_components[c];
+    for(int t = 0; t < 2; t++) {
+      int index = cmp.connected_terminals[t].index;
+      layout.terminal_rows.push_back(index == 0 ? -1 : layout.row_of_node[index]);
+    }
+    layout.branch_rows.push_back(cmp.component_name[0] == 'V' || cmp.component_name[0] == 'L' ? layout.size++ : -1);
+    if(cmp.component_name[0] == 'V' || cmp.component_name[0] == 'I') {
+      spectra[c] = source_spectrum(cmp, period, samples, harmonics);
+    }
+  }
+
+  // The harmonic blocks are independent
+  vector<VectorXcd> solutions(harmonics+1);
+  vector<char> solved(harmonics+1, 0);
+  int threads = sim.assembly_threads > 0 ? sim.assembly_threads : max(1u, thread::hardware_concurrency());
+  threads = min(threads, harmonics+1);
+  vector<thread> workers;
+  for(int worker = 0; worker < threads; worker++) {
+    workers.push_back(thread([&, worker]() {
+      for(int k = worker; k <= harmonics; k += threads) {
+        solved[k] = solve_harmonic(sim, layout, spectra, k, omega, solutions[k]);
+      }
+    }));
+  }
+  for(thread &worker: workers) {
+    worker.join();
+  }
+  for(int k = 0; k <= harmonics; k++) {
+    if(!solved[k]) {
+      cout << "[ERROR] Harmonic balance: the circuit equations of harmonic " << k << " are singular (loop of voltage sources"
+           << (k == 0 ? " and inductors" : "") << "?)" << endl;
+      return 1;
+    }
+  }
+
+  // One row per harmonic: peak amplitude and phase (degrees, cosine reference) of every node voltage and component current
+  ofstream ofs(filename);
+  ofs << "Harmonic,Frequency";
+  for(const node &nd: layout.nodes) {
+    ofs << ",mag(" << nd.index << "),phase(" << nd.index << ")";
+  }
+  for(const component &cmp: sim.network_components) {
+    ofs << ",mag(" << cmp.component_name << "),phase(" << cmp.component_name << ")";
+  }
+  ofs << endl;
+  for(int k = 0; k <= harmonics; k++) {
+    vector<complex<double>> values;
+    for(int row = 0; row < layout.nodes.size(); row++) {
+      values.push_back(solutions[k](row));
+    }
+    for(int c = 0; c < sim.network_components.size(); c++) {
+      values.push_back(component_current(sim.network_components[c], c, layout, solutions[k], spectra, k, omega));
+    }
+    ofs << k << "," << k*fundamental;
+    for(const complex<double> &value: values) {
+      ofs << "," << abs(value) << "," << (abs(value) == 0.0 ? 0.0 : arg(value) * 180.0 / M_PI);
+    }
+    ofs << endl;
+  }
+
+  if(sim.verbose) {
+    cout << "Harmonic balance: " << harmonics << " harmonics of " << fundamental << "Hz, " << samples << " samples per period, "
+         << layout.size << " unknowns per harmonic" << endl;
+  }
+  return 0;
+}
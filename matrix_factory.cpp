@@ -1,6 +1,127 @@
 #include "simulator.hpp"
 #include "dependencies.hpp"
 
+#include <thread>
+#include <condition_variable>
+
+// Assembly is split into contiguous ranges (of rows or components), one per thread.
+// Every thread only writes its own rows or its own buffer, so no locks are needed and the result does not depend on the thread count.
+// The threads are kept in a pool for the whole process, as G and I are assembled at every timestep.
+static const int min_work_per_thread = 2000; // below this, handing out the ranges costs more than it saves
+
+// Runs one job at a time: parts 0 ... parts-1 of it are taken by the waiting workers and by the calling thread.
+// A second simulation that assembles while the pool is busy (library users running in parallel) runs its parts itself.
+class assembly_pool {
+  public:
+    ~assembly_pool() {
+      {
+        lock_guard<mutex> lock(state_mutex);
+        stopping = true;
+      }
+      wake.notify_all();
+      for(thread &worker: workers) {
+        worker.join();
+      }
+    }
+
+    // false if the pool is busy with another job
+    bool run(int parts, const function<void(int)> &part) {
+      unique_lock<mutex> job_lock(job_mutex, try_to_lock);
+      if(!job_lock.owns_lock()) {
+        return false;
+      }
+      {
+        lock_guard<mutex> lock(state_mutex);
+        while(workers.size() < parts-1) {
+          workers.push_back(thread([this]() { work(); }));
+        }
+        job = &part;
+        job_parts = parts;
+        next_part = 0;
+        finished_parts = 0;
+        generation++;
+      }
+      wake.notify_all();
+      take_parts();
+      unique_lock<mutex> lock(state_mutex);
+      done.wait(lock, [this]() { return finished_parts == job_parts; });
+      job = nullptr;
+      return true;
+    }
+
+  private:
+    mutex job_mutex;
+    mutex state_mutex;
+    condition_variable wake, done;
+    vector<thread> workers;
+    const function<void(int)> *job = nullptr;
+    int job_parts = 0, next_part = 0, finished_parts = 0;
+    long generation = 0;
+    bool stopping = false;
+
+    void take_parts() {
+      unique_lock<mutex> lock(state_mutex);
+      while(job != nullptr && next_part < job_parts) {
+        int current = next_part++;
+        const function<void(int)> &part = *job;
+        lock.unlock();
+        part(current);
+        lock.lock();
+        if(++finished_parts == job_parts) {
+          done.notify_all();
+        }
+      }
+    }
+
+    void work() {
+      long seen = 0;
+      while(true) {
+        {
+          unique_lock<mutex> lock(state_mutex);
+          wake.wait(lock, [&]() { return stopping || generation != seen; });
+          if(stopping) {
+            return;
+          }
+          seen = generation;
+        }
+        take_parts();
+      }
+    }
+};
+
+static int assembly_thread_count(const network_simulation &A, int work_items) {
+  int threads = A.assembly_threads;
+  if(threads <= 0) {
+    threads = thread::hardware_concurrency();
+  }
+  threads = min(threads, work_items / min_work_per_thread);
+  return max(threads, 1);
+}
+
+// Calls part(0) ... part(parts-1), in parallel
+static void parallel_parts(int parts, const function<void(int)> &part) {
+  static assembly_pool pool;
+  if(parts > 1 && pool.run(parts, part)) {
+    return;
+  }
+  for(int p = 0; p < parts; p++) {
+    part(p);
+  }
+}
+
+// Range of part number part when [0, count) is split into parts consecutive ranges
+static pair<int,int> part_range(int count, int parts, int part) {
+  return make_pair(int((long)count * part / parts), int((long)count * (part+1) / parts));
+}
+
+// Calls work(begin, end) for consecutive ranges covering [0, count), in parallel
+static void parallel_ranges(int count, int threads, const function<void(int,int)> &work) {
+  parallel_parts(threads, [&](int part) {
+    pair<int,int> range = part_range(count, threads, part);
+    work(range.first, range.second);
+  });
+}
+
 double impedance(component cmp) {
   if (cmp.component_name[0] == 'R') {
     return cmp.read_value()[0];
@@ -9,7 +130,7 @@ double impedance(component cmp) {
 }
 
 double sum_conductance(vector<component> components) {
-  double sum;
+  double sum = 0.0;
   for(component cmp: components) {
     if(cmp.component_name[0] == 'R')
     sum += 1.0/impedance(cmp);
@@ -39,7 +160,7 @@ double calculate_conductance_between_nodes(node A, node B) {
 
 
 
-vector<node> create_v_matrix(network_simulation A) {
+vector<node> create_v_matrix(const network_simulation &A) {
   vector<node> network_nodes_without_ref_node;
   for(int c = 0 ; c < A.network_nodes.size(); c++){
 	if(A.network_nodes[c].index != 0 ) {
@@ -50,38 +171,56 @@ vector<node> create_v_matrix(network_simulation A) {
 }
 
 // This functoin constructs the current single-column matrix  (I in G*V = I)
-MatrixXd create_i_matrix(network_simulation A, double simulation_progress) {
-
-  vector<node> nodes_with_ref_node = A.network_nodes;
-  vector<node> unknown_nodes = create_v_matrix(A);
-  node reference_node(0);
-
-  // the following for loop finds the reference node in the circuit and assigns it to the reference_node
-  for(int it = 0; it < nodes_with_ref_node.size(); it++){
-    if(nodes_with_ref_node[it].index == 0){
-      reference_node = nodes_with_ref_node[it];
+// It is called every timestep, so the nodes are only referenced (create_v_matrix would copy every node with its components)
+// and the supernode rows are looked up once per call instead of once per row.
+MatrixXd create_i_matrix(const network_simulation &A, double simulation_progress) {
+
+  // The unknown nodes, in the order of create_v_matrix
+  vector<const node*> unknown_nodes;
+  for(const node &nd: A.network_nodes) {
+    if(nd.index != 0) {
+      unknown_nodes.push_back(&nd);
     }
   }
+  // Only the index of the reference node is compared
+  node reference_node(0);
 
 
   //the matrix with 1 column and some rows declared. The number of rows is defined by the number of unknown voltage nodes in the circuit
   int rows = unknown_nodes.size();
-  MatrixXd current_matrix(rows,1);
+  MatrixXd current_matrix = MatrixXd::Zero(rows,1);
 
   //this does supernodes separation, it finds supernodes, separate them into a pair of nodes, relationship node and non-relationship node
   vector<pair<node,node>> supernodes = supernode_separation(A.network_components, reference_node);
+  // Rows of both nodes of every supernode, and the supernodes of every row (in order, a later one overwrites the row)
+  map<int,int> row_of_node;
+  for(int row = 0; row < rows; row++) {
+    row_of_node[unknown_nodes[row]->index] = row;
+  }
+  vector<pair<int,int>> supernode_rows;
+  vector<vector<int>> supernodes_of_row(rows);
+  for(const pair<node,node> &snd: supernodes) {
+    int first = row_of_node.count(snd.first.index) ? row_of_node[snd.first.index] : -1;
+    int second = row_of_node.count(snd.second.index) ? row_of_node[snd.second.index] : -1;
+    if(first != -1) { supernodes_of_row[first].push_back(supernode_rows.size()); }
+    if(second != -1 && second != first) { supernodes_of_row[second].push_back(supernode_rows.size()); }
+    supernode_rows.push_back({first, second});
+  }
 
 
   // The for loop checks all the nodes and pushes value into the matrix according to different situations.
-  for(int i = 0; i < unknown_nodes.size(); i++) {
+  // Every row only depends on its own node, so the rows are split between threads.
+  parallel_ranges(rows, assembly_thread_count(A, rows), [&](int first_row, int last_row) {
+  for(int i = first_row; i < last_row; i++) {
+    const node &unknown_node = *unknown_nodes[i];
     // For a regular node (no supernode), the current sources are summed
     double current;
-    current = sum_known_currents(unknown_nodes[i], simulation_progress);
+    current = sum_known_currents(unknown_node, simulation_progress);
     current_matrix(i,0) = current;
 
     // If it is a node with known voltage, set the current entry to voltage at that node
-    if(is_a_node_voltage_known(unknown_nodes[i],reference_node)) {
-    	for(component cmp: unknown_nodes[i].connected_components) {
+    if(is_a_node_voltage_known(unknown_node,reference_node)) {
+    	for(const component &cmp: unknown_node.connected_components) {
     		//find the v source that the node is connected to
     		if(cmp.component_name[0] == 'V'){
     			double voltage;
@@ -89,12 +228,12 @@ MatrixXd create_i_matrix(network_simulation A, double simulation_progress) {
     			// Check if the positive side or the negative side of the v source is conneceted to the node
 
     			// Positive side to the node
-    			if(cmp.connected_terminals[0] == unknown_nodes[i]){
+    			if(cmp.connected_terminals[0] == unknown_node){
     				voltage = cmp.component_value[0] + cmp.component_value[1]*sin(2*M_PI*cmp.component_value[2]*simulation_progress);
     				current_matrix(i,0) = voltage;
     			}
     			// Negative side to the node
-    		  if(cmp.connected_terminals[1] == unknown_nodes[i]){
+    		  if(cmp.connected_terminals[1] == unknown_node){
     				voltage = 0.0 - (cmp.component_value[0] + cmp.component_value[1]*sin(2*M_PI*cmp.component_value[2]*simulation_progress));
             current_matrix(i,0) = voltage;
     			}
@@ -105,19 +244,19 @@ MatrixXd create_i_matrix(network_simulation A, double simulation_progress) {
     // For a supernode, there are two matrix-line entries. One line represents a relationship between nodes, the other line represents the total conductance/currents of the two nodes forming a supernode
 
     // For the node-relationship entry, the source value is used.
-    for(pair<node,node> snd: supernodes){
+    for(int s: supernodes_of_row[i]){
+      int first = supernode_rows[s].first;
+      int second = supernode_rows[s].second;
 
       // If the current node is a supernode
-    	if(unknown_nodes[i] == snd.first){
-        vector<double> vsource_values;
+    	if(i == first && second != -1){
         // Iterate through the components of the supernode(node 1 of supernode)
-        for(component cmp1: unknown_nodes[i].connected_components){
+        for(const component &cmp1: unknown_node.connected_components){
           // Iterate through the components of the supernode(node 2 of supernode
-          int which = which_is_the_node(unknown_nodes, snd.second);
-          for(component cmp2: unknown_nodes[which].connected_components){
+          for(const component &cmp2: unknown_nodes[second]->connected_components){
             if(cmp1.component_name == cmp2.component_name){
               // The voltage source that caused the node to be classified as a supernode
-              vsource_values = cmp1.component_value;
+              const vector<double> &vsource_values = cmp1.component_value;
               double voltage = vsource_values[0] + vsource_values[1]*sin(2*M_PI*vsource_values[2]*simulation_progress);
               current_matrix(i,0) = voltage;
             }
@@ -127,28 +266,30 @@ MatrixXd create_i_matrix(network_simulation A, double simulation_progress) {
 
 
       // If it is a non-relationship supernode
-    	if(unknown_nodes[i] == snd.second){
+    	if(i == second){
     	  // return the sum of I sources going out of the node if the supernode
     		double current = 0.0;
     		//add the current going out of the first super node
-        int which = which_is_the_node(unknown_nodes, snd.first);
-    		current += sum_known_currents(unknown_nodes[which], simulation_progress);
+    		if(first != -1) {
+    		  current += sum_known_currents(*unknown_nodes[first], simulation_progress);
+    		}
     		// add the current going out of the second super node
-    		current += sum_known_currents(unknown_nodes[i], simulation_progress);
+    		current += sum_known_currents(unknown_node, simulation_progress);
     		current_matrix(i,0) = current;
     	}
     }
 
   }
+  });
 
   // Finally return the assembled current matrix
   return current_matrix;
 }
 
 
-MatrixXd create_G_matrix(network_simulation A){
+MatrixXd create_G_matrix(const network_simulation &A){
 
-	vector<node> nodes_with_ref_node = A.network_nodes;
+	const vector<node> &nodes_with_ref_node = A.network_nodes;
 	vector<node> nodes_wo_ref_node = create_v_matrix(A);
 	node reference_node(0);
 
@@ -169,7 +310,9 @@ MatrixXd create_G_matrix(network_simulation A){
 	//the following two for loops addresses different terms in the G matrix. It defines all columns in one row first then defines the columns in the second row...
 	//the "row" for-loop checks all the nodes and pushes value into the columns of the row  according to different situations.
 	//the whole row is first initiated with normal conductance terms, if the row is a known node or a supernode, the whole row will be overwritten.
-	for(int row = 0; row < num; row++){
+	//rows are independent of each other, so they are split between threads
+	parallel_ranges(num, assembly_thread_count(A, num*num), [&](int first_row, int last_row) {
+	for(int row = first_row; row < last_row; row++){
 
 
 		 //if it is a normal row with all the conductance terms like G11, G12, G13 and etc.
@@ -233,5 +376,113 @@ MatrixXd create_G_matrix(network_simulation A){
 
 
 	}
+	});
 	return G;
 }
+
+
+// Sparse version of create_G_matrix for large networks.
+// Rather than comparing every pair of nodes, every resistor is stamped once into the rows of its two terminals.
+// Known nodes and supernodes get the same rows as in create_G_matrix:
+// known node => 1 on the diagonal; relationship supernode => V+ - V- ; non-relationship supernode => sum of both conductance rows
+SparseMatrix<double> create_G_sparse_matrix(const network_simulation &A) {
+
+  vector<node> nodes_wo_ref_node = create_v_matrix(A);
+  node reference_node(0);
+  for(int it = 0; it < A.network_nodes.size(); it++){
+    if(A.network_nodes[it].index == 0){
+      reference_node = A.network_nodes[it];
+    }
+  }
+
+  int num = nodes_wo_ref_node.size();
+
+  // Row of every node in the matrix (the reference node has no row)
+  map<int,int> row_of_node;
+  for(int row = 0; row < num; row++){
+    row_of_node[nodes_wo_ref_node[row].index] = row;
+  }
+
+  // Row types: 0 normal, 1 known node, 2 relationship supernode, 3 non-relationship supernode
+  vector<int> row_type(num, 0);
+  vector<int> supernode_partner(num, -1);
+  for(int row = 0; row < num; row++){
+    if(is_a_node_voltage_known(nodes_wo_ref_node[row], reference_node)){
+      row_type[row] = 1;
+    }
+  }
+  vector<pair<node,node>> supernodes = supernode_separation(A.network_components, reference_node);
+  for(pair<node,node> snd: supernodes){
+    int positive = row_of_node[snd.first.index];
+    int negative = row_of_node[snd.second.index];
+    row_type[positive] = 2;
+    supernode_partner[positive] = negative;
+  }
+  for(pair<node,node> snd: supernodes){
+    int positive = row_of_node[snd.first.index];
+    int negative = row_of_node[snd.second.index];
+    row_type[negative] = 3;
+    supernode_partner[negative] = positive;
+  }
+
+  // Each thread stamps a contiguous range of components into its own buffer.
+  // The buffers are joined in component order, so the summation order is the same as for a single thread.
+  int component_count = A.network_components.size();
+  int threads = assembly_thread_count(A, component_count);
+  vector<vector<Triplet<double>>> thread_entries(threads);
+
+  parallel_parts(threads, [&](int part) {
+    int first_cmp = part_range(component_count, threads, part).first;
+    int last_cmp = part_range(component_count, threads, part).second;
+    vector<Triplet<double>> &entries = thread_entries[part];
+    entries.reserve(4*(last_cmp-first_cmp));
+
+    // Conductance terms of a node end up in its own row, or in the row of its partner for relationship supernodes
+    auto stamp = [&](int row, int column, double value) {
+      if(row_type[row] == 0 || row_type[row] == 3){
+        entries.push_back(Triplet<double>(row, column, value));
+      }
+      if(row_type[row] == 2 && row_type[supernode_partner[row]] == 3){
+        entries.push_back(Triplet<double>(supernode_partner[row], column, value));
+      }
+    };
+
+    for(int c = first_cmp; c < last_cmp; c++){
+      const component &cmp = A.network_components[c];
+      if(cmp.component_name[0] != 'R'){
+        continue;
+      }
+      double conductance = 1.0/cmp.component_value[0];
+      int a = cmp.connected_terminals[0].index == 0 ? -1 : row_of_node.at(cmp.connected_terminals[0].index);
+      int b = cmp.connected_terminals[1].index == 0 ? -1 : row_of_node.at(cmp.connected_terminals[1].index);
+      if(a != -1){
+        stamp(a, a, conductance);
+        if(b != -1){ stamp(a, b, -conductance); }
+      }
+      if(b != -1){
+        stamp(b, b, conductance);
+        if(a != -1){ stamp(b, a, -conductance); }
+      }
+    }
+  });
+
+  vector<Triplet<double>> entries;
+  entries.reserve(4*component_count + 2*num);
+  for(vector<Triplet<double>> &buffer: thread_entries){
+    entries.insert(entries.end(), buffer.begin(), buffer.end());
+  }
+
+  for(int row = 0; row < num; row++){
+    if(row_type[row] == 1){
+      entries.push_back(Triplet<double>(row, row, 1.0));
+    }
+    if(row_type[row] == 2){
+      entries.push_back(Triplet<double>(row, row, 1.0));
+      entries.push_back(Triplet<double>(row, supernode_partner[row], -1.0));
+    }
+  }
+
+  SparseMatrix<double> G(num, num);
+  G.setFromTriplets(entries.begin(), entries.end());
+  return G;
+}
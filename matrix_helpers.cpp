@@ -1,7 +1,7 @@
  #include "dependencies.hpp"
 #include "simulator.hpp"
 
-bool is_a_node_voltage_known(node input, node reference_node) {
+bool is_a_node_voltage_known(const node &input, const node &reference_node) {
   // check if a node is connected to any voltage sources, if so, check whether the other node of the voltage source is the reference node, or connected to another voltage source.
 
   if(input == reference_node){
@@ -34,7 +34,7 @@ bool is_a_node_voltage_known(node input, node reference_node) {
 }
 
 
-bool r_two_nodes_supernodes(component cmp, node reference_node) {
+bool r_two_nodes_supernodes(const component &cmp, const node &reference_node) {
   // this bool function checks if two nodes should be combined into supernodes, thus resulting in a different value in the current column
   // supernodes should be represented by two rows in the matrix.
   // the first row shows the relationship between the two nodes.
@@ -50,7 +50,7 @@ bool r_two_nodes_supernodes(component cmp, node reference_node) {
   return false;
 }
 
-double sum_known_currents(node input, double simulation_progress) {
+double sum_known_currents(const node &input, double simulation_progress) {
 //this function sums up the currents going out of one node at a specific time
 	double sum_current = 0.0;
 	for(int i = 0 ; i < input.connected_components.size() ; i++){
@@ -69,7 +69,7 @@ double sum_known_currents(node input, double simulation_progress) {
 }
 
 // Returns pairs of normal nodes, which represent a supernode.
-vector<pair<node,node>> supernode_separation(vector<component> components, node reference_node) {
+vector<pair<node,node>> supernode_separation(const vector<component> &components, const node &reference_node) {
   // A supernode consists of two nodes. In the matrix a supernode occupies two lines. Each of the two nodes is separated
   //this function takes in the components in the network simulation and checks supernodes.
   //This function outputs a vector of vector of nodes.
@@ -80,7 +80,7 @@ vector<pair<node,node>> supernode_separation(vector<component> components, node
 	vector<node> relationship_node;
 	vector<node> non_relationship_node;
   vector<pair<node,node>> output;
-  for(component cmp: components) {
+  for(const component &cmp: components) {
 		if(cmp.component_name[0] == 'V'){
 			if(r_two_nodes_supernodes(cmp, reference_node)){
 				//the positive side of the V source is going to be the relationship node (assumed to be, it doesnt matter if it's the relationship one or the non relationship one
@@ -91,7 +91,7 @@ vector<pair<node,node>> supernode_separation(vector<component> components, node
 	return output;
 }
 
-int which_is_the_node(vector<node> nodes_wo_ref , node input){
+int which_is_the_node(const vector<node> &nodes_wo_ref, const node &input){
 	for(int i = 0; i < nodes_wo_ref.size(); i++){
 		if(nodes_wo_ref[i] == input){
 			return i;
@@ -101,9 +101,10 @@ int which_is_the_node(vector<node> nodes_wo_ref , node input){
   return -1;
 }
 
-int which_is_cmp(vector<component> networkcmp, component input){
+int which_is_cmp(const vector<component> &networkcmp, const component &input){
   for(int i = 0 ; i < networkcmp.size(); i++){
-    if(networkcmp[i].component_name[0] == input.component_name[2] && networkcmp[i].component_name[1] == input.component_name[3]){
+    // input is the source equivalent (I_L1, V_C1), so its name without the prefix is the original component
+    if(networkcmp[i].component_name == input.component_name.substr(2)){
       return i;
     }
   }
@@ -111,7 +112,7 @@ int which_is_cmp(vector<component> networkcmp, component input){
   return -1;
 }
 
-int which_is_cmp1(vector<component> networkcmp, component input){
+int which_is_cmp1(const vector<component> &networkcmp, const component &input){
      for(int i = 0 ; i < networkcmp.size(); i++){
        if(networkcmp[i].component_name == input.component_name){
          return i;
@@ -122,71 +123,138 @@ int which_is_cmp1(vector<component> networkcmp, component input){
    
 }
 
-void update_source_equivalents(network_simulation &sim, vector<node> Vvector, vector<double> current_through_components, double simulation_progress, double timestep){
+void set_source_values(network_simulation &sim, int component_number, vector<double> values) {
+  component &source = sim.network_components[component_number];
+  source.component_value = values;
 
-//  vector<component> network_components = sim.network_components;
-
-  for(int i = 0 ; i < sim.network_components.size(); i++){
-    if(sim.network_components[i].component_name[1] == '_') {
-
-      // The node voltages with a 0 current source are correct. However, they seem wrong here.
-      if(sim.network_components[i].component_name[0] == 'I') {
-      	int which_is_node0 = which_is_the_node(Vvector, sim.network_components[i].connected_terminals[0]);
-      	int which_is_node1 = which_is_the_node(Vvector, sim.network_components[i].connected_terminals[1]);
-
-        double voltage_across_component;
-        if(which_is_node0 != -1) {
-          voltage_across_component = Vvector[which_is_node0].node_voltage - Vvector[which_is_node1].node_voltage;
-        } else if(which_is_node0==-1) {
-          voltage_across_component = 0 - Vvector[which_is_node1].node_voltage;
-        } else if(which_is_node1==-1) {
-          voltage_across_component = Vvector[which_is_node0].node_voltage - 0;
-        } else {
-          voltage_across_component = 0.0;
-        }
- 
+  int which0 = which_is_the_node(sim.network_nodes, source.connected_terminals[0]);
+  int which1 = which_is_the_node(sim.network_nodes, source.connected_terminals[1]);
+  int node_cmp_idx1 = which_is_cmp1(sim.network_nodes[which0].connected_components, source);
+  sim.network_nodes[which0].connected_components[node_cmp_idx1] = source;
+  int node_cmp_idx2 = which_is_cmp1(sim.network_nodes[which1].connected_components, source);
+  sim.network_nodes[which1].connected_components[node_cmp_idx2] = source;
+}
 
-        sim.network_components[i].component_value[0]=(voltage_across_component / sim.cl_values[sim.network_components[i].component_name])*timestep + sim.network_components[i].component_value[0];
-		independent_i_source equivalent_source(sim.network_components[i].component_name, sim.network_components[i].component_value[0], 0.0, 0.0, sim.network_components[i].connected_terminals);
-		sim.network_components[i] = equivalent_source;
+// The state of the circuit: values of all C/L source equivalents, in component order
+vector<double> read_reactive_states(const network_simulation &sim) {
+  vector<double> states;
+  for(const component &cmp: sim.network_components) {
+    if(cmp.component_name[1] == '_') {
+      states.push_back(cmp.component_value[0]);
+    }
+  }
+  return states;
+}
 
- 		int which0  = which_is_the_node(sim.network_nodes, sim.network_components[i].connected_terminals[0]);
-        int which1  = which_is_the_node(sim.network_nodes, sim.network_components[i].connected_terminals[1]);
-		int node_cmp_idx1 = which_is_cmp1(sim.network_nodes[which0].connected_components, sim.network_components[i]);
-        sim.network_nodes[which0].connected_components[node_cmp_idx1] = equivalent_source;
+static void add_reactive_element(network_simulation &sim, reactive_elements &elements, const vector<node> &Vvector, int component_number) {
+  const component &cmp = sim.network_components[component_number];
+  elements.components.push_back(component_number);
+  elements.values.push_back(sim.cl_values.at(cmp.component_name));
+  elements.states.push_back(cmp.component_value[0]);
+
+  int row0 = which_is_the_node(Vvector, cmp.connected_terminals[0]);
+  int row1 = which_is_the_node(Vvector, cmp.connected_terminals[1]);
+  elements.rows0.push_back(row0 == -1 ? Vvector.size() : row0);
+  elements.rows1.push_back(row1 == -1 ? Vvector.size() : row1);
+
+  int which0 = which_is_the_node(sim.network_nodes, cmp.connected_terminals[0]);
+  int which1 = which_is_the_node(sim.network_nodes, cmp.connected_terminals[1]);
+  elements.nodes0.push_back(which0);
+  elements.slots0.push_back(which_is_cmp1(sim.network_nodes[which0].connected_components, cmp));
+  elements.nodes1.push_back(which1);
+  elements.slots1.push_back(which_is_cmp1(sim.network_nodes[which1].connected_components, cmp));
+}
 
-        int node_cmp_idx2 = which_is_cmp1(sim.network_nodes[which1].connected_components, sim.network_components[i]);
-        sim.network_nodes[which1].connected_components[node_cmp_idx2] = equivalent_source;
+static void build_reactive_elements(network_simulation &sim) {
+  vector<node> Vvector = create_v_matrix(sim);
+  sim.inductors = reactive_elements();
+  sim.capacitors = reactive_elements();
+  for(int i = 0; i < sim.network_components.size(); i++) {
+    const string &name = sim.network_components[i].component_name;
+    if(name[1] == '_') {
+      add_reactive_element(sim, name[0] == 'I' ? sim.inductors : sim.capacitors, Vvector, i);
+    }
+  }
+  sim.reactive_elements_built = true;
+}
 
+// Copies the states to the components and to the node copies
+static void store_reactive_states(network_simulation &sim, const reactive_elements &elements) {
+  for(int k = 0; k < elements.states.size(); k++) {
+    double state = elements.states[k];
+    sim.network_components[elements.components[k]].component_value[0] = state;
+    sim.network_nodes[elements.nodes0[k]].connected_components[elements.slots0[k]].component_value[0] = state;
+    sim.network_nodes[elements.nodes1[k]].connected_components[elements.slots1[k]].component_value[0] = state;
+  }
+}
 
+void write_reactive_states(network_simulation &sim, const vector<double> &states) {
+  if(!sim.reactive_elements_built) {
+    build_reactive_elements(sim);
+  }
+  // Both arrays are in component order
+  int state = 0, inductor = 0, capacitor = 0;
+  for(const component &cmp: sim.network_components) {
+    if(cmp.component_name[1] == '_') {
+      if(cmp.component_name[0] == 'I') {
+        sim.inductors.states[inductor++] = states[state++];
+      } else {
+        sim.capacitors.states[capacitor++] = states[state++];
       }
+    }
+  }
+  store_reactive_states(sim, sim.inductors);
+  store_reactive_states(sim, sim.capacitors);
+}
 
-      if(sim.network_components[i].component_name[0] == 'V'){
-		
- 		int which_is_node0 = which_is_the_node(Vvector, sim.network_components[i].connected_terminals[0]);
-      	int which_is_node1 = which_is_the_node(Vvector, sim.network_components[i].connected_terminals[1]);
-
-      	double current_across_component = tell_currents(sim.network_components[i], Vvector, simulation_progress);
-		
-		sim.network_components[i].component_value[0] = (-current_across_component / sim.cl_values[sim.network_components[i].component_name])*timestep + sim.network_components[i].component_value[0];
-		independent_v_source equivalent_source(sim.network_components[i].component_name, sim.network_components[i].component_value[0], 0.0, 0.0, sim.network_components[i].connected_terminals);
-
-
-		sim.network_components[i] = equivalent_source;
- 
-		int which0  = which_is_the_node(sim.network_nodes, sim.network_components[i].connected_terminals[0]);
-		int which1  = which_is_the_node(sim.network_nodes, sim.network_components[i].connected_terminals[1]);
-		int node_cmp_idx1 = which_is_cmp1(sim.network_nodes[which0].connected_components, sim.network_components[i]);
-        sim.network_nodes[which0].connected_components[node_cmp_idx1] = equivalent_source;
-		
-        int node_cmp_idx2 = which_is_cmp1(sim.network_nodes[which1].connected_components, sim.network_components[i]);
-        sim.network_nodes[which1].connected_components[node_cmp_idx2] = equivalent_source;
-		
-		}
+// Forward Euler step of all C/L source equivalents: i_L += v_L/L*dt, v_C -= i_C/C*dt
+void update_source_equivalents(network_simulation &sim, const vector<node> &Vvector, const vector<double> &current_through_components, double simulation_progress, double timestep){
+  if(!sim.reactive_elements_built) {
+    build_reactive_elements(sim);
+  }
+
+  // Node voltages, ground is the last row
+  vector<double> voltages(Vvector.size() + 1, 0.0);
+  for(int row = 0; row < Vvector.size(); row++) {
+    voltages[row] = Vvector[row].node_voltage;
+  }
 
-	 }
+  reactive_elements &inductors = sim.inductors;
+  for(int k = 0; k < inductors.states.size(); k++) {
+    double voltage_across_component = voltages[inductors.rows0[k]] - voltages[inductors.rows1[k]];
+    inductors.states[k] = (voltage_across_component / inductors.values[k])*timestep + inductors.states[k];
+  }
 
+  reactive_elements &capacitors = sim.capacitors;
+  if(sim.state_rates.empty()) {
+    for(int k = 0; k < capacitors.states.size(); k++) {
+      capacitors.states[k] = (-current_through_components[capacitors.components[k]] / capacitors.values[k])*timestep + capacitors.states[k];
+    }
+  } else {
+    int phase = llround(simulation_progress / timestep) % sim.multirate_steps;
+    for(int k = 0; k < capacitors.states.size(); k++) {
+      int i = capacitors.components[k];
+      double current_across_component = current_through_components[i];
+      if(sim.state_rates[i] == 0) {
+        capacitors.states[k] = (-current_across_component / capacitors.values[k])*timestep + capacitors.states[k];
+        continue;
+      }
+      // Slow capacitor (multirate): one step of multirate_steps*timestep at the start of every macro step
+      if(phase == 0) {
+        sim.slow_start_values[i] = capacitors.states[k];
+        sim.slow_end_values[i] = (-current_across_component / capacitors.values[k])*timestep*sim.multirate_steps + sim.slow_start_values[i];
+      }
+      // Capacitors at the interface to fast blocks are interpolated over the macro step, the others jump at its end
+      if(sim.state_rates[i] == 2) {
+        capacitors.states[k] = sim.slow_start_values[i] + (sim.slow_end_values[i] - sim.slow_start_values[i]) * (phase+1) / sim.multirate_steps;
+      } else {
+        capacitors.states[k] = phase == sim.multirate_steps-1 ? sim.slow_end_values[i] : sim.slow_start_values[i];
+      }
+    }
   }
+
+  store_reactive_states(sim, inductors);
+  store_reactive_states(sim, capacitors);
 }
 
 
@@ -232,112 +300,38 @@ void convert_CLs_to_sources(network_simulation &sim){
 
 }
 
-//the following function is used to tell the currents through a V source
-//it calculates the current resulted from other components (not from the source itself) from connected_terminals[0] to connected_terminals[1]
-//output increases when current goes out of terminal[0] , output decreases when current goes out of terminal[1]
-double tell_currents(component input, vector<node> Vvector, double simulation_progress){
-	double output = 0.0;
-	//sum currents going out of terminal[0]
-	int which_is_node0 = which_is_the_node(Vvector, input.connected_terminals[0]);
-	int which_is_node1 = which_is_the_node(Vvector, input.connected_terminals[1]);
-	if(input.connected_terminals[1].index == 0){ // if input.connected_terminals[1] is not in Vvector, this is because Vvector doesn't contain the reference node.
-		for(int i = 0 ; i < Vvector[which_is_node0].connected_components.size() ; i++){
-
-			if(Vvector[which_is_node0].connected_components[i].component_name[0] == 'R'){
-				if(Vvector[which_is_node0].connected_components[i].connected_terminals[0] == Vvector[which_is_node0]){
-					output += calculate_current_through_R(Vvector[which_is_node0].connected_components[i], Vvector);
-				}
-				if(Vvector[which_is_node0].connected_components[i].connected_terminals[1] == Vvector[which_is_node0]){
-					output -= calculate_current_through_R(Vvector[which_is_node0].connected_components[i], Vvector);
-				}
-			}
-			if(Vvector[which_is_node0].connected_components[i].component_name[0] == 'I'){
-				if(Vvector[which_is_node0].connected_components[i].connected_terminals[0] == Vvector[which_is_node0]){
-					output += Vvector[which_is_node0].connected_components[i].component_value[0] + Vvector[which_is_node0].connected_components[i].component_value[1]*sin(2*M_PI*Vvector[which_is_node0].connected_components[i].component_value[2]*simulation_progress);
-				}
-				if(Vvector[which_is_node0].connected_components[i].connected_terminals[1] == Vvector[which_is_node0]){
-					output -= Vvector[which_is_node0].connected_components[i].component_value[0] + Vvector[which_is_node0].connected_components[i].component_value[1]*sin(2*M_PI*Vvector[which_is_node0].connected_components[i].component_value[2]*simulation_progress);
-				}
-			}
-		}
-
-	} else {
-		for(int c = 0; c< Vvector[which_is_node1].connected_components.size(); c++){
-			if(Vvector[which_is_node1].connected_components[c].component_name[0] == 'R'){
-				if(Vvector[which_is_node1].connected_components[c].connected_terminals[0] == Vvector[which_is_node1]){
-					output -= calculate_current_through_R(Vvector[which_is_node1].connected_components[c], Vvector);
-				}
-				if(Vvector[which_is_node1].connected_components[c].connected_terminals[1] == Vvector[which_is_node1]){
-					output += calculate_current_through_R(Vvector[which_is_node1].connected_components[c], Vvector);
-				}
-			}
-			if(Vvector[which_is_node1].connected_components[c].component_name[0] == 'I'){
-				if(Vvector[which_is_node1].connected_components[c].connected_terminals[0] == Vvector[which_is_node1]){
-					output -= Vvector[which_is_node1].connected_components[c].component_value[0] + Vvector[which_is_node1].connected_components[c].component_value[1]*sin(2*M_PI*Vvector[which_is_node1].connected_components[c].component_value[2]*simulation_progress);
-				}
-				if(Vvector[which_is_node1].connected_components[c].connected_terminals[1] == Vvector[which_is_node1]){
-					output += Vvector[which_is_node1].connected_components[c].component_value[0] + Vvector[which_is_node1].connected_components[c].component_value[1]*sin(2*M_PI*Vvector[which_is_node1].connected_components[c].component_value[2]*simulation_progress);
-				}
-			}
-
-		}
-	}
-
-	return output;
+double source_value(const component &source, double simulation_progress) {
+  return source.component_value[0] + source.component_value[1]*sin(2*M_PI*source.component_value[2]*simulation_progress);
 }
 
-
-double calculate_current_through_R(component R, vector<node> Vvector){
-	//the function calculates the current through R by using the node voltage difference across it divided by R value
-	// this function is written because nodes are recreated in Vvector when copying from the network_nodes of the network simulation class
-	double node0voltage = 0.0;
-	double node1voltage = 0.0;
-	double current_through_R;
-	for(node no: Vvector){
-		if(R.connected_terminals[0].index == no.index){
-			node0voltage = no.node_voltage;
-		}
-		if(R.connected_terminals[1].index == no.index){
-			node1voltage = no.node_voltage;
-		}
-	}
-	current_through_R = (node0voltage - node1voltage) / R.component_value[0];
-	return current_through_R;
-
-}
 //the following function should take the version of network_component, where all C and Ls are converted to sources.
 //the output of the function includes the current through all components from the input. The orders are matched.
-vector<double> calculate_current_through_component(vector<component> network_component, vector<node> Vvector, double simulation_progress){
+vector<double> calculate_current_through_component(const network_simulation &sim, const network_solver &solver, const VectorXd &solution, double simulation_progress){
 
-	vector<double> current_column;
+	vector<double> current_column(sim.network_components.size(), 0.0);
+	int unknown_voltages = solution.size() - solver.branch_components.size();
 
-	//go through all components
-	//treat different ones differently
-	for(int i = 0 ; i < network_component.size() ; i++){
+	for(int i = 0 ; i < sim.network_components.size() ; i++){
+		const component &cmp = sim.network_components[i];
 
-		// the current through a resistor is done by ( the node voltage at connected_terminals[0] - the node voltage at connected_terminals[1]) / resistor value.
-		// Also, the i sources connected to the connected_terminals of the resistor are taken into account.
-		// To keep it consistent, its always positive.
-		if(network_component[i].component_name[0] == 'R'){
-			double current_through_R = 0.0;
-			current_through_R = calculate_current_through_R(network_component[i], Vvector);
-			current_column.push_back(current_through_R);
+		// the current through a resistor is ( the node voltage at connected_terminals[0] - the node voltage at connected_terminals[1]) / resistor value.
+		if(cmp.component_name[0] == 'R'){
+			int row0 = solver.terminal_rows[2*i];
+			int row1 = solver.terminal_rows[2*i+1];
+			double voltage0 = row0 == -1 ? 0.0 : solution(row0);
+			double voltage1 = row1 == -1 ? 0.0 : solution(row1);
+			current_column[i] = (voltage0 - voltage1) / cmp.component_value[0];
 		}
 
-		// The current through V shows the current going through V from the positive side of the v source to the negative side of the v source
-		if(network_component[i].component_name[0] == 'V'){
-			double current_through_V = 0.0;
-			current_through_V = tell_currents(network_component[i],Vvector, simulation_progress);
-			current_column.push_back(current_through_V);
-		}
-
-		//The current through I shows the current going through I from the In side to the Out side.
-		if(network_component[i].component_name[0] == 'I'){
-			double current_through_I = 0.0;
-			current_through_I = network_component[i].component_value[0] + network_component[i].component_value[1]*sin(2*M_PI*network_component[i].component_value[2]*simulation_progress);
-			current_column.push_back(current_through_I);
+		//The current through I shows the current going through I from the In side to the Out side (for an inductor this is its state).
+		if(cmp.component_name[0] == 'I'){
+			current_column[i] = source_value(cmp, simulation_progress);
 		}
+	}
 
+	// The current through V is an unknown of the solution: the current it drives out of connected_terminals[0]
+	for(int k = 0 ; k < solver.branch_components.size() ; k++){
+		current_column[solver.branch_components[k]] = solution(unknown_voltages + k);
 	}
 	return current_column;
 
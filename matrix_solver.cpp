@@ -4,6 +4,1071 @@
 using namespace std;
 using namespace Eigen;
 
-int main(){
+// The conductance matrix is the same for every timestep, so it is assembled and factorised (or preconditioned) once.
+//
+// Nodes with a grounded voltage source have the row V_k = I_k. Their columns in the other rows are moved to the
+// right-hand side (I_i -= G_ik * V_k). For networks of resistors, capacitors (voltage source equivalents) and grounded
+// sources the remaining matrix is then symmetric positive definite, and Cholesky (LLT) replaces the general LU.
+//
+// The iterative solver is meant for very large resistive grids, where even a sparse factorisation does not fit into memory.
+// Symmetric systems are solved with conjugate gradient, everything else with BiCGSTAB.
 
-	
+static const int dense_solver_limit = 400; // larger systems are factorised as sparse matrices
+
+static bool is_symmetric(const SparseMatrix<double> &G) {
+  SparseMatrix<double> G_transposed = G.transpose();
+  return (G - G_transposed).norm() <= 1e-12 * G.norm();
+}
+
+// Assembles G and splits off the columns of the known nodes
+static void assemble_solver_matrix(network_solver &solver, const network_simulation &sim) {
+  SparseMatrix<double, RowMajor> G = create_G_sparse_matrix(sim);
+  G.prune(0.0);
+  int n = G.rows();
+
+  // A known row only has its diagonal entry
+  vector<bool> known(n, false);
+  solver.known_rows.clear();
+  for(int row = 0; row < n; row++) {
+    SparseMatrix<double, RowMajor>::InnerIterator entry(G, row);
+    if(G.row(row).nonZeros() == 1 && entry && entry.col() == row) {
+      known[row] = true;
+      solver.known_rows.push_back(row);
+    }
+  }
+
+  vector<Triplet<double>> remaining, moved;
+  for(int row = 0; row < n; row++) {
+    for(SparseMatrix<double, RowMajor>::InnerIterator entry(G, row); entry; ++entry) {
+      if(known[entry.col()] && entry.col() != row) {
+        moved.push_back(Triplet<double>(row, entry.col(), entry.value()));
+      } else {
+        remaining.push_back(Triplet<double>(row, entry.col(), entry.value()));
+      }
+    }
+  }
+  solver.G.resize(n, n);
+  solver.G.setFromTriplets(remaining.begin(), remaining.end());
+  solver.G.makeCompressed();
+  solver.known_columns.resize(n, n);
+  solver.known_columns.setFromTriplets(moved.begin(), moved.end());
+  solver.symmetric = is_symmetric(solver.G);
+
+  VectorXd row_sums = VectorXd::Zero(n);
+  for(int col = 0; col < solver.G.outerSize(); col++) {
+    for(SparseMatrix<double>::InnerIterator entry(solver.G, col); entry; ++entry) {
+      row_sums(entry.row()) += fabs(entry.value());
+    }
+  }
+  solver.G_norm = n > 0 ? row_sums.maxCoeff() : 0.0;
+}
+
+// Solver health.
+// Every solution is checked for NaN/Inf, and every solver_check_interval-th one also for its relative residual
+// |G x - I| / (|G| |x| + |I|). A backward stable solve keeps it near the machine epsilon, whatever the conditioning.
+// A failed check stops the run (solver_abort) instead of writing a waveform of garbage.
+
+static thread_local double last_residual = 0.0;
+
+double last_solve_residual() {
+  return last_residual;
+}
+
+// Only the first failure is printed
+static void report_solver_failure(network_solver &solver, const network_simulation &sim, string message) {
+  if(!solver.failure_reported) {
+    cout << (sim.solver_abort ? "[ERROR] " : "[WARNING] ") << message << endl;
+    solver.failure_reported = true;
+  }
+  solver.failed = solver.failed || sim.solver_abort;
+}
+
+// |R| / (|G| |V| + |I|) of the worst column, R = I - G*V
+static double relative_residual(const network_solver &solver, const MatrixXd &I, const MatrixXd &V, const MatrixXd &R) {
+  double residual = 0.0;
+  for(int col = 0; col < V.cols(); col++) {
+    double scale = solver.G_norm * V.col(col).lpNorm<Infinity>() + I.col(col).lpNorm<Infinity>();
+    if(scale > 0.0) {
+      residual = max(residual, R.col(col).lpNorm<Infinity>() / scale);
+    }
+  }
+  return residual;
+}
+
+// I is the reduced right-hand side, V the solution of G*V = I. The residual I - G*V is only computed for the checked solves.
+static void check_solution(network_solver &solver, const network_simulation &sim, const MatrixXd &I, const MatrixXd &V, const function<MatrixXd()> &residual_of) {
+  if(!sim.solver_checks) {
+    last_residual = 0.0;
+    return;
+  }
+  long solve_number;
+  {
+    lock_guard<mutex> lock(solver.telemetry_mutex);
+    solve_number = solver.total_solves++;
+  }
+  bool finite = V.allFinite();
+  bool checked = finite && sim.solver_check_interval > 0 && solve_number % sim.solver_check_interval == 0;
+  double residual = 0.0;
+  if(checked) {
+    residual = relative_residual(solver, I, V, residual_of());
+  }
+  last_residual = residual;
+
+  lock_guard<mutex> lock(solver.telemetry_mutex);
+  if(!finite) {
+    solver.nonfinite_solves++;
+    report_solver_failure(solver, sim, "Solver returned NaN/Inf, the conductance matrix is singular (floating node or source loop?)");
+    return;
+  }
+  if(checked) {
+    solver.checked_solves++;
+    bool exceeded = residual > sim.max_residual && solver.max_residual <= sim.max_residual;
+    solver.max_residual = max(solver.max_residual, residual);
+    if(exceeded) {
+      ostringstream message;
+      message << "Solver residual " << residual << " exceeds max_residual=" << sim.max_residual << ", the conductance matrix is ill-conditioned";
+      report_solver_failure(solver, sim, message.str());
+    }
+  }
+}
+
+static void check_solution(network_solver &solver, const network_simulation &sim, const MatrixXd &I, const MatrixXd &V) {
+  check_solution(solver, sim, I, V, [&]() { return MatrixXd(I - solver.G * V); });
+}
+
+// Right-hand sides (one per column) with the known node voltages moved over
+static MatrixXd reduced_rhs(const network_solver &solver, const MatrixXd &Imatrix) {
+  if(solver.known_rows.empty()) {
+    return Imatrix;
+  }
+  MatrixXd known_voltages = MatrixXd::Zero(Imatrix.rows(), Imatrix.cols());
+  for(int row: solver.known_rows) {
+    known_voltages.row(row) = Imatrix.row(row) / solver.G.coeff(row, row);
+  }
+  return Imatrix - solver.known_columns * known_voltages;
+}
+
+void prepare_iterative_solver(network_solver &solver, const network_simulation &sim) {
+  assemble_solver_matrix(solver, sim);
+  solver.previous_solution = VectorXd::Zero(solver.G.rows());
+  solver.total_iterations = 0;
+  solver.unconverged_solves = 0;
+
+  // Incomplete Cholesky is the symmetric counterpart of ILU; it breaks down if the matrix is not positive definite
+  if(solver.symmetric && sim.preconditioner != "jacobi") {
+    solver.cg_ic.setTolerance(sim.solver_tolerance);
+    solver.cg_ic.setMaxIterations(sim.solver_max_iterations);
+    solver.cg_ic.compute(solver.G);
+    if(solver.cg_ic.info() == Success) {
+      solver.method = "cg_ic";
+      return;
+    }
+    cout << "[WARNING] Incomplete Cholesky failed, using BiCGSTAB with ILU instead" << endl;
+  }
+
+  if(solver.symmetric && sim.preconditioner == "jacobi") {
+    solver.cg_jacobi.setTolerance(sim.solver_tolerance);
+    solver.cg_jacobi.setMaxIterations(sim.solver_max_iterations);
+    solver.cg_jacobi.compute(solver.G);
+    solver.method = "cg_jacobi";
+    return;
+  }
+
+  if(sim.preconditioner != "jacobi") {
+    solver.bicgstab_ilu.setTolerance(sim.solver_tolerance);
+    solver.bicgstab_ilu.setMaxIterations(sim.solver_max_iterations);
+    solver.bicgstab_ilu.compute(solver.G);
+    if(solver.bicgstab_ilu.info() == Success) {
+      solver.method = "bicgstab_ilu";
+      return;
+    }
+    cout << "[WARNING] ILU preconditioner could not be computed, using BiCGSTAB with the Jacobi preconditioner instead" << endl;
+  }
+
+  solver.bicgstab_jacobi.setTolerance(sim.solver_tolerance);
+  solver.bicgstab_jacobi.setMaxIterations(sim.solver_max_iterations);
+  solver.bicgstab_jacobi.compute(solver.G);
+  solver.method = "bicgstab_jacobi";
+}
+
+MatrixXd solve_iterative(network_solver &solver, const network_simulation &sim, const MatrixXd &Imatrix) {
+  VectorXd I = reduced_rhs(solver, Imatrix);
+  VectorXd V;
+  ComputationInfo info;
+  long iterations;
+
+  // Consecutive timesteps have very similar solutions, so the last one is used as the initial guess
+  if(solver.method == "cg_ic") {
+    V = solver.cg_ic.solveWithGuess(I, solver.previous_solution);
+    info = solver.cg_ic.info();
+    iterations = solver.cg_ic.iterations();
+  } else if(solver.method == "cg_jacobi") {
+    V = solver.cg_jacobi.solveWithGuess(I, solver.previous_solution);
+    info = solver.cg_jacobi.info();
+    iterations = solver.cg_jacobi.iterations();
+  } else if(solver.method == "bicgstab_jacobi") {
+    V = solver.bicgstab_jacobi.solveWithGuess(I, solver.previous_solution);
+    info = solver.bicgstab_jacobi.info();
+    iterations = solver.bicgstab_jacobi.iterations();
+  } else {
+    V = solver.bicgstab_ilu.solveWithGuess(I, solver.previous_solution);
+    info = solver.bicgstab_ilu.info();
+    iterations = solver.bicgstab_ilu.iterations();
+  }
+
+  // Reported once, the number of such timesteps is printed with the solver summary
+  if(info != Success && solver.unconverged_solves++ == 0) {
+    cout << "[WARNING] Iterative solver did not converge within " << sim.solver_max_iterations << " iterations" << endl;
+  }
+
+  solver.total_iterations += iterations;
+  solver.previous_solution = V;
+  check_solution(solver, sim, I, V);
+  return V;
+}
+
+
+// Small circuits (a handful of unknowns) are dominated by heap allocation and dynamic-size dispatch in Eigen.
+// For those the system is copied into fixed-size matrices, so the LU is stored inline and its loops are unrolled.
+// The factorisation is computed once by prepare_network_solver, every timestep only substitutes.
+template<int N>
+class fixed_size_lu_of: public fixed_size_lu {
+  public:
+    PartialPivLU<Matrix<double,N,N>> lu;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    fixed_size_lu_of(const MatrixXd &Gmatrix): lu(Matrix<double,N,N>(Gmatrix)) {}
+
+    MatrixXd solve(const MatrixXd &Imatrix) const {
+      if(Imatrix.cols() > 1) {
+        return lu.solve(Imatrix);
+      }
+      Matrix<double,N,1> I = Imatrix.col(0);
+      Matrix<double,N,1> V = lu.solve(I);
+      return V;
+    }
+};
+
+template<int N>
+static fixed_size_lu *factorise_fixed_size(const MatrixXd &Gmatrix) {
+  return new fixed_size_lu_of<N>(Gmatrix);
+}
+
+typedef fixed_size_lu *(*fixed_size_factoriser)(const MatrixXd &);
+
+// Index = number of unknowns. All sizes are instantiated at compile time.
+static const int max_fixed_size = 16;
+static const fixed_size_factoriser fixed_size_factorisers[max_fixed_size+1] = {
+  nullptr,
+  &factorise_fixed_size<1>, &factorise_fixed_size<2>, &factorise_fixed_size<3>, &factorise_fixed_size<4>,
+  &factorise_fixed_size<5>, &factorise_fixed_size<6>, &factorise_fixed_size<7>, &factorise_fixed_size<8>,
+  &factorise_fixed_size<9>, &factorise_fixed_size<10>, &factorise_fixed_size<11>, &factorise_fixed_size<12>,
+  &factorise_fixed_size<13>, &factorise_fixed_size<14>, &factorise_fixed_size<15>, &factorise_fixed_size<16>
+};
+
+MatrixXd solve_direct(const MatrixXd &Gmatrix, const MatrixXd &Imatrix) {
+  int unknowns = Gmatrix.rows();
+  if(unknowns > 0 && unknowns <= max_fixed_size) {
+    unique_ptr<fixed_size_lu> lu(fixed_size_factorisers[unknowns](Gmatrix));
+    return lu->solve(Imatrix);
+  }
+  MatrixXd G_inverse = Gmatrix.inverse();
+  return G_inverse * Imatrix;
+}
+
+// Right-hand side injection.
+// The right-hand side is linear in the source values, so its assembly is recorded once as a matrix, one column per source.
+// The columns are found by assembling I with some sources at 1 and all others at 0. A source only enters the rows of its
+// terminals and of their supernode partners (nodes across a voltage source), so sources whose rows don't overlap are
+// probed together in the same assembly and a circuit takes a handful of assemblies, not one per source.
+
+void prepare_source_injection(network_solver &solver, const network_simulation &sim) {
+  network_simulation probe = sim;
+  vector<node> Vvector = create_v_matrix(sim);
+  map<int,int> row_of_node;
+  for(int row = 0; row < Vvector.size(); row++) {
+    row_of_node[Vvector[row].index] = row;
+  }
+  // Nodes across a voltage source from every node
+  map<int, vector<int>> partners;
+  for(const component &cmp: sim.network_components) {
+    if(cmp.component_name[0] == 'V') {
+      partners[cmp.connected_terminals[0].index].push_back(cmp.connected_terminals[1].index);
+      partners[cmp.connected_terminals[1].index].push_back(cmp.connected_terminals[0].index);
+    }
+  }
+
+  solver.injected_sources.clear();
+  vector<vector<int>> owners; // per probe, the source that may enter each row (-1 none)
+  vector<vector<int>> probes;
+  for(int c = 0; c < probe.network_components.size(); c++) {
+    const component &cmp = probe.network_components[c];
+    if(cmp.component_name[0] != 'V' && cmp.component_name[0] != 'I') {
+      continue;
+    }
+    int s = solver.injected_sources.size();
+    solver.injected_sources.push_back(c);
+    set_source_values(probe, c, {0.0, 0.0, 0.0});
+
+    set<int> rows;
+    for(const node &terminal: cmp.connected_terminals) {
+      if(terminal.index == 0) {
+        continue; // ground has no row, its partners are only affected by their own sources
+      }
+      for(int index: partners[terminal.index]) {
+        if(row_of_node.count(index)) { rows.insert(row_of_node[index]); }
+      }
+      if(row_of_node.count(terminal.index)) { rows.insert(row_of_node[terminal.index]); }
+    }
+    int p = 0;
+    while(p < probes.size() && any_of(rows.begin(), rows.end(), [&](int row) { return owners[p][row] != -1; })) {
+      p++;
+    }
+    if(p == probes.size()) {
+      probes.emplace_back();
+      owners.emplace_back(Vvector.size(), -1);
+    }
+    probes[p].push_back(c);
+    for(int row: rows) {
+      owners[p][row] = s;
+    }
+  }
+
+  vector<Triplet<double>> entries;
+  for(int p = 0; p < probes.size(); p++) {
+    for(int c: probes[p]) {
+      set_source_values(probe, c, {1.0, 0.0, 0.0});
+    }
+    MatrixXd column = create_i_matrix(probe, 0.0);
+    for(int row = 0; row < column.rows(); row++) {
+      if(column(row, 0) != 0.0 && owners[p][row] != -1) {
+        entries.push_back(Triplet<double>(row, owners[p][row], column(row, 0)));
+      }
+    }
+    for(int c: probes[p]) {
+      set_source_values(probe, c, {0.0, 0.0, 0.0});
+    }
+  }
+  solver.source_injection.resize(Vvector.size(), solver.injected_sources.size());
+  solver.source_injection.setFromTriplets(entries.begin(), entries.end());
+}
+
+// Latency.
+// The unknowns are split into the connected components of G (with the known columns moved out, nodes with a grounded
+// capacitor or source are blocks of their own). Every block is factorised separately. Its right-hand side depends only
+// on the V/I sources (including C/L equivalents) at its nodes and at the known nodes it is coupled to. While none of these
+// changes by more than latency_tolerance times the largest source of the same kind, the block keeps its last solution
+// and neither its rows of I are assembled nor is it solved.
+
+static int find_block_root(vector<int> &parent, int row) {
+  while(parent[row] != row) {
+    parent[row] = parent[parent[row]];
+    row = parent[row];
+  }
+  return row;
+}
+
+static void prepare_latency_blocks(network_solver &solver, const network_simulation &sim) {
+  int n = solver.G.rows();
+  vector<int> parent(n);
+  for(int row = 0; row < n; row++) {
+    parent[row] = row;
+  }
+  for(int col = 0; col < solver.G.outerSize(); col++) {
+    for(SparseMatrix<double>::InnerIterator entry(solver.G, col); entry; ++entry) {
+      parent[find_block_root(parent, entry.row())] = find_block_root(parent, col);
+    }
+  }
+
+  // Rows of every block, blocks of known rows first
+  vector<bool> known(n, false);
+  for(int row: solver.known_rows) {
+    known[row] = true;
+  }
+  map<int, vector<int>> rows_of_root;
+  for(int row = 0; row < n; row++) {
+    rows_of_root[find_block_root(parent, row)].push_back(row);
+  }
+  vector<vector<int>> block_rows;
+  for(bool known_blocks: {true, false}) {
+    for(auto &block: rows_of_root) {
+      if(known[block.second[0]] == known_blocks) {
+        block_rows.push_back(block.second);
+      }
+    }
+  }
+
+  // Sources at every node
+  vector<node> Vvector = create_v_matrix(sim);
+  map<int, vector<int>> sources_at_node;
+  for(int c = 0; c < sim.network_components.size(); c++) {
+    const component &cmp = sim.network_components[c];
+    if(cmp.component_name[0] == 'V' || cmp.component_name[0] == 'I') {
+      sources_at_node[cmp.connected_terminals[0].index].push_back(c);
+      sources_at_node[cmp.connected_terminals[1].index].push_back(c);
+    }
+  }
+
+  // Right-hand side rows of every block, from the injection matrix of the whole circuit
+  prepare_source_injection(solver, sim);
+  map<int,int> injection_column;
+  for(int s = 0; s < solver.injected_sources.size(); s++) {
+    injection_column[solver.injected_sources[s]] = s;
+  }
+  SparseMatrix<double, RowMajor> injection_rows = solver.source_injection;
+
+  SparseMatrix<double, RowMajor> G_rows = solver.G;
+  SparseMatrix<double, RowMajor> known_column_rows = solver.known_columns;
+  solver.blocks.clear();
+  for(const vector<int> &rows: block_rows) {
+    solver.blocks.emplace_back();
+    solver_block &block = solver.blocks.back();
+    block.rows = rows;
+
+    map<int,int> position;
+    for(int r = 0; r < rows.size(); r++) {
+      position[rows[r]] = r;
+    }
+    vector<Triplet<double>> entries, couplings;
+    set<int> input_rows(rows.begin(), rows.end());
+    set<int> sources;
+    for(int r = 0; r < rows.size(); r++) {
+      for(SparseMatrix<double, RowMajor>::InnerIterator entry(G_rows, rows[r]); entry; ++entry) {
+        entries.push_back(Triplet<double>(r, position[entry.col()], entry.value()));
+      }
+      for(SparseMatrix<double, RowMajor>::InnerIterator entry(known_column_rows, rows[r]); entry; ++entry) {
+        couplings.push_back(Triplet<double>(r, entry.col(), entry.value()));
+        input_rows.insert(entry.col());
+      }
+      for(SparseMatrix<double, RowMajor>::InnerIterator entry(injection_rows, rows[r]); entry; ++entry) {
+        sources.insert(solver.injected_sources[entry.col()]);
+      }
+    }
+    block.G.resize(rows.size(), rows.size());
+    block.G.setFromTriplets(entries.begin(), entries.end());
+    block.known_columns.resize(rows.size(), n);
+    block.known_columns.setFromTriplets(couplings.begin(), couplings.end());
+
+    for(int row: input_rows) {
+      for(int c: sources_at_node[Vvector[row].index]) {
+        sources.insert(c);
+      }
+    }
+    block.sources.assign(sources.begin(), sources.end());
+    map<int,int> source_position;
+    for(int s = 0; s < block.sources.size(); s++) {
+      block.source_columns.push_back(injection_column[block.sources[s]]);
+      source_position[block.source_columns[s]] = s;
+    }
+    vector<Triplet<double>> injections;
+    for(int r = 0; r < rows.size(); r++) {
+      for(SparseMatrix<double, RowMajor>::InnerIterator entry(injection_rows, rows[r]); entry; ++entry) {
+        injections.push_back(Triplet<double>(r, source_position[entry.col()], entry.value()));
+      }
+    }
+    block.injection.resize(rows.size(), block.sources.size());
+    block.injection.setFromTriplets(injections.begin(), injections.end());
+
+    block.use_llt = false;
+    if(solver.symmetric) {
+      block.llt.compute(block.G);
+      block.use_llt = block.llt.info() == Success;
+    }
+    if(!block.use_llt) {
+      block.lu.analyzePattern(block.G);
+      block.lu.factorize(block.G);
+      if(block.lu.info() != Success) {
+        cout << "[ERROR] Conductance matrix is singular: " << block.lu.lastErrorMessage() << endl;
+      }
+    }
+  }
+
+  solver.block_solution = VectorXd::Zero(n);
+  solver.block_solves = 0;
+  solver.skipped_block_solves = 0;
+  solver.method = "latency_blocks";
+}
+
+MatrixXd solve_latency_blocks(network_solver &solver, const network_simulation &sim, double simulation_progress) {
+  // Signal levels of the whole circuit, the tolerance is relative to them
+  double voltage_scale = 0.0, current_scale = 0.0;
+  VectorXd values(solver.injected_sources.size());
+  for(int s = 0; s < solver.injected_sources.size(); s++) {
+    const component &cmp = sim.network_components[solver.injected_sources[s]];
+    values(s) = source_value(cmp, simulation_progress);
+    double &scale = cmp.component_name[0] == 'V' ? voltage_scale : current_scale;
+    scale = max(scale, fabs(values(s)));
+  }
+
+  // Blocks whose sources moved are assembled from their own sources and solved, known rows first as their voltages are
+  // used by the blocks coupled to them. A latent block only costs the comparison of its sources.
+  vector<double> active_rhs, active_solution, active_residual;
+  for(int b = 0; b < solver.blocks.size(); b++) {
+    solver_block &block = solver.blocks[b];
+    bool changed = !block.solved;
+    for(int s = 0; s < block.sources.size() && !changed; s++) {
+      double scale = sim.network_components[block.sources[s]].component_name[0] == 'V' ? voltage_scale : current_scale;
+      changed = fabs(values(block.source_columns[s]) - block.solved_inputs[s]) > sim.latency_tolerance * scale;
+    }
+    if(!changed) {
+      solver.skipped_block_solves++;
+      continue;
+    }
+
+    VectorXd inputs(block.sources.size());
+    for(int s = 0; s < block.sources.size(); s++) {
+      inputs(s) = values(block.source_columns[s]);
+    }
+    VectorXd rhs = block.injection * inputs;
+    if(block.known_columns.nonZeros() > 0) {
+      rhs -= block.known_columns * solver.block_solution;
+    }
+    VectorXd V = block.use_llt ? VectorXd(block.llt.solve(rhs)) : VectorXd(block.lu.solve(rhs));
+    VectorXd residual = rhs - block.G * V;
+    for(int r = 0; r < block.rows.size(); r++) {
+      solver.block_solution(block.rows[r]) = V(r);
+      active_rhs.push_back(rhs(r));
+      active_solution.push_back(V(r));
+      active_residual.push_back(residual(r));
+    }
+
+    block.solved = true;
+    block.solved_inputs.assign(inputs.data(), inputs.data() + inputs.size());
+    solver.block_solves++;
+  }
+  if(active_solution.empty()) {
+    return solver.block_solution;
+  }
+  // Latent blocks keep both their solution and their right-hand side, so only the rows solved now are checked
+  Map<VectorXd> I(active_rhs.data(), active_rhs.size()), V(active_solution.data(), active_solution.size());
+  Map<VectorXd> R(active_residual.data(), active_residual.size());
+  check_solution(solver, sim, I, V, [&]() { return MatrixXd(R); });
+  return solver.block_solution;
+}
+
+// Fill-reducing ordering of the sparse G: AMD (symmetric permutation P G P^T) for Cholesky and LDLT, COLAMD (column
+// permutation G Q) for LU. It only depends on the circuit graph, so it is taken from the ordering cache when the same
+// topology was ordered before; the symbolic analysis of the permuted matrix is then only an elimination tree.
+static void prepare_sparse_ordering(network_solver &solver, const network_simulation &sim, string method) {
+  uint64_t topology_hash = hash_circuit_topology(sim);
+  vector<int> indices;
+  solver.ordering_from_cache = find_cached_ordering(sim.ordering_cache_file, topology_hash, method, solver.G.rows(), indices);
+  if(!solver.ordering_from_cache) {
+    PermutationMatrix<Dynamic, Dynamic, int> permutation;
+    if(method == "amd") {
+      AMDOrdering<int>()(solver.G, permutation);
+    } else {
+      COLAMDOrdering<int>()(solver.G, permutation);
+    }
+    // Eigen's orderings give the inverse of the permutation that is applied to the matrix
+    PermutationMatrix<Dynamic, Dynamic, int> inverse = permutation.inverse();
+    indices.assign(inverse.indices().data(), inverse.indices().data() + inverse.indices().size());
+    store_cached_ordering(sim.ordering_cache_file, topology_hash, method, indices);
+  }
+  solver.ordering.resize(indices.size());
+  for(int i = 0; i < indices.size(); i++) {
+    solver.ordering.indices()(i) = indices[i];
+  }
+}
+
+static void factorise_direct_solver(network_solver &solver, const network_simulation &sim) {
+  if(sim.latency_tolerance > 0.0 || sim.multirate_steps > 1) {
+    prepare_latency_blocks(solver, sim);
+    return;
+  }
+  int unknowns = solver.G.rows();
+  bool dense = unknowns <= dense_solver_limit;
+  if(dense) {
+    solver.G_dense = MatrixXd(solver.G);
+  }
+
+  if(unknowns <= max_fixed_size) {
+    solver.method = "fixed_size";
+    if(unknowns > 0) {
+      solver.fixed_lu.reset(fixed_size_factorisers[unknowns](solver.G_dense));
+    }
+    return;
+  }
+
+  if(solver.symmetric) {
+    // Cholesky fails if the matrix is not positive definite, LDLT still works for semidefinite matrices
+    if(dense) {
+      solver.dense_llt.compute(solver.G_dense);
+      if(solver.dense_llt.info() == Success) {
+        solver.method = "dense_llt";
+        return;
+      }
+      solver.dense_ldlt.compute(solver.G_dense);
+      if(solver.dense_ldlt.info() == Success && solver.dense_ldlt.isPositive()) {
+        solver.method = "dense_ldlt";
+        return;
+      }
+    } else {
+      prepare_sparse_ordering(solver, sim, "amd");
+      SparseMatrix<double> G_ordered = solver.ordering * solver.G * solver.ordering.transpose();
+      solver.sparse_llt.compute(G_ordered);
+      if(solver.sparse_llt.info() == Success) {
+        solver.method = "sparse_llt";
+        return;
+      }
+      solver.sparse_ldlt.compute(G_ordered);
+      if(solver.sparse_ldlt.info() == Success && solver.sparse_ldlt.vectorD().minCoeff() > 0.0) {
+        solver.method = "sparse_ldlt";
+        return;
+      }
+    }
+  }
+
+  if(dense) {
+    solver.dense_lu.compute(solver.G_dense);
+    solver.method = "dense_lu";
+  } else {
+    prepare_sparse_ordering(solver, sim, "colamd");
+    SparseMatrix<double> G_ordered = solver.G * solver.ordering;
+    G_ordered.makeCompressed();
+    solver.sparse_lu.analyzePattern(G_ordered);
+    solver.sparse_lu.factorize(G_ordered);
+    solver.method = "sparse_lu";
+    if(solver.sparse_lu.info() != Success) {
+      cout << "[ERROR] Conductance matrix is singular: " << solver.sparse_lu.lastErrorMessage() << endl;
+    }
+  }
+}
+
+// Mixed precision.
+// G is factorised in single precision: half the memory, and twice the values per SIMD instruction in the substitutions.
+// The solution is then refined, V += solve(I - G*V), with the residual in double and the correction from the float
+// factorisation. Each step gains the digits of single precision that are not lost to the conditioning of G, so a few steps
+// reach the accuracy of a double factorisation. When a step does not halve the residual (cond(G) close to 1e7), G is
+// factorised in double once, and this and all later solves use it.
+// Circuits solved with the fixed-size LU or the latency blocks always stay in double.
+
+static const int max_refinement_steps = 10;
+static const double refinement_tolerance = 1e-15; // relative residual of a double factorisation
+static const double refinement_floor = 1e-13; // a stalled refinement below this has reached the rounding of the residual
+
+static void factorise_single_precision(network_solver &solver, const network_simulation &sim) {
+  solver.mixed_precision = true;
+  solver.double_factorised = false;
+  solver.refinement_steps = 0;
+  if(solver.G.rows() <= dense_solver_limit) {
+    MatrixXf G_float = MatrixXd(solver.G).cast<float>();
+    if(solver.symmetric) {
+      solver.dense_llt_float.compute(G_float);
+      if(solver.dense_llt_float.info() == Success) {
+        solver.method = "dense_llt";
+        return;
+      }
+    }
+    solver.dense_lu_float.compute(G_float);
+    solver.method = "dense_lu";
+    return;
+  }
+
+  if(solver.symmetric) {
+    prepare_sparse_ordering(solver, sim, "amd");
+    SparseMatrix<double> G_ordered = solver.ordering * solver.G * solver.ordering.transpose();
+    solver.sparse_llt_float.compute(G_ordered.cast<float>());
+    if(solver.sparse_llt_float.info() == Success) {
+      solver.method = "sparse_llt";
+      return;
+    }
+  }
+  prepare_sparse_ordering(solver, sim, "colamd");
+  SparseMatrix<double> G_ordered = solver.G * solver.ordering;
+  SparseMatrix<float> G_float = G_ordered.cast<float>();
+  G_float.makeCompressed();
+  solver.sparse_lu_float.analyzePattern(G_float);
+  solver.sparse_lu_float.factorize(G_float);
+  solver.method = "sparse_lu";
+  if(solver.sparse_lu_float.info() != Success) {
+    cout << "[ERROR] Conductance matrix is singular: " << solver.sparse_lu_float.lastErrorMessage() << endl;
+  }
+}
+
+// The fallback: the same method in double precision
+static void factorise_double_precision(network_solver &solver) {
+  if(solver.method == "dense_llt") {
+    solver.dense_llt.compute(MatrixXd(solver.G));
+  } else if(solver.method == "dense_lu") {
+    solver.dense_lu.compute(MatrixXd(solver.G));
+  } else if(solver.method == "sparse_llt") {
+    SparseMatrix<double> G_ordered = solver.ordering * solver.G * solver.ordering.transpose();
+    solver.sparse_llt.compute(G_ordered);
+  } else {
+    SparseMatrix<double> G_ordered = solver.G * solver.ordering;
+    G_ordered.makeCompressed();
+    solver.sparse_lu.analyzePattern(G_ordered);
+    solver.sparse_lu.factorize(G_ordered);
+  }
+}
+
+static MatrixXd solve_single_precision(const network_solver &solver, const MatrixXd &I) {
+  if(solver.method == "dense_llt") {
+    return solver.dense_llt_float.solve(I.cast<float>()).cast<double>();
+  }
+  if(solver.method == "dense_lu") {
+    return solver.dense_lu_float.solve(I.cast<float>()).cast<double>();
+  }
+  if(solver.method == "sparse_llt") {
+    MatrixXf ordered = (solver.ordering * I).cast<float>();
+    MatrixXf V = solver.sparse_llt_float.solve(ordered);
+    return solver.ordering.transpose() * V.cast<double>();
+  }
+  MatrixXf V = solver.sparse_lu_float.solve(I.cast<float>());
+  return solver.ordering * V.cast<double>();
+}
+
+// Solves G*V = I (I already reduced) with the factorisation
+static MatrixXd solve_factorised(const network_solver &solver, const MatrixXd &I) {
+  if(solver.mixed_precision && !solver.double_factorised) {
+    return solve_single_precision(solver, I);
+  }
+  if(solver.method == "fixed_size") {
+    return solver.fixed_lu ? solver.fixed_lu->solve(I) : I;
+  }
+  if(solver.method == "dense_llt") {
+    return solver.dense_llt.solve(I);
+  }
+  if(solver.method == "dense_ldlt") {
+    return solver.dense_ldlt.solve(I);
+  }
+  if(solver.method == "dense_lu") {
+    return solver.dense_lu.solve(I);
+  }
+  if(solver.method == "sparse_llt") {
+    return solver.ordering.transpose() * MatrixXd(solver.sparse_llt.solve(solver.ordering * I));
+  }
+  if(solver.method == "sparse_ldlt") {
+    return solver.ordering.transpose() * MatrixXd(solver.sparse_ldlt.solve(solver.ordering * I));
+  }
+  return solver.ordering * MatrixXd(solver.sparse_lu.solve(I));
+}
+
+// Solves G^T*V = I, G = L U Q^T => G^T = Q U^T L^T. G is symmetric for all other methods.
+static VectorXd solve_factorised_transposed(network_solver &solver, const VectorXd &I) {
+  if(solver.mixed_precision && !solver.double_factorised && solver.method == "sparse_lu") {
+    VectorXf V = solver.sparse_lu_float.transpose().solve((solver.ordering.transpose() * I).cast<float>());
+    return V.cast<double>();
+  }
+  if(solver.mixed_precision && !solver.double_factorised && solver.method == "dense_lu") {
+    VectorXf I_float = I.cast<float>();
+    VectorXf V = solver.dense_lu_float.transpose().solve(I_float);
+    return V.cast<double>();
+  }
+  if(solver.method == "sparse_lu") {
+    return solver.sparse_lu.transpose().solve(solver.ordering.transpose() * I);
+  }
+  if(solver.method == "dense_lu") {
+    return solver.dense_lu.transpose().solve(I);
+  }
+  return solve_factorised(solver, I);
+}
+
+// Hager's estimate of the 1-norm of G^-1: a few solves with G and G^T instead of the inverse
+static double estimate_inverse_norm(network_solver &solver) {
+  int n = solver.G.rows();
+  VectorXd x = VectorXd::Constant(n, 1.0/n);
+  double estimate = 0.0;
+  for(int iteration = 0; iteration < 5; iteration++) {
+    VectorXd y = solve_factorised(solver, x);
+    estimate = y.lpNorm<1>();
+    VectorXd signs = y.unaryExpr([](double value) { return value >= 0.0 ? 1.0 : -1.0; });
+    VectorXd z = solve_factorised_transposed(solver, signs);
+    int largest;
+    if(z.cwiseAbs().maxCoeff(&largest) <= z.dot(x)) {
+      break;
+    }
+    x.setZero();
+    x(largest) = 1.0;
+  }
+  return estimate;
+}
+
+// Condition estimate and pivot growth of the factorisation, singular matrices are reported before the first timestep
+static void measure_factorisation(network_solver &solver, const network_simulation &sim) {
+  solver.rcond = -1.0;
+  solver.pivot_growth = -1.0;
+  if(solver.method == "latency_blocks" || solver.G.rows() == 0) {
+    return;
+  }
+  double largest_entry = solver.G.coeffs().cwiseAbs().maxCoeff();
+  bool estimate_rcond = false;
+  if(solver.mixed_precision) {
+    // From the float factorisation, which is accurate enough for a condition number
+    estimate_rcond = true;
+    if(solver.method == "dense_llt") {
+      solver.pivot_growth = solver.dense_llt_float.matrixLLT().diagonal().cwiseAbs2().maxCoeff() / largest_entry;
+    } else if(solver.method == "dense_lu") {
+      solver.pivot_growth = solver.dense_lu_float.matrixLU().triangularView<Upper>().toDenseMatrix().cwiseAbs().maxCoeff() / largest_entry;
+    } else if(solver.method == "sparse_llt") {
+      SparseMatrix<float> L = solver.sparse_llt_float.matrixL();
+      solver.pivot_growth = L.diagonal().cwiseAbs2().maxCoeff() / largest_entry;
+    }
+  } else if(solver.method == "fixed_size") {
+    PartialPivLU<MatrixXd> lu(solver.G_dense);
+    // Eigen's estimator does not see an exactly zero pivot
+    solver.rcond = lu.matrixLU().diagonal().cwiseAbs().minCoeff() == 0.0 ? 0.0 : lu.rcond();
+    solver.pivot_growth = lu.matrixLU().triangularView<Upper>().toDenseMatrix().cwiseAbs().maxCoeff() / largest_entry;
+  } else if(solver.method == "dense_lu") {
+    solver.rcond = solver.dense_lu.matrixLU().diagonal().cwiseAbs().minCoeff() == 0.0 ? 0.0 : solver.dense_lu.rcond();
+    solver.pivot_growth = solver.dense_lu.matrixLU().triangularView<Upper>().toDenseMatrix().cwiseAbs().maxCoeff() / largest_entry;
+  } else if(solver.method == "dense_llt") {
+    solver.rcond = solver.dense_llt.rcond();
+    solver.pivot_growth = solver.dense_llt.matrixLLT().diagonal().cwiseAbs2().maxCoeff() / largest_entry;
+  } else if(solver.method == "dense_ldlt") {
+    solver.rcond = solver.dense_ldlt.rcond();
+    solver.pivot_growth = solver.dense_ldlt.vectorD().cwiseAbs().maxCoeff() / largest_entry;
+  } else {
+    // The sparse factorisations have no estimator of their own
+    estimate_rcond = true;
+    if(solver.method == "sparse_llt") {
+      SparseMatrix<double> L = solver.sparse_llt.matrixL();
+      solver.pivot_growth = L.diagonal().cwiseAbs2().maxCoeff() / largest_entry;
+    } else if(solver.method == "sparse_ldlt") {
+      solver.pivot_growth = solver.sparse_ldlt.vectorD().cwiseAbs().maxCoeff() / largest_entry;
+    }
+  }
+  if(estimate_rcond) {
+    double G_1norm = 0.0;
+    for(int col = 0; col < solver.G.outerSize(); col++) {
+      double column_sum = 0.0;
+      for(SparseMatrix<double>::InnerIterator entry(solver.G, col); entry; ++entry) {
+        column_sum += fabs(entry.value());
+      }
+      G_1norm = max(G_1norm, column_sum);
+    }
+    double inverse_norm = estimate_inverse_norm(solver);
+    solver.rcond = isfinite(inverse_norm) && inverse_norm > 0.0 ? 1.0 / (G_1norm * inverse_norm) : 0.0;
+  }
+
+  if(!(solver.rcond >= 1e-15)) {
+    ostringstream message;
+    message << "Conductance matrix is singular to working precision (rcond=" << solver.rcond << "), check for floating nodes";
+    report_solver_failure(solver, sim, message.str());
+  }
+}
+
+void prepare_direct_solver(network_solver &solver, const network_simulation &sim) {
+  assemble_solver_matrix(solver, sim);
+  solver.mixed_precision = false;
+  bool blocks = sim.latency_tolerance > 0.0 || sim.multirate_steps > 1;
+  if(sim.precision == "mixed" && !blocks && solver.G.rows() > max_fixed_size) {
+    factorise_single_precision(solver, sim);
+  } else {
+    factorise_direct_solver(solver, sim);
+  }
+  measure_factorisation(solver, sim);
+}
+
+// Iterative refinement of a solution from the float factorisation, see factorise_single_precision
+static MatrixXd refine_solution(network_solver &solver, const MatrixXd &I, MatrixXd V) {
+  double previous_residual = numeric_limits<double>::infinity();
+  for(int step = 0; step < max_refinement_steps; step++) {
+    MatrixXd R = I - solver.G * V;
+    double residual = relative_residual(solver, I, V, R);
+    if(residual <= refinement_tolerance) {
+      return V;
+    }
+    if(!(residual < 0.5 * previous_residual)) {
+      if(residual <= refinement_floor) {
+        return V;
+      }
+      break;
+    }
+    previous_residual = residual;
+    V += solve_factorised(solver, R);
+    solver.refinement_steps++;
+  }
+
+  {
+    lock_guard<mutex> lock(solver.telemetry_mutex);
+    if(!solver.double_factorised) {
+      cout << "[WARNING] Mixed precision refinement does not converge, the conductance matrix is factorised in double precision" << endl;
+      factorise_double_precision(solver);
+      solver.double_factorised = true;
+    }
+  }
+  return solve_factorised(solver, I);
+}
+
+MatrixXd solve_prepared_direct(network_solver &solver, const network_simulation &sim, const MatrixXd &Imatrix) {
+  // Several right-hand sides (stimulus variants) share one factorisation and are substituted as one block
+  MatrixXd I = reduced_rhs(solver, Imatrix);
+  MatrixXd V = solve_factorised(solver, I);
+  if(solver.mixed_precision && !solver.double_factorised) {
+    V = refine_solution(solver, I, V);
+  }
+  check_solution(solver, sim, I, V);
+  return V;
+}
+
+MatrixXd solve_prepared_system(network_solver &solver, const network_simulation &sim, const MatrixXd &Imatrix) {
+  if(solver.method == "latency_blocks") {
+    // Every block, in order (known rows first), without the latency bookkeeping of the time loop
+    MatrixXd V = MatrixXd::Zero(Imatrix.rows(), Imatrix.cols());
+    for(const solver_block &block: solver.blocks) {
+      MatrixXd rhs(block.rows.size(), Imatrix.cols());
+      for(int r = 0; r < block.rows.size(); r++) {
+        rhs.row(r) = Imatrix.row(block.rows[r]);
+      }
+      if(block.known_columns.nonZeros() > 0) {
+        rhs -= block.known_columns * V;
+      }
+      MatrixXd block_V = block.use_llt ? MatrixXd(block.llt.solve(rhs)) : MatrixXd(block.lu.solve(rhs));
+      for(int r = 0; r < block.rows.size(); r++) {
+        V.row(block.rows[r]) = block_V.row(r);
+      }
+    }
+    return V;
+  }
+  if(sim.solver_mode == "iterative") {
+    // One column at a time from a zero initial guess, the initial guess and iteration count of the time loop are kept
+    VectorXd previous_solution = solver.previous_solution;
+    long total_iterations = solver.total_iterations;
+    long unconverged_solves = solver.unconverged_solves;
+    MatrixXd V(Imatrix.rows(), Imatrix.cols());
+    for(int col = 0; col < Imatrix.cols(); col++) {
+      solver.previous_solution = VectorXd::Zero(Imatrix.rows());
+      V.col(col) = solve_iterative(solver, sim, Imatrix.col(col));
+    }
+    solver.previous_solution = previous_solution;
+    solver.total_iterations = total_iterations;
+    solver.unconverged_solves = unconverged_solves;
+    return V;
+  }
+  return solve_prepared_direct(solver, sim, Imatrix);
+}
+
+
+// Branch currents.
+// In modified nodal analysis every voltage source adds its current i_k as an unknown:
+//    [ G_R  -B ] [V]   [-J]
+//    [ B^T   0 ] [i] = [ E]
+// The node voltages are solved above from the nodal form (supernodes and known nodes), which is this system with i eliminated,
+// so the one factorisation already covers the whole KKT system and only the back-substitution of the first block row is
+// left: B*i = G_R*V + J. The voltage sources form a forest over the nodes (a loop would make B rank deficient), so B is
+// triangular when its rows are taken leaves first: every source's current is what leaves the subtree below it. That order
+// is found once here, every timestep is then one pass over the voltage sources.
+
+int prepare_branch_currents(network_solver &solver, const network_simulation &sim) {
+  vector<node> Vvector = create_v_matrix(sim);
+  map<int,int> row_of_node;
+  for(int row = 0; row < Vvector.size(); row++) {
+    row_of_node[Vvector[row].index] = row;
+  }
+
+  int n = Vvector.size();
+  solver.terminal_rows.assign(2*sim.network_components.size(), -1);
+  solver.branch_components.clear();
+  solver.branch_order.clear();
+  solver.branch_child_rows.clear();
+  solver.branch_parent_rows.clear();
+  vector<Triplet<double>> conductances;
+  // Voltage sources adjacent to every row, ground is row n
+  vector<vector<int>> adjacent_sources(n+1);
+  for(int c = 0; c < sim.network_components.size(); c++) {
+    const component &cmp = sim.network_components[c];
+    int row0 = cmp.connected_terminals[0].index == 0 ? -1 : row_of_node[cmp.connected_terminals[0].index];
+    int row1 = cmp.connected_terminals[1].index == 0 ? -1 : row_of_node[cmp.connected_terminals[1].index];
+    solver.terminal_rows[2*c] = row0;
+    solver.terminal_rows[2*c+1] = row1;
+
+    if(cmp.component_name[0] == 'R') {
+      double g = 1.0/cmp.component_value[0];
+      if(row0 != -1) { conductances.push_back(Triplet<double>(row0, row0, g)); }
+      if(row1 != -1) { conductances.push_back(Triplet<double>(row1, row1, g)); }
+      if(row0 != -1 && row1 != -1) {
+        conductances.push_back(Triplet<double>(row0, row1, -g));
+        conductances.push_back(Triplet<double>(row1, row0, -g));
+      }
+    }
+    if(cmp.component_name[0] == 'V') {
+      int k = solver.branch_components.size();
+      solver.branch_components.push_back(c);
+      adjacent_sources[row0 == -1 ? n : row0].push_back(k);
+      adjacent_sources[row1 == -1 ? n : row1].push_back(k);
+    }
+  }
+  solver.resistor_G.resize(n, n);
+  solver.resistor_G.setFromTriplets(conductances.begin(), conductances.end());
+
+  // Breadth first through every tree of voltage sources, rooted at ground where the tree reaches it. Reaching a row twice
+  // means the sources form a loop (e.g. a capacitor in parallel with a voltage source) and their currents are undetermined.
+  vector<bool> visited(n+1, false), source_used(solver.branch_components.size(), false);
+  vector<int> roots = {n};
+  for(int row = 0; row < n; row++) {
+    roots.push_back(row);
+  }
+  for(int root: roots) {
+    if(visited[root] || adjacent_sources[root].empty()) {
+      continue;
+    }
+    visited[root] = true;
+    vector<int> queue = {root};
+    for(int q = 0; q < queue.size(); q++) {
+      int parent = queue[q];
+      for(int k: adjacent_sources[parent]) {
+        if(source_used[k]) {
+          continue;
+        }
+        source_used[k] = true;
+        int c = solver.branch_components[k];
+        int row0 = solver.terminal_rows[2*c] == -1 ? n : solver.terminal_rows[2*c];
+        int row1 = solver.terminal_rows[2*c+1] == -1 ? n : solver.terminal_rows[2*c+1];
+        int child = row0 == parent ? row1 : row0;
+        if(visited[child]) {
+          cout << "[ERROR] Voltage sources (or capacitors) form a loop through " << sim.network_components[c].component_name
+               << ", their currents can't be determined" << endl;
+          solver.failed = true;
+          return 1;
+        }
+        visited[child] = true;
+        queue.push_back(child);
+        solver.branch_order.push_back(k);
+        solver.branch_child_rows.push_back(child);
+        solver.branch_parent_rows.push_back(parent == n ? -1 : parent);
+      }
+    }
+  }
+  // Leaves first
+  reverse(solver.branch_order.begin(), solver.branch_order.end());
+  reverse(solver.branch_child_rows.begin(), solver.branch_child_rows.end());
+  reverse(solver.branch_parent_rows.begin(), solver.branch_parent_rows.end());
+  return 0;
+}
+
+VectorXd solve_branch_currents(const network_solver &solver, const network_simulation &sim, const VectorXd &V, double simulation_progress) {
+  if(solver.branch_components.empty()) {
+    return VectorXd::Zero(0);
+  }
+
+  // Currents leaving every node through resistors and current sources
+  VectorXd leaving = solver.resistor_G * V;
+  for(int c = 0; c < sim.network_components.size(); c++) {
+    const component &cmp = sim.network_components[c];
+    if(cmp.component_name[0] != 'I') {
+      continue;
+    }
+    double current = source_value(cmp, simulation_progress);
+    if(solver.terminal_rows[2*c] != -1) { leaving(solver.terminal_rows[2*c]) += current; }
+    if(solver.terminal_rows[2*c+1] != -1) { leaving(solver.terminal_rows[2*c+1]) -= current; }
+  }
+  return back_substitute_branch_currents(solver, leaving);
+}
+
+MatrixXd back_substitute_branch_currents(const network_solver &solver, MatrixXd leaving) {
+  MatrixXd currents = MatrixXd::Zero(solver.branch_components.size(), leaving.cols());
+  // Row of the child node: B(child,k)*i_k = what leaves its subtree, which then enters the parent through source k
+  for(int j = 0; j < solver.branch_order.size(); j++) {
+    int k = solver.branch_order[j];
+    int child = solver.branch_child_rows[j];
+    int parent = solver.branch_parent_rows[j];
+    double sign = solver.terminal_rows[2*solver.branch_components[k]] == child ? 1.0 : -1.0;
+    currents.row(k) = sign * leaving.row(child);
+    if(parent != -1) {
+      leaving.row(parent) += leaving.row(child);
+    }
+  }
+  return currents;
+}
@@ -0,0 +1,295 @@
+#include "simulator.hpp"
+#include "dependencies.hpp"
+
+using namespace std;
+using namespace Eigen;
+
+// .meas and .four are evaluated while the simulation runs, from the same rows that are written to the CSV file.
+// Integrals (AVG, RMS, Fourier coefficients) use the trapezoidal rule on the linear interpolation between timesteps,
+// clipped to the measurement window. Nothing but a few accumulators per measurement is kept.
+
+// V(N003) => "3", I(R1) => "R1"; the name of the CSV column
+static string signal_column_name(string signal) {
+  string inside = signal.substr(2, signal.size()-3);
+  if(signal[0] == 'V') {
+    return to_string(parse_node_name_to_index(inside));
+  }
+  return inside;
+}
+
+static bool parse_signal(network_simulation &sim, string signal) {
+  static const regex signal_pattern("V\\(N?[0-9]+\\)|I\\([A-Z][A-Za-z0-9_.]*\\)");
+  if(!regex_match(signal, signal_pattern)) {
+    return false;
+  }
+  // Measured nodes must not be removed by the RC reduction
+  if(signal[0] == 'V') {
+    sim.probed_nodes.push_back(parse_node_name_to_index(signal.substr(2, signal.size()-3)));
+  }
+  return true;
+}
+
+int parse_measurement(network_simulation &sim, string netlist_line) {
+  vector<string> tokens;
+  string token;
+  stringstream input(netlist_line);
+  while(input >> token) {
+    tokens.push_back(token);
+  }
+
+  // .four <frequency> <signals...>
+  if(tokens[0] == ".four") {
+    if(tokens.size() < 3) {
+      return 2;
+    }
+    fourier_analysis fourier;
+    fourier.frequency = suffix_parser(tokens[1]);
+    for(int i = 2; i < tokens.size(); i++) {
+      if(!parse_signal(sim, tokens[i])) {
+        return 2;
+      }
+      fourier.signals.push_back(tokens[i]);
+    }
+    if(fourier.frequency <= 0.0 || fourier.signals.empty()) {
+      return 2;
+    }
+    sim.fourier_analyses.push_back(fourier);
+    return 0;
+  }
+
+  // .meas tran <name> MAX|MIN|PP|AVG|RMS <signal> [FROM=<t>] [TO=<t>]
+  // .meas tran <name> WHEN <signal>=<value> [RISE=<n>|FALL=<n>|CROSS=<n>] [FROM=<t>] [TO=<t>]
+  if(tokens.size() < 5 || tokens[1] != "tran") {
+    return 2;
+  }
+  measurement meas;
+  meas.name = tokens[2];
+  meas.kind = tokens[3];
+  transform(meas.kind.begin(), meas.kind.end(), meas.kind.begin(), ::toupper);
+  string signal = tokens[4];
+  if(meas.kind == "WHEN") {
+    size_t equals = signal.find('=');
+    if(equals == string::npos) {
+      return 2;
+    }
+    meas.threshold = suffix_parser(signal.substr(equals+1));
+    signal = signal.substr(0, equals);
+  } else if(meas.kind != "MAX" && meas.kind != "MIN" && meas.kind != "PP" && meas.kind != "AVG" && meas.kind != "RMS") {
+    return 2;
+  }
+  if(!parse_signal(sim, signal)) {
+    return 2;
+  }
+  meas.signal = signal;
+
+  for(int i = 5; i < tokens.size(); i++) {
+    string key = tokens[i].substr(0, tokens[i].find('='));
+    string value = tokens[i].substr(tokens[i].find('=')+1);
+    transform(key.begin(), key.end(), key.begin(), ::toupper);
+    if(key == "FROM") {
+      meas.from = suffix_parser(value);
+    } else if(key == "TO") {
+      meas.to = suffix_parser(value);
+    } else if(meas.kind == "WHEN" && (key == "RISE" || key == "FALL" || key == "CROSS")) {
+      static const regex occurrence_number("[1-9][0-9]{0,8}");
+      if(!regex_match(value, occurrence_number)) {
+        return 2;
+      }
+      meas.edge = key == "RISE" ? 1 : key == "FALL" ? -1 : 0;
+      meas.occurrence = stoi(value);
+    } else {
+      return 2;
+    }
+  }
+  sim.measurements.push_back(meas);
+  return 0;
+}
+
+static int find_column(const vector<string> &column_names, string signal) {
+  string name = signal_column_name(signal);
+  // Capacitors and inductors are named after their source equivalents
+  for(string candidate: {name, "V_" + name, "I_" + name}) {
+    for(int c = 0; c < column_names.size(); c++) {
+      if(column_names[c] == candidate) {
+        return c;
+      }
+    }
+  }
+  return -1;
+}
+
+int prepare_measurements(network_simulation &sim, const vector<string> &column_names, double stoptime) {
+  for(measurement &meas: sim.measurements) {
+    meas.column = find_column(column_names, meas.signal);
+    if(meas.column == -1) {
+      cout << "[ERROR] .meas " << meas.name << ": unknown signal " << meas.signal << endl;
+      return 2;
+    }
+    if(meas.to < 0.0) {
+      meas.to = stoptime;
+    }
+  }
+  for(fourier_analysis &fourier: sim.fourier_analyses) {
+    // The last full period of the simulation
+    fourier.start = stoptime - 1.0/fourier.frequency;
+    fourier.end = stoptime;
+    if(fourier.start < 0.0) {
+      cout << "[WARNING] .four: the simulation is shorter than one period of " << fourier.frequency << " Hz" << endl;
+      fourier.start = 0.0;
+    }
+    for(string signal: fourier.signals) {
+      int column = find_column(column_names, signal);
+      if(column == -1) {
+        cout << "[ERROR] .four: unknown signal " << signal << endl;
+        return 2;
+      }
+      fourier.columns.push_back(column);
+    }
+    fourier.duration = 0.0;
+    fourier.cosine_integrals.assign(fourier.columns.size(), vector<double>(fourier.harmonics+1, 0.0));
+    fourier.sine_integrals.assign(fourier.columns.size(), vector<double>(fourier.harmonics+1, 0.0));
+  }
+  return 0;
+}
+
+// The part of the step from t0 to t1 inside [from, to], with the values interpolated at its ends. False if it is outside.
+static bool clip_interval(double from, double to, double &t0, double &v0, double &t1, double &v1) {
+  if(t1 <= from || t0 >= to || t1 <= t0) {
+    return false;
+  }
+  double slope = (v1 - v0) / (t1 - t0);
+  if(t0 < from) {
+    v0 += slope * (from - t0);
+    t0 = from;
+  }
+  if(t1 > to) {
+    v1 -= slope * (t1 - to);
+    t1 = to;
+  }
+  return true;
+}
+
+static void accumulate_measurement(measurement &meas, double t0, double v0, double t1, double v1) {
+  if(meas.kind == "WHEN") {
+    if(meas.found || !clip_interval(meas.from, meas.to, t0, v0, t1, v1)) {
+      return;
+    }
+    bool rise = v0 < meas.threshold && v1 >= meas.threshold;
+    bool fall = v0 > meas.threshold && v1 <= meas.threshold;
+    if((meas.edge == 1 && rise) || (meas.edge == -1 && fall) || (meas.edge == 0 && (rise || fall))) {
+      meas.crossings++;
+      if(meas.crossings == meas.occurrence) {
+        meas.found = true;
+        meas.result = t0 + (meas.threshold - v0) / (v1 - v0) * (t1 - t0);
+      }
+    }
+    return;
+  }
+
+  if(!clip_interval(meas.from, meas.to, t0, v0, t1, v1)) {
+    return;
+  }
+  for(double v: {v0, v1}) {
+    meas.maximum = meas.found ? max(meas.maximum, v) : v;
+    meas.minimum = meas.found ? min(meas.minimum, v) : v;
+    meas.found = true;
+  }
+  double dt = t1 - t0;
+  meas.integral += (v0 + v1) / 2.0 * dt;
+  // Exact integral of the square of the linear interpolation
+  meas.square_integral += (v0*v0 + v0*v1 + v1*v1) / 3.0 * dt;
+  meas.duration += dt;
+}
+
+static void accumulate_fourier(fourier_analysis &fourier, int s, double t0, double v0, double t1, double v1) {
+  if(!clip_interval(fourier.start, fourier.end, t0, v0, t1, v1)) {
+    return;
+  }
+  double omega = 2*M_PI*fourier.frequency;
+  for(int h = 0; h <= fourier.harmonics; h++) {
+    fourier.cosine_integrals[s][h] += (v0*cos(h*omega*t0) + v1*cos(h*omega*t1)) / 2.0 * (t1 - t0);
+    fourier.sine_integrals[s][h] += (v0*sin(h*omega*t0) + v1*sin(h*omega*t1)) / 2.0 * (t1 - t0);
+  }
+  if(s == 0) {
+    fourier.duration += t1 - t0;
+  }
+}
+
+void accumulate_measurements(network_simulation &sim, double simulation_progress, const vector<double> &values) {
+  if(!sim.has_previous_measurement_row) {
+    sim.has_previous_measurement_row = true;
+  } else {
+    double t0 = sim.previous_measurement_time;
+    for(measurement &meas: sim.measurements) {
+      accumulate_measurement(meas, t0, sim.previous_measurement_row[meas.column], simulation_progress, values[meas.column]);
+    }
+    for(fourier_analysis &fourier: sim.fourier_analyses) {
+      for(int s = 0; s < fourier.columns.size(); s++) {
+        accumulate_fourier(fourier, s, t0, sim.previous_measurement_row[fourier.columns[s]], simulation_progress, values[fourier.columns[s]]);
+      }
+    }
+  }
+  sim.previous_measurement_time = simulation_progress;
+  sim.previous_measurement_row = values;
+}
+
+bool measurement_value(const measurement &meas, double &value) {
+  if(!meas.found) {
+    return false;
+  }
+  if(meas.kind == "WHEN") { value = meas.result; }
+  if(meas.kind == "MAX") { value = meas.maximum; }
+  if(meas.kind == "MIN") { value = meas.minimum; }
+  if(meas.kind == "PP") { value = meas.maximum - meas.minimum; }
+  if(meas.kind == "AVG") { value = meas.duration > 0.0 ? meas.integral / meas.duration : meas.maximum; }
+  if(meas.kind == "RMS") { value = meas.duration > 0.0 ? sqrt(meas.square_integral / meas.duration) : fabs(meas.maximum); }
+  return true;
+}
+
+static void report_measurement_results(const vector<measurement> &measurements, const vector<fourier_analysis> &fourier_analyses) {
+  for(const measurement &meas: measurements) {
+    double value;
+    if(measurement_value(meas, value)) {
+      cout << meas.name << " = " << value << endl;
+    } else {
+      cout << meas.name << " = failed" << endl;
+    }
+  }
+
+  for(const fourier_analysis &fourier: fourier_analyses) {
+    double period = fourier.duration > 0.0 ? fourier.duration : fourier.end - fourier.start;
+    for(int s = 0; s < fourier.columns.size(); s++) {
+      // v(t) = DC + sum M_h sin(h*w*t + phase_h)
+      double dc = fourier.cosine_integrals[s][0] / period;
+      vector<double> magnitude(fourier.harmonics+1), phase(fourier.harmonics+1);
+      for(int h = 1; h <= fourier.harmonics; h++) {
+        double a = 2.0 * fourier.cosine_integrals[s][h] / period;
+        double b = 2.0 * fourier.sine_integrals[s][h] / period;
+        magnitude[h] = hypot(a, b);
+        phase[h] = atan2(a, b) * 180.0 / M_PI;
+      }
+      double distortion = 0.0;
+      for(int h = 2; h <= fourier.harmonics; h++) {
+        distortion += magnitude[h]*magnitude[h];
+      }
+
+      cout << endl << "Fourier components of " << fourier.signals[s] << ", DC component: " << dc << endl;
+      cout << "Harmonic\tFrequency\tMagnitude\tPhase\tNorm. Magnitude\tNorm. Phase" << endl;
+      for(int h = 1; h <= fourier.harmonics; h++) {
+        cout << h << "\t" << h*fourier.frequency << "\t" << magnitude[h] << "\t" << phase[h] << "\t";
+        cout << (magnitude[1] > 0.0 ? magnitude[h]/magnitude[1] : 0.0) << "\t" << phase[h] - phase[1] << endl;
+      }
+      cout << "Total harmonic distortion: " << (magnitude[1] > 0.0 ? 100.0*sqrt(distortion)/magnitude[1] : 0.0) << "%" << endl;
+    }
+  }
+}
+
+void report_measurements(const network_simulation &sim) {
+  report_measurement_results(sim.measurements, sim.fourier_analyses);
+  for(int k = 0; k < sim.variant_measurements.size(); k++) {
+    if(!sim.variant_measurements[k].empty() || !sim.variant_fourier_analyses[k].empty()) {
+      cout << endl << "Stimulus variant " << k+1 << ":" << endl;
+      report_measurement_results(sim.variant_measurements[k], sim.variant_fourier_analyses[k]);
+    }
+  }
+}
@@ -0,0 +1,547 @@
+#include "simulator.hpp"
+#include "dependencies.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+using namespace std;
+using namespace Eigen;
+
+// Binary cache of a parsed netlist, stored as <netlist>.cache.
+// It holds the parsed components (subcircuits already expanded) and the analysis directive lines, which are cheap to parse again.
+// The cache is keyed by a hash of the netlist text, simulator_version and the time the simulator was built (the parse depends on
+// the parser, so a rebuilt simulator parses again), and a format version; any mismatch means it is rebuilt.
+//
+// Layout (native byte order):
+//   "NETCACHE" | uint32 version | uint64 netlist hash | uint64 netlist size
+//   uint32 directive count, each: uint32 length, characters
+//   uint32 component count, each: uint32 name length, name, uint32 value count, doubles, int32 node 0, int32 node 1
+
+static const char cache_magic[8] = {'N','E','T','C','A','C','H','E'};
+static const uint32_t cache_format_version = 1;
+
+// FNV-1a, 64 bit
+static uint64_t hash_netlist(const string &text) {
+  uint64_t hash = 14695981039346656037ULL;
+  for(unsigned char c: text) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Bounds-checked reading of the mapped cache file; a short or corrupt file sets ok to false
+class cache_reader {
+  public:
+    const char *data;
+    size_t size;
+    size_t position = 0;
+    bool ok = true;
+
+    template<typename T>
+    T read() {
+      T value = T();
+      if(position + sizeof(T) > size) {
+        ok = false;
+        return value;
+      }
+      memcpy(&value, data + position, sizeof(T));
+      position += sizeof(T);
+      return value;
+    }
+    string read_string() {
+      uint32_t length = read<uint32_t>();
+      if(!ok || position + length > size) {
+        ok = false;
+        return "";
+      }
+      string text(data + position, length);
+      position += length;
+      return text;
+    }
+};
+
+template<typename T>
+static void write_value(ofstream &out, T value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void write_string(ofstream &out, const string &text) {
+  write_value<uint32_t>(out, text.size());
+  out.write(text.data(), text.size());
+}
+
+static void write_netlist_cache(const network_simulation &netlist_network, string cache_name, uint64_t hash, uint64_t netlist_size) {
+  // Written to a temporary file first, so an interrupted run never leaves a half-written cache behind
+  string temporary_name = cache_name + ".tmp";
+  ofstream out(temporary_name, ios::binary);
+  if(!out.is_open()) {
+    return;
+  }
+  out.write(cache_magic, sizeof(cache_magic));
+  write_value<uint32_t>(out, cache_format_version);
+  write_value<uint64_t>(out, hash);
+  write_value<uint64_t>(out, netlist_size);
+
+  write_value<uint32_t>(out, netlist_network.analysis_directives.size());
+  for(const string &directive: netlist_network.analysis_directives) {
+    write_string(out, directive);
+  }
+
+  write_value<uint32_t>(out, netlist_network.network_components.size());
+  for(const component &cmp: netlist_network.network_components) {
+    write_string(out, cmp.component_name);
+    write_value<uint32_t>(out, cmp.component_value.size());
+    for(double value: cmp.component_value) {
+      write_value<double>(out, value);
+    }
+    write_value<int32_t>(out, cmp.connected_terminals[0].index);
+    write_value<int32_t>(out, cmp.connected_terminals[1].index);
+  }
+  out.close();
+  rename(temporary_name.c_str(), cache_name.c_str());
+}
+
+// Fills the network from a mapped cache file. Returns false if the cache does not belong to this netlist.
+static bool read_netlist_cache(network_simulation &netlist_network, const char *data, size_t size, uint64_t hash, uint64_t netlist_size) {
+  cache_reader reader;
+  reader.data = data;
+  reader.size = size;
+
+  if(size < sizeof(cache_magic) || memcmp(data, cache_magic, sizeof(cache_magic)) != 0) {
+    return false;
+  }
+  reader.position = sizeof(cache_magic);
+  if(reader.read<uint32_t>() != cache_format_version || reader.read<uint64_t>() != hash || reader.read<uint64_t>() != netlist_size) {
+    return false;
+  }
+
+  network_simulation loaded;
+  uint32_t directive_count = reader.read<uint32_t>();
+  for(uint32_t d = 0; d < directive_count && reader.ok; d++) {
+    parse_netlist_line(loaded, reader.read_string());
+  }
+
+  // Nodes are created in the same order as push_nodes_with_component does while parsing, but found through a map
+  map<int,int> node_position;
+  uint32_t component_count = reader.read<uint32_t>();
+  for(uint32_t c = 0; c < component_count && reader.ok; c++) {
+    string name = reader.read_string();
+    uint32_t value_count = reader.read<uint32_t>();
+    vector<double> values;
+    for(uint32_t v = 0; v < value_count && reader.ok; v++) {
+      values.push_back(reader.read<double>());
+    }
+    int index_0 = reader.read<int32_t>();
+    int index_1 = reader.read<int32_t>();
+    if(!reader.ok || name.empty() || values.empty()) {
+      return false;
+    }
+
+    component cmp;
+    cmp.component_name = name;
+    cmp.component_value = values;
+    cmp.connected_terminals = {node(index_0), node(index_1)};
+    loaded.network_components.push_back(cmp);
+
+    for(int index: {index_0, index_1}) {
+      if(node_position.find(index) == node_position.end()) {
+        node_position[index] = loaded.network_nodes.size();
+        loaded.network_nodes.push_back(node(index));
+      }
+      loaded.network_nodes[node_position[index]].connected_components.push_back(cmp);
+    }
+  }
+  if(!reader.ok) {
+    return false;
+  }
+
+  netlist_network = loaded;
+  return true;
+}
+
+int parse_netlist_text(network_simulation &netlist_network, const string &text) {
+  stringstream lines(text);
+  string line;
+  int line_number = 0;
+  while(getline(lines, line)) {
+    line_number++;
+    if(!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    // Lines the parser does not understand are skipped (e.g. .ic), only broken subcircuit instances stop the simulation
+    if(parse_netlist_line(netlist_network, line) == 2 && line.find_first_not_of(" \t") != string::npos) {
+      cout << "[WARNING] Netlist line " << line_number << " ignored: " << line << endl;
+    }
+  }
+  // Without an .end line the instances are still pending
+  expand_subcircuit_instances(netlist_network);
+  return netlist_network.subcircuit_errors > 0 ? 2 : 0;
+}
+
+int load_netlist(network_simulation &netlist_network, string filename) {
+  ifstream netlist_file(filename, ios::binary);
+  if(!netlist_file.is_open()) {
+    cout << "[ERROR] Can't open netlist: " << filename << endl;
+    return 2;
+  }
+  stringstream contents;
+  contents << netlist_file.rdbuf();
+  string text = contents.str();
+  uint64_t hash = hash_netlist(string(simulator_version) + " " + __DATE__ + " " + __TIME__ + "\n" + text);
+  string cache_name = filename + ".cache";
+
+  // Memory-map the cache, so nothing but the header is read if it is stale
+  int descriptor = open(cache_name.c_str(), O_RDONLY);
+  if(descriptor != -1) {
+    struct stat cache_stat;
+    bool loaded = false;
+    if(fstat(descriptor, &cache_stat) == 0 && cache_stat.st_size > 0) {
+      void *mapped = mmap(nullptr, cache_stat.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+      if(mapped != MAP_FAILED) {
+        loaded = read_netlist_cache(netlist_network, static_cast<const char*>(mapped), cache_stat.st_size, hash, text.size());
+        munmap(mapped, cache_stat.st_size);
+      }
+    }
+    close(descriptor);
+    if(loaded) {
+      cout << "Netlist loaded from cache: " << cache_name << endl;
+      return 0;
+    }
+  }
+
+  // A netlist with broken subcircuit instances is not cached, so the errors are reported again on the next run
+  if(parse_netlist_text(netlist_network, text) != 0) {
+    cout << "[ERROR] Netlist " << filename << " has subcircuit instances that can't be expanded" << endl;
+    return 2;
+  }
+  write_netlist_cache(netlist_network, cache_name, hash, text.size());
+  return 0;
+}
+
+
+// Cache of fill-reducing orderings.
+// Ordering a large sparse matrix (AMD, COLAMD) can cost as much as factorising it, but it only depends on the sparsity pattern,
+// which is fixed by the circuit graph. Orderings are therefore kept by a hash of the graph: in memory for further simulations
+// in the same process (sweeps, library calls), and appended to a file for later runs of the same design.
+//
+// File layout (native byte order):
+//   "ORDCACHE" | uint32 version
+//   entries, each: uint64 topology hash | uint32 method length, method | uint32 size | int32 permutation indices
+
+static const char ordering_cache_magic[8] = {'O','R','D','C','A','C','H','E'};
+static const uint32_t ordering_cache_format_version = 1;
+
+static mutex ordering_cache_mutex;
+static map<pair<uint64_t,string>, vector<int>> cached_orderings;
+static set<string> loaded_ordering_files;
+
+uint64_t hash_circuit_topology(const network_simulation &sim) {
+  uint64_t hash = 14695981039346656037ULL;
+  auto mix = [&hash](int64_t value) {
+    for(int byte = 0; byte < 8; byte++) {
+      hash ^= (value >> (8*byte)) & 0xff;
+      hash *= 1099511628211ULL;
+    }
+  };
+  mix(sim.network_nodes.size());
+  for(const node &nd: sim.network_nodes) {
+    mix(nd.index);
+  }
+  mix(sim.network_components.size());
+  for(const component &cmp: sim.network_components) {
+    mix(cmp.component_name[0]);
+    mix(cmp.connected_terminals[0].index);
+    mix(cmp.connected_terminals[1].index);
+  }
+  return hash;
+}
+
+// Reads all entries of an ordering cache file into cached_orderings, once per file. The caller holds the lock.
+static void load_ordering_file(string cache_file) {
+  if(cache_file.empty() || loaded_ordering_files.count(cache_file)) {
+    return;
+  }
+  loaded_ordering_files.insert(cache_file);
+
+  ifstream in(cache_file, ios::binary);
+  string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  cache_reader reader;
+  reader.data = contents.data();
+  reader.size = contents.size();
+  if(reader.size < sizeof(ordering_cache_magic) || memcmp(reader.data, ordering_cache_magic, sizeof(ordering_cache_magic)) != 0) {
+    return;
+  }
+  reader.position = sizeof(ordering_cache_magic);
+  if(reader.read<uint32_t>() != ordering_cache_format_version) {
+    return;
+  }
+  // A torn last entry (interrupted run) is ignored
+  while(reader.ok && reader.position < reader.size) {
+    uint64_t topology_hash = reader.read<uint64_t>();
+    string method = reader.read_string();
+    uint32_t size = reader.read<uint32_t>();
+    vector<int> ordering;
+    for(uint32_t i = 0; i < size && reader.ok; i++) {
+      ordering.push_back(reader.read<int32_t>());
+    }
+    if(reader.ok) {
+      cached_orderings[make_pair(topology_hash, method)] = ordering;
+    }
+  }
+}
+
+bool find_cached_ordering(string cache_file, uint64_t topology_hash, string method, int size, vector<int> &ordering) {
+  lock_guard<mutex> lock(ordering_cache_mutex);
+  load_ordering_file(cache_file);
+  auto found = cached_orderings.find(make_pair(topology_hash, method));
+  if(found == cached_orderings.end() || found->second.size() != size) {
+    return false;
+  }
+  // Every index must appear exactly once, otherwise the entry is not a permutation (corrupt file)
+  vector<bool> seen(size, false);
+  for(int index: found->second) {
+    if(index < 0 || index >= size || seen[index]) {
+      return false;
+    }
+    seen[index] = true;
+  }
+  ordering = found->second;
+  return true;
+}
+
+void store_cached_ordering(string cache_file, uint64_t topology_hash, string method, const vector<int> &ordering) {
+  lock_guard<mutex> lock(ordering_cache_mutex);
+  cached_orderings[make_pair(topology_hash, method)] = ordering;
+  if(cache_file.empty()) {
+    return;
+  }
+
+  // Entries are appended to a valid file; a missing, foreign or outdated file is started anew
+  char header[sizeof(ordering_cache_magic) + sizeof(uint32_t)] = {};
+  ifstream existing(cache_file, ios::binary);
+  existing.read(header, sizeof(header));
+  uint32_t version = 0;
+  memcpy(&version, header + sizeof(ordering_cache_magic), sizeof(version));
+  bool valid_header = existing.gcount() == sizeof(header) && memcmp(header, ordering_cache_magic, sizeof(ordering_cache_magic)) == 0 && version == ordering_cache_format_version;
+  existing.close();
+  ofstream out(cache_file, ios::binary | (valid_header ? ios::app : ios::trunc));
+  if(!out.is_open()) {
+    return;
+  }
+  if(!valid_header) {
+    out.write(ordering_cache_magic, sizeof(ordering_cache_magic));
+    write_value<uint32_t>(out, ordering_cache_format_version);
+  }
+  write_value<uint64_t>(out, topology_hash);
+  write_string(out, method);
+  write_value<uint32_t>(out, ordering.size());
+  for(int index: ordering) {
+    write_value<int32_t>(out, index);
+  }
+}
+
+
+// Result cache.
+// Regression and optimisation flows often simulate the very same circuit again. The rows of a whole transient run are
+// therefore stored in a directory of entry files, named by a hash of everything the rows depend on: the parsed circuit
+// (component names, values and nodes), the analysis directives (with whitespace normalised), simulator_version and the
+// time the simulator was built, so a rebuilt simulator never replays results of the old code, even if simulator_version
+// was not changed. A hit replays the rows instead of simulating. The directory is kept below a size limit by removing the
+// least recently used entries (the modification time of an entry is updated on every hit). A run whose entry alone would
+// exceed the limit is not recorded at all.
+//
+// Entry layout (native byte order):
+//   "RESCACHE" | uint32 version | uint64 key | double stop time | uint64 row count
+//   uint32 column count, each: uint32 length, characters
+//   rows, each: int32 variant | double time | double value per column
+
+static const char result_cache_magic[8] = {'R','E','S','C','A','C','H','E'};
+static const uint32_t result_cache_format_version = 1;
+static const size_t result_cache_header_size = sizeof(result_cache_magic) + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(double) + sizeof(uint64_t);
+
+uint64_t hash_simulation_inputs(const network_simulation &sim) {
+  uint64_t hash = hash_netlist(string(simulator_version) + " " + __DATE__ + " " + __TIME__);
+  auto mix = [&hash](const void *data, size_t size) {
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    for(size_t byte = 0; byte < size; byte++) {
+      hash ^= bytes[byte];
+      hash *= 1099511628211ULL;
+    }
+  };
+  for(const component &cmp: sim.network_components) {
+    mix(cmp.component_name.data(), cmp.component_name.size() + 1);
+    for(double value: cmp.component_value) {
+      mix(&value, sizeof(value));
+    }
+    int32_t terminals[2] = {cmp.connected_terminals[0].index, cmp.connected_terminals[1].index};
+    mix(terminals, sizeof(terminals));
+  }
+  for(const string &directive: sim.analysis_directives) {
+    stringstream words(directive);
+    string word;
+    while(words >> word) {
+      mix(word.data(), word.size() + 1);
+    }
+    mix("\n", 1);
+  }
+  return hash;
+}
+
+static string result_cache_entry_name(string cache_dir, uint64_t key) {
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long) key);
+  return cache_dir + "/" + name + ".result";
+}
+
+bool replay_cached_result(string cache_dir, uint64_t key, function<int(const vector<string>&, double)> columns,
+                          function<void(int, double, const vector<double>&)> row) {
+  string entry_name = result_cache_entry_name(cache_dir, key);
+  int descriptor = open(entry_name.c_str(), O_RDONLY);
+  if(descriptor == -1) {
+    return false;
+  }
+  struct stat entry_stat;
+  void *mapped = MAP_FAILED;
+  if(fstat(descriptor, &entry_stat) == 0 && entry_stat.st_size > 0) {
+    mapped = mmap(nullptr, entry_stat.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+  }
+  close(descriptor);
+  if(mapped == MAP_FAILED) {
+    return false;
+  }
+
+  // The whole entry is checked before anything is passed on
+  cache_reader reader;
+  reader.data = static_cast<const char*>(mapped);
+  reader.size = entry_stat.st_size;
+  bool valid = reader.size >= result_cache_header_size && memcmp(reader.data, result_cache_magic, sizeof(result_cache_magic)) == 0;
+  reader.position = sizeof(result_cache_magic);
+  valid = valid && reader.read<uint32_t>() == result_cache_format_version && reader.read<uint64_t>() == key;
+  double stoptime = reader.read<double>();
+  uint64_t row_count = reader.read<uint64_t>();
+  vector<string> column_names(valid ? reader.read<uint32_t>() : 0);
+  for(string &name: column_names) {
+    name = reader.read_string();
+  }
+  size_t row_size = sizeof(int32_t) + sizeof(double) * (1 + column_names.size());
+  valid = valid && reader.ok && !column_names.empty() && reader.size - reader.position == row_count * row_size;
+
+  if(valid && columns(column_names, stoptime) == 0) {
+    vector<double> values(column_names.size());
+    for(uint64_t r = 0; r < row_count; r++) {
+      int variant = reader.read<int32_t>();
+      double time = reader.read<double>();
+      memcpy(values.data(), reader.data + reader.position, sizeof(double) * values.size());
+      reader.position += sizeof(double) * values.size();
+      row(variant, time, values);
+    }
+    utime(entry_name.c_str(), nullptr); // most recently used
+  }
+  munmap(mapped, entry_stat.st_size);
+  return valid;
+}
+
+bool begin_cached_result(result_cache_entry &entry, string cache_dir, uint64_t key, const vector<string> &column_names, uint64_t max_bytes) {
+  mkdir(cache_dir.c_str(), 0755);
+  entry.cache_dir = cache_dir;
+  entry.max_bytes = max_bytes;
+  entry.file_name = result_cache_entry_name(cache_dir, key);
+  // One temporary file per process, concurrent runs of the same circuit don't write into each other's entry
+  entry.temporary_name = entry.file_name + "." + to_string(getpid()) + ".tmp";
+  entry.rows = 0;
+  entry.out.open(entry.temporary_name, ios::binary | ios::trunc);
+  if(!entry.out.is_open()) {
+    return false;
+  }
+  entry.out.write(result_cache_magic, sizeof(result_cache_magic));
+  write_value<uint32_t>(entry.out, result_cache_format_version);
+  write_value<uint64_t>(entry.out, key);
+  write_value<double>(entry.out, 0.0); // stop time and row count are written by finish_cached_result
+  write_value<uint64_t>(entry.out, 0);
+  write_value<uint32_t>(entry.out, column_names.size());
+  for(const string &name: column_names) {
+    write_string(entry.out, name);
+  }
+  entry.bytes = entry.out.tellp();
+  entry.row_bytes = sizeof(int32_t) + sizeof(double) * (1 + column_names.size());
+  return true;
+}
+
+void add_cached_result_row(result_cache_entry &entry, int variant, double simulation_progress, const vector<double> &values) {
+  if(!entry.out.is_open()) {
+    return;
+  }
+  // An entry larger than the whole cache would only evict everything else and then itself, so it is given up
+  entry.bytes += entry.row_bytes;
+  if(entry.bytes > entry.max_bytes) {
+    entry.out.close();
+    remove(entry.temporary_name.c_str());
+    return;
+  }
+  write_value<int32_t>(entry.out, variant);
+  write_value<double>(entry.out, simulation_progress);
+  entry.out.write(reinterpret_cast<const char*>(values.data()), sizeof(double) * values.size());
+  entry.rows++;
+}
+
+// Removes the least recently used entries, except the one just written, until the directory holds at most max_bytes
+static void evict_cached_results(string cache_dir, string written_entry, uint64_t max_bytes) {
+  DIR *directory = opendir(cache_dir.c_str());
+  if(!directory) {
+    return;
+  }
+  vector<pair<pair<time_t, long>, pair<uint64_t, string>>> entries; // last use (seconds, nanoseconds), size, path
+  uint64_t total_bytes = 0;
+  while(dirent *file = readdir(directory)) {
+    string name = file->d_name;
+    if(name.size() <= 7 || name.compare(name.size() - 7, 7, ".result") != 0) {
+      continue;
+    }
+    string path = cache_dir + "/" + name;
+    struct stat entry_stat;
+    if(stat(path.c_str(), &entry_stat) == 0) {
+      total_bytes += entry_stat.st_size;
+      if(path != written_entry) {
+        entries.push_back(make_pair(make_pair(entry_stat.st_mtim.tv_sec, entry_stat.st_mtim.tv_nsec), make_pair(uint64_t(entry_stat.st_size), path)));
+      }
+    }
+  }
+  closedir(directory);
+
+  sort(entries.begin(), entries.end());
+  for(int e = 0; e < entries.size() && total_bytes > max_bytes; e++) {
+    if(remove(entries[e].second.second.c_str()) == 0) {
+      total_bytes -= entries[e].second.first;
+    }
+  }
+}
+
+void finish_cached_result(result_cache_entry &entry, double stoptime, uint64_t max_bytes) {
+  if(!entry.out.is_open()) {
+    return;
+  }
+  entry.out.seekp(result_cache_header_size - sizeof(double) - sizeof(uint64_t));
+  write_value<double>(entry.out, stoptime);
+  write_value<uint64_t>(entry.out, entry.rows);
+  entry.out.close();
+  if(entry.out.fail() || rename(entry.temporary_name.c_str(), entry.file_name.c_str()) != 0) {
+    remove(entry.temporary_name.c_str());
+    return;
+  }
+  evict_cached_results(entry.cache_dir, entry.file_name, max_bytes);
+}
+
+result_cache_entry::~result_cache_entry() {
+  // A run that failed leaves no entry behind
+  if(out.is_open()) {
+    out.close();
+    remove(temporary_name.c_str());
+  }
+}
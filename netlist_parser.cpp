@@ -3,16 +3,44 @@
 
 // Returns status code of parse operation: 0-success; 1-end_of_file; 2-parser_error;
 int parse_netlist_line(network_simulation &netlist_network, string netlist_line) {
-  // REGEX is used to verify and classify the netlist line
+  // REGEX is used to verify and classify the netlist line (compiled once, parsing is called for every line)
   // There are different types of lines in reduced spice format
   //1:Component => <designator> <node0> <node1> [<node 2] <value>
-  regex reduced_spice_format_component("(V|I|R|C|L|D|Q)[0-9]+ N?[0-9]+ N?[0-9]+ (N?[0-9]+ )?.+");
+  static const regex reduced_spice_format_component("(V|I|R|C|L|D|Q)[0-9]+(\\.X[0-9]+)* N?[0-9]+ N?[0-9]+ (N?[0-9]+ )?.+");
   //2:Comment => *XXXXX
-  regex reduced_spice_format_comment("\\*.+");
+  static const regex reduced_spice_format_comment("\\*.+");
   //3:Transient simulation paramters => .tran 0 <stop time> 0 <timestep>
-  regex reduced_spice_format_tran(".tran 0 [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)?s 0 [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)?s");
+  static const regex reduced_spice_format_tran(".tran 0 [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)?s 0 [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)?s");
   //4:End of spice netlist => .end
-  regex reduced_spice_format_end(".end");
+  static const regex reduced_spice_format_end(".end");
+  //5:Subcircuits => .subckt <name> <port nodes...>, ended by .ends; instances => X<n> <nodes...> <name>
+  static const regex reduced_spice_format_subckt("\\.subckt [A-Za-z_][A-Za-z0-9_]*( N?[0-9]+)+");
+  static const regex reduced_spice_format_ends("\\.ends( [A-Za-z_][A-Za-z0-9_]*)?");
+  static const regex reduced_spice_format_instance("X[0-9]+( N?[0-9]+)+ [A-Za-z_][A-Za-z0-9_]*");
+  //6:Simulator options => .options <key>=<value> [<key>=<value> ...]
+  static const regex reduced_spice_format_options("\\.options( [a-z_]+=[^ ]+)+");
+  //7:Probed nodes => .probe <nodes...>
+  static const regex reduced_spice_format_probe("\\.probe( N?[0-9]+)+");
+  //8:Periodic steady state => .pss [<fundamental frequency>]
+  static const regex reduced_spice_format_pss("\\.pss( [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)?)?");
+  //9:Sensitivity analysis => .sens V(<node>) [V(<node>) ...]
+  static const regex reduced_spice_format_sens("\\.sens( V\\(N?[0-9]+\\))+");
+  //10:Measurements => .meas tran <name> <MAX|MIN|PP|AVG|RMS|WHEN> <signal> ..., Fourier analysis => .four <frequency> <signals...>
+  static const regex reduced_spice_format_meas("\\.(meas|four) .+");
+  //11:Stimulus variants => .stimulus <source>=<value>|SINE(...) [...], simulated in one batch with the netlist
+  static const regex reduced_spice_format_stimulus("\\.stimulus( [VI][0-9]+(\\.X[0-9]+)*=(SINE\\([^)]*\\)|[^ ]+))+");
+  //12:Harmonic balance => .hb [<fundamental frequency> [<harmonics>]]
+  static const regex reduced_spice_format_hb("\\.hb( [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)?( [0-9]{1,9})?)?");
+
+  // Lines inside a subcircuit definition are only stored, they are parsed when an instance is expanded
+  if (!netlist_network.open_subcircuit.empty()) {
+    if (regex_match(netlist_line, reduced_spice_format_ends)) {
+      netlist_network.open_subcircuit = "";
+    } else if (!regex_match(netlist_line, reduced_spice_format_comment)) {
+      netlist_network.subcircuits[netlist_network.open_subcircuit].lines.push_back(netlist_line);
+    }
+    return 0;
+  }
 
   // Trying to match one of the three types
   if (regex_match(netlist_line, reduced_spice_format_component)) {
@@ -63,7 +91,7 @@ int parse_netlist_line(network_simulation &netlist_network, string netlist_line)
 
     // AC Sources
     // Matches SINE function
-    regex full_sine_function_pattern("(V|I).+SINE\\([0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)? [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)? [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)?\\)");
+    static const regex full_sine_function_pattern("(V|I).+SINE\\([0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)? [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)? [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)?\\)");
     smatch sine_function_matches_exists;
 
     if(regex_search(netlist_line, sine_function_matches_exists, full_sine_function_pattern)) {
@@ -83,7 +111,7 @@ int parse_netlist_line(network_simulation &netlist_network, string netlist_line)
       vector<node> new_nodes = {new_node_1, new_node_2};
 
       // Extract SINE(X Y Z) function parameters
-      regex sine_paramters_pattern("[0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)? [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)? [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)?");
+      static const regex sine_paramters_pattern("[0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)? [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)? [0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)?");
 
 	  string s =sine_function_matches_exists.str(0);
 	  
@@ -183,10 +211,99 @@ int parse_netlist_line(network_simulation &netlist_network, string netlist_line)
     netlist_network.stop_time = netlist_stop_time;
     netlist_network.timestep = netlist_timestep;
 
+    netlist_network.analysis_directives.push_back(netlist_line);
+    return 0;
+  }
+  else if (regex_match(netlist_line, reduced_spice_format_options)) {
+    string placeholder, option;
+    stringstream input(netlist_line);
+    input >> placeholder;
+    while(input >> option) {
+      if(parse_simulation_option(netlist_network, option) != 0) {
+        return 2; // Error: Unknown option
+      }
+    }
+    netlist_network.analysis_directives.push_back(netlist_line);
+    return 0;
+  }
+  else if (regex_match(netlist_line, reduced_spice_format_subckt)) {
+    string placeholder, subckt_name, port;
+    stringstream input(netlist_line);
+    input >> placeholder >> subckt_name;
+
+    subcircuit definition;
+    while(input >> port) {
+      definition.ports.push_back(port);
+    }
+    netlist_network.subcircuits[subckt_name] = definition;
+    netlist_network.open_subcircuit = subckt_name;
+    return 0;
+  }
+  else if (regex_match(netlist_line, reduced_spice_format_instance)) {
+    // Subcircuits may be defined after they are used, so instances are expanded at .end (or after the last line)
+    netlist_network.subcircuit_instances.push_back(netlist_line);
+    return 0;
+  }
+  else if (regex_match(netlist_line, reduced_spice_format_probe)) {
+    string placeholder, node_name;
+    stringstream input(netlist_line);
+    input >> placeholder;
+    while(input >> node_name) {
+      netlist_network.probed_nodes.push_back(parse_node_name_to_index(node_name));
+    }
+    netlist_network.analysis_directives.push_back(netlist_line);
+    return 0;
+  }
+  else if (regex_match(netlist_line, reduced_spice_format_pss)) {
+    string placeholder, frequency_raw;
+    stringstream input(netlist_line);
+    input >> placeholder;
+    netlist_network.pss_frequency = (input >> frequency_raw) ? suffix_parser(frequency_raw) : 0.0;
+    netlist_network.analysis_directives.push_back(netlist_line);
+    return 0;
+  }
+  else if (regex_match(netlist_line, reduced_spice_format_hb)) {
+    string placeholder, frequency_raw, harmonics_raw;
+    stringstream input(netlist_line);
+    input >> placeholder;
+    netlist_network.hb_frequency = (input >> frequency_raw) ? suffix_parser(frequency_raw) : 0.0;
+    if(input >> harmonics_raw) {
+      netlist_network.hb_harmonics = max(1, stoi(harmonics_raw));
+    }
+    netlist_network.analysis_directives.push_back(netlist_line);
+    return 0;
+  }
+  else if (regex_match(netlist_line, reduced_spice_format_sens)) {
+    string placeholder, output;
+    stringstream input(netlist_line);
+    input >> placeholder;
+    while(input >> output) {
+      // V(N003) => N003; the nodes must stay in the network, so they are also probed
+      int node_index = parse_node_name_to_index(output.substr(2, output.size()-3));
+      netlist_network.sensitivity_nodes.push_back(node_index);
+      netlist_network.probed_nodes.push_back(node_index);
+    }
+    netlist_network.analysis_directives.push_back(netlist_line);
+    return 0;
+  }
+  else if (regex_match(netlist_line, reduced_spice_format_meas)) {
+    if(parse_measurement(netlist_network, netlist_line) != 0) {
+      return 2; // Error: Invalid measurement
+    }
+    netlist_network.analysis_directives.push_back(netlist_line);
+    return 0;
+  }
+  else if (regex_match(netlist_line, reduced_spice_format_stimulus)) {
+    if(parse_stimulus_variant(netlist_network, netlist_line) != 0) {
+      return 2; // Error: Invalid stimulus
+    }
+    netlist_network.analysis_directives.push_back(netlist_line);
     return 0;
   }
   else if (regex_match(netlist_line, reduced_spice_format_end)) {
-    // Line is a .end, ignored
+    if(expand_subcircuit_instances(netlist_network) != 0) {
+      return 2; // Error: Invalid subcircuit instance
+    }
     return 1; // End of netlist reached
   }
   else {
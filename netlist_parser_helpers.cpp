@@ -2,6 +2,13 @@
 #include "dependencies.hpp"
 
 MatrixXf solve_matrix_equation(MatrixXf A, MatrixXf B) {
+  // Symmetric positive definite matrices (resistor/capacitor networks) are solved with Cholesky, all others with QR
+  if(A.isApprox(A.transpose())) {
+    LLT<MatrixXf> cholesky(A);
+    if(cholesky.info() == Success) {
+      return cholesky.solve(B);
+    }
+  }
   VectorXf x = A.colPivHouseholderQr().solve(B);
   return x;
 }
@@ -10,20 +17,20 @@ double suffix_parser(string input) {
   // reduced spice format takes multiplier or normal float as input
 
   // This strips the unit from back, if it is present (5ms=>5m)
-  regex has_unit(".+(s|Ohm|Ω|F|H)");
+  static const regex has_unit(".+(s|Ohm|Ω|F|H)");
   if (regex_match(input, has_unit)) {
     input = input.substr(0, input.size()-1);
   }
 
   // Input format examples: 1m, 0.1 ...
   // 1. Check if input already is a number
-  regex pure_number("[0-9]+([.][0-9]+)?");
+  static const regex pure_number("[0-9]+([.][0-9]+)?([eE][-+]?[0-9]+)?");
   if (regex_match(input, pure_number)) {
     return stod(input);
   }
 
   // 2. Check for metric suffix
-  regex metric_suffix("[0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)");
+  static const regex metric_suffix("[0-9]+([.][0-9]+)?(p|n|u|m|k|Meg|G)");
   if (regex_match(input, metric_suffix)) {
     if(input.find("p") != string::npos) { return stod(input.substr(0, input.size()-1))*1e-12; }
     if(input.find("n") != string::npos) { return stod(input.substr(0, input.size()-1))*1e-9; }
@@ -41,11 +48,12 @@ double suffix_parser(string input) {
 
 // This converts a raw node name from the netlist to the pure node index (int)
 int parse_node_name_to_index(string node_name) {
-  regex standard_node("N[0-9][0-9][0-9]");
+  // N000-N999 from the netlist, larger numbers are internal nodes of subcircuit instances
+  static const regex standard_node("N[0-9][0-9][0-9]+");
   if(regex_match(node_name, standard_node)){
     return stoi(node_name.substr(1));
   }
-  regex reference_node("0");
+  static const regex reference_node("0");
   if(regex_match(node_name, reference_node)){
     return 0;
   }
@@ -66,3 +74,144 @@ void push_nodes_with_component(network_simulation &netlist_network, vector<node>
     }
   }
 }
+
+// Whole numbers of options (threads, iteration limits, ...); at most 9 digits, so stoi can't fail
+static bool is_option_count(const string &value) {
+  static const regex count("[0-9]{1,9}");
+  return regex_match(value, count);
+}
+
+// Applies one key=value pair of an .options line to the simulation.
+int parse_simulation_option(network_simulation &netlist_network, string option) {
+  string key = option.substr(0, option.find('='));
+  string value = option.substr(option.find('=')+1);
+  static const regex megabytes("[0-9]{1,9}([.][0-9]+)?");
+
+  if(key == "solver" && (value == "direct" || value == "iterative")) {
+    netlist_network.solver_mode = value;
+    return 0;
+  }
+  if(key == "preconditioner" && (value == "ilu" || value == "jacobi")) {
+    netlist_network.preconditioner = value;
+    return 0;
+  }
+  if(key == "solver_tol") {
+    netlist_network.solver_tolerance = suffix_parser(value);
+    return 0;
+  }
+  if(key == "solver_max_iterations" && is_option_count(value)) {
+    netlist_network.solver_max_iterations = stoi(value);
+    return 0;
+  }
+  if(key == "threads" && is_option_count(value)) {
+    netlist_network.assembly_threads = stoi(value);
+    return 0;
+  }
+  if(key == "pss_tol") {
+    netlist_network.pss_tolerance = suffix_parser(value);
+    return 0;
+  }
+  if(key == "merge_elements" && (value == "0" || value == "1")) {
+    netlist_network.merge_elements = value == "1";
+    return 0;
+  }
+  if(key == "rc_reduction_tol") {
+    netlist_network.rc_reduction_tol = suffix_parser(value);
+    return 0;
+  }
+  if(key == "latency_tol") {
+    netlist_network.latency_tolerance = suffix_parser(value);
+    return 0;
+  }
+  if(key == "multirate" && is_option_count(value)) {
+    netlist_network.multirate_steps = max(1, stoi(value));
+    return 0;
+  }
+  if(key == "result_cache_size" && regex_match(value, megabytes)) {
+    netlist_network.result_cache_size = max(0.0, stod(value));
+    return 0;
+  }
+  if(key == "precision" && (value == "double" || value == "mixed")) {
+    netlist_network.precision = value;
+    return 0;
+  }
+  if(key == "solver_checks" && is_option_count(value)) {
+    netlist_network.solver_check_interval = max(0, stoi(value));
+    return 0;
+  }
+  if(key == "max_residual") {
+    netlist_network.max_residual = suffix_parser(value);
+    return 0;
+  }
+  if(key == "solver_abort" && (value == "0" || value == "1")) {
+    netlist_network.solver_abort = value == "1";
+    return 0;
+  }
+  if(key == "solver_trace" && (value == "0" || value == "1")) {
+    netlist_network.solver_trace = value == "1";
+    return 0;
+  }
+  if(key == "sens_check" && (value == "0" || value == "1")) {
+    netlist_network.sensitivity_check = value == "1";
+    return 0;
+  }
+  if(key == "parareal" && is_option_count(value)) {
+    netlist_network.parareal_slices = max(0, stoi(value));
+    return 0;
+  }
+  if(key == "parareal_coarse" && is_option_count(value)) {
+    netlist_network.parareal_coarse = max(1, stoi(value));
+    return 0;
+  }
+  if(key == "parareal_tol") {
+    netlist_network.parareal_tolerance = suffix_parser(value);
+    return 0;
+  }
+  if(key == "output_waveforms" && (value == "0" || value == "1")) {
+    netlist_network.write_waveforms = value == "1";
+    return 0;
+  }
+  if(key == "waveform_index" && (value == "0" || value == "1")) {
+    netlist_network.waveform_index = value == "1";
+    return 0;
+  }
+  if(key == "output_interval") {
+    netlist_network.output_interval = suffix_parser(value);
+    return 0;
+  }
+  if(key == "output_abstol") {
+    netlist_network.output_abstol = suffix_parser(value);
+    return 0;
+  }
+  if(key == "output_reltol") {
+    netlist_network.output_reltol = suffix_parser(value);
+    return 0;
+  }
+
+  cout << "[ERROR] Unknown option: " << option << endl;
+  return 2;
+}
+
+// .stimulus <source>=<dc value>|SINE(<dc offset> <amplitude> <frequency>) [...]
+int parse_stimulus_variant(network_simulation &netlist_network, string netlist_line) {
+  static const regex assignment_pattern("([VI][0-9]+(\\.X[0-9]+)*)=(SINE\\(([^)]*)\\)|[^ ]+)");
+  stimulus_variant variant;
+  for(sregex_iterator match(netlist_line.begin(), netlist_line.end(), assignment_pattern), end; match != end; ++match) {
+    variant.sources.push_back((*match)[1]);
+    if((*match)[4].matched) {
+      string dc_offset_raw, amplitude_raw, frequency_raw;
+      stringstream input((*match)[4].str());
+      if(!(input >> dc_offset_raw >> amplitude_raw >> frequency_raw)) {
+        return 2;
+      }
+      variant.values.push_back({suffix_parser(dc_offset_raw), suffix_parser(amplitude_raw), suffix_parser(frequency_raw)});
+    } else {
+      variant.values.push_back({suffix_parser((*match)[3].str()), 0.0, 0.0});
+    }
+  }
+  if(variant.sources.empty()) {
+    return 2;
+  }
+  netlist_network.stimulus_variants.push_back(variant);
+  return 0;
+}
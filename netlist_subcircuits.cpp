@@ -0,0 +1,186 @@
+#include "simulator.hpp"
+#include "dependencies.hpp"
+
+using namespace std;
+using namespace Eigen;
+
+// Subcircuit instances are expanded into ordinary netlist lines, which then go through parse_netlist_line.
+// Element names get the instance name appended (R1 in X3 => R1.X3), internal nodes get fresh node numbers.
+// Subcircuits made only of resistors are not expanded: their internal nodes are eliminated once per definition
+// (Schur complement of the nodal admittance matrix) and every instance only adds resistors between its ports.
+
+static const int max_subcircuit_depth = 64; // deeper nesting means a subcircuit that instantiates itself
+
+static bool is_purely_resistive(const subcircuit &definition) {
+  for(string line: definition.lines) {
+    if(line[0] != 'R') {
+      return false;
+    }
+  }
+  return !definition.lines.empty();
+}
+
+// Port admittance matrix of a resistive subcircuit, referenced to ground. Empty if an internal node floats.
+static MatrixXd reduce_resistive_subcircuit(const subcircuit &definition) {
+  // Ports come first, internal nodes after them. Ground has no row.
+  map<string,int> position;
+  for(int p = 0; p < definition.ports.size(); p++) {
+    position[definition.ports[p]] = p;
+  }
+  for(string line: definition.lines) {
+    string name, node1, node2;
+    stringstream input(line);
+    input >> name >> node1 >> node2;
+    for(string nd: {node1, node2}) {
+      if(nd != "0" && position.find(nd) == position.end()) {
+        int next = position.size();
+        position[nd] = next;
+      }
+    }
+  }
+
+  int ports = definition.ports.size();
+  int total = position.size();
+  MatrixXd Y = MatrixXd::Zero(total, total);
+  for(string line: definition.lines) {
+    string name, node1, node2, value;
+    stringstream input(line);
+    input >> name >> node1 >> node2 >> value;
+    double conductance = 1.0/suffix_parser(value);
+    int a = node1 == "0" ? -1 : position[node1];
+    int b = node2 == "0" ? -1 : position[node2];
+    if(a != -1) { Y(a,a) += conductance; }
+    if(b != -1) { Y(b,b) += conductance; }
+    if(a != -1 && b != -1) {
+      Y(a,b) -= conductance;
+      Y(b,a) -= conductance;
+    }
+  }
+
+  int internal = total - ports;
+  if(internal == 0) {
+    return Y;
+  }
+  MatrixXd Y_pp = Y.topLeftCorner(ports, ports);
+  MatrixXd Y_pi = Y.topRightCorner(ports, internal);
+  MatrixXd Y_ii = Y.bottomRightCorner(internal, internal);
+  // Y_ii is symmetric positive definite as long as every internal node is connected to a port or ground
+  LDLT<MatrixXd> ldlt(Y_ii);
+  // A zero pivot does not make the factorisation fail, and rcond() misses it
+  if(ldlt.info() != Success || !(ldlt.vectorD().cwiseAbs().minCoeff() > 1e-12 * ldlt.vectorD().cwiseAbs().maxCoeff())) {
+    return MatrixXd();
+  }
+  return Y_pp - Y_pi * ldlt.solve(Y_pi.transpose());
+}
+
+// Returns 0 on success, 2 on error
+static int expand_instance(network_simulation &netlist_network, string instance_line, string parent_suffix, int depth) {
+  vector<string> tokens;
+  string token;
+  stringstream input(instance_line);
+  while(input >> token) {
+    tokens.push_back(token);
+  }
+  string instance_name = tokens[0] + parent_suffix;
+  string subckt_name = tokens.back();
+  vector<string> instance_nodes(tokens.begin()+1, tokens.end()-1);
+
+  if(netlist_network.subcircuits.find(subckt_name) == netlist_network.subcircuits.end()) {
+    cout << "[ERROR] Unknown subcircuit: " << subckt_name << endl;
+    return 2;
+  }
+  const subcircuit &definition = netlist_network.subcircuits[subckt_name];
+  if(definition.ports.size() != instance_nodes.size()) {
+    cout << "[ERROR] Wrong number of nodes for subcircuit " << subckt_name << ": " << instance_line << endl;
+    return 2;
+  }
+  if(depth > max_subcircuit_depth) {
+    cout << "[ERROR] Subcircuits nested more than " << max_subcircuit_depth << " levels deep (" << subckt_name << " instantiates itself?)" << endl;
+    return 2;
+  }
+
+  if(is_purely_resistive(definition)) {
+    // Every instance of the same subcircuit shares one reduction
+    if(netlist_network.subcircuit_reductions.find(subckt_name) == netlist_network.subcircuit_reductions.end()) {
+      netlist_network.subcircuit_reductions[subckt_name] = reduce_resistive_subcircuit(definition);
+    }
+    MatrixXd Y = netlist_network.subcircuit_reductions[subckt_name];
+    if(Y.size() == 0) {
+      cout << "[ERROR] Subcircuit " << subckt_name << " has an internal node without a path to a port or ground" << endl;
+      return 2;
+    }
+
+    // Off-diagonal terms are resistors between ports, the row sums are resistors from a port to ground
+    int resistor_count = 0;
+    for(int p = 0; p < Y.rows(); p++) {
+      for(int q = p; q < Y.cols(); q++) {
+        double conductance = p == q ? Y.row(p).sum() : -Y(p,q);
+        string node_p = instance_nodes[p];
+        string node_q = p == q ? "0" : instance_nodes[q];
+        if(conductance <= 1e-12 * Y.diagonal().maxCoeff() || node_p == node_q) {
+          continue;
+        }
+        resistor_count++;
+        stringstream resistor_line;
+        resistor_line.precision(17);
+        resistor_line << "R" << resistor_count << "." << instance_name << " " << node_p << " " << node_q << " " << 1.0/conductance;
+        parse_netlist_line(netlist_network, resistor_line.str());
+      }
+    }
+    return 0;
+  }
+
+  // Port names map to the instance nodes, ground stays ground, every other node is new
+  map<string,string> node_names;
+  for(int p = 0; p < definition.ports.size(); p++) {
+    node_names[definition.ports[p]] = instance_nodes[p];
+  }
+  node_names["0"] = "0";
+  auto map_node = [&](string nd) {
+    if(node_names.find(nd) == node_names.end()) {
+      node_names[nd] = "N" + to_string(netlist_network.next_internal_node++);
+    }
+    return node_names[nd];
+  };
+
+  for(string line: definition.lines) {
+    vector<string> parts;
+    stringstream line_input(line);
+    while(line_input >> token) {
+      parts.push_back(token);
+    }
+    if(line[0] == 'X') {
+      // Nested instance: map its nodes and expand it with this instance as parent
+      string nested_line = parts[0];
+      for(int i = 1; i < parts.size()-1; i++) {
+        nested_line += " " + map_node(parts[i]);
+      }
+      nested_line += " " + parts.back();
+      if(expand_instance(netlist_network, nested_line, "." + instance_name, depth+1) != 0) {
+        return 2;
+      }
+      continue;
+    }
+    string element_line = parts[0] + "." + instance_name + " " + map_node(parts[1]) + " " + map_node(parts[2]);
+    for(int i = 3; i < parts.size(); i++) {
+      element_line += " " + parts[i];
+    }
+    if(parse_netlist_line(netlist_network, element_line) == 2) {
+      cout << "[ERROR] Incorrect line in subcircuit " << subckt_name << ": " << line << endl;
+      return 2;
+    }
+  }
+  return 0;
+}
+
+int expand_subcircuit_instances(network_simulation &netlist_network) {
+  int status = 0;
+  for(string instance_line: netlist_network.subcircuit_instances) {
+    if(expand_instance(netlist_network, instance_line, "", 1) != 0) {
+      netlist_network.subcircuit_errors++;
+      status = 2;
+    }
+  }
+  netlist_network.subcircuit_instances.clear();
+  return status;
+}
@@ -0,0 +1,421 @@
+#include "simulator.hpp"
+#include "dependencies.hpp"
+
+using namespace std;
+using namespace Eigen;
+
+// Reduction of linear RC subnetworks (TICER, time-constant based node elimination).
+// A node that only connects to resistors and capacitors is "quick" when its time constant C_node/G_node is well below the timestep.
+// Such a node is removed and its neighbours i,k are connected by
+//    g_ik = g_i*g_k / G_node        c_ik = (g_i*c_k + g_k*c_i) / G_node
+// which keeps all elements positive (the reduced network stays passive) and is exact for purely resistive nodes.
+// The voltage of a removed node is recovered after each solve as sum(g_i*V_i) / G_node.
+
+static const int max_eliminated_degree = 6; // more neighbours would add too many new elements
+
+// The working graph: components plus, for every node, the indices of the components attached to it
+class reduction_graph {
+  public:
+    vector<component> components;
+    vector<bool> removed;
+    map<int, vector<int>> attached;
+    int added = 0;
+};
+
+static vector<int> active_components(reduction_graph &graph, int node_index) {
+  vector<int> active;
+  for(int c: graph.attached[node_index]) {
+    if(!graph.removed[c]) {
+      active.push_back(c);
+    }
+  }
+  graph.attached[node_index] = active;
+  return active;
+}
+
+static int other_terminal(const component &cmp, int node_index) {
+  return cmp.connected_terminals[0].index == node_index ? cmp.connected_terminals[1].index : cmp.connected_terminals[0].index;
+}
+
+// Adds a resistor (as a conductance) or capacitor between a and b.
+// Capacitors are merged with an existing capacitor on the same nodes, as parallel capacitors become parallel voltage sources later.
+// A capacitor at a node with a voltage source would form a loop of voltage sources, so it is dropped (it only carries source current).
+// Resistors are only merged with resistors created by the reduction, so original resistor currents stay meaningful.
+static void add_element(reduction_graph &graph, char type, int a, int b, double value) {
+  if(a == b || value <= 0.0) {
+    return;
+  }
+  if(type == 'C') {
+    for(int end: {a, b}) {
+      for(int c: active_components(graph, end)) {
+        if(graph.components[c].component_name[0] == 'V') {
+          return;
+        }
+      }
+    }
+  }
+  for(int c: active_components(graph, a)) {
+    component &cmp = graph.components[c];
+    if(cmp.component_name[0] != type || other_terminal(cmp, a) != b) {
+      continue;
+    }
+    if(type == 'C') {
+      cmp.component_value[0] += value;
+      return;
+    }
+    if(cmp.component_name.find(".MOR") != string::npos) {
+      cmp.component_value[0] = 1.0/(1.0/cmp.component_value[0] + value);
+      return;
+    }
+  }
+
+  graph.added++;
+  string name = string(1, type) + to_string(graph.added) + ".MOR";
+  vector<node> terminals = {node(a), node(b)};
+  if(type == 'R') {
+    graph.components.push_back(R(name, 1.0/value, terminals));
+  } else {
+    graph.components.push_back(C(name, value, terminals));
+  }
+  graph.removed.push_back(false);
+  graph.attached[a].push_back(graph.components.size()-1);
+  graph.attached[b].push_back(graph.components.size()-1);
+}
+
+// Rebuilds network_nodes from the component list, in the same order as the parser creates them
+void rebuild_network_nodes(network_simulation &sim) {
+  sim.network_nodes.clear();
+  for(const component &cmp: sim.network_components) {
+    push_nodes_with_component(sim, {node(cmp.connected_terminals[0].index), node(cmp.connected_terminals[1].index)}, cmp);
+  }
+}
+
+int reduce_rc_network(network_simulation &sim) {
+  reduction_graph graph;
+  graph.components = sim.network_components;
+  graph.removed = vector<bool>(graph.components.size(), false);
+  for(int c = 0; c < graph.components.size(); c++) {
+    graph.attached[graph.components[c].connected_terminals[0].index].push_back(c);
+    graph.attached[graph.components[c].connected_terminals[1].index].push_back(c);
+  }
+
+  set<int> probed(sim.probed_nodes.begin(), sim.probed_nodes.end());
+  double max_time_constant = sim.rc_reduction_tol * sim.timestep;
+  int eliminated = 0;
+
+  for(const node &candidate: sim.network_nodes) {
+    int n = candidate.index;
+    if(n == 0 || probed.count(n)) {
+      continue;
+    }
+    vector<int> cmps = active_components(graph, n);
+
+    // Only linear RC nodes whose capacitors go to ground (no floating capacitors are created that way); sources and inductors pin a node
+    map<int,double> g, c;
+    bool eligible = !cmps.empty();
+    for(int i: cmps) {
+      const component &cmp = graph.components[i];
+      int neighbour = other_terminal(cmp, n);
+      if(neighbour == n) {
+        eligible = false;
+      } else if(cmp.component_name[0] == 'R') {
+        g[neighbour] += 1.0/cmp.component_value[0];
+      } else if(cmp.component_name[0] == 'C' && neighbour == 0) {
+        c[neighbour] += cmp.component_value[0];
+      } else {
+        eligible = false;
+      }
+    }
+    if(!eligible || g.empty()) {
+      continue;
+    }
+    set<int> neighbours;
+    double G_node = 0.0, C_node = 0.0;
+    for(auto &term: g) { neighbours.insert(term.first); G_node += term.second; }
+    for(auto &term: c) { neighbours.insert(term.first); C_node += term.second; }
+    if(neighbours.size() > max_eliminated_degree || C_node / G_node > max_time_constant) {
+      continue;
+    }
+
+    for(int i: cmps) {
+      graph.removed[i] = true;
+    }
+    vector<int> neighbour_list(neighbours.begin(), neighbours.end());
+    for(int a = 0; a < neighbour_list.size(); a++) {
+      for(int b = a+1; b < neighbour_list.size(); b++) {
+        int i = neighbour_list[a], k = neighbour_list[b];
+        add_element(graph, 'R', i, k, g[i]*g[k] / G_node);
+        add_element(graph, 'C', i, k, (g[i]*c[k] + g[k]*c[i]) / G_node);
+      }
+    }
+
+    // Quasi-static voltage of the removed node, used to write it to the output
+    eliminated_node removed_node;
+    removed_node.index = n;
+    for(auto &term: g) {
+      removed_node.neighbours.push_back(term.first);
+      removed_node.weights.push_back(term.second / G_node);
+    }
+    sim.eliminated_nodes.push_back(removed_node);
+    eliminated++;
+  }
+
+  sim.network_components.clear();
+  for(int i = 0; i < graph.components.size(); i++) {
+    if(!graph.removed[i]) {
+      sim.network_components.push_back(graph.components[i]);
+    }
+  }
+  rebuild_network_nodes(sim);
+  return eliminated;
+}
+
+vector<double> reconstruct_eliminated_voltages(const network_simulation &sim, const vector<node> &Vvector) {
+  map<int,double> voltage;
+  voltage[0] = 0.0;
+  for(const node &nd: Vvector) {
+    voltage[nd.index] = nd.node_voltage;
+  }
+  // A removed node only refers to nodes that were still present when it was removed, so go backwards
+  for(int e = sim.eliminated_nodes.size()-1; e >= 0; e--) {
+    const eliminated_node &removed_node = sim.eliminated_nodes[e];
+    double v = 0.0;
+    for(int i = 0; i < removed_node.neighbours.size(); i++) {
+      v += removed_node.weights[i] * voltage[removed_node.neighbours[i]];
+    }
+    voltage[removed_node.index] = v;
+  }
+
+  vector<double> voltages;
+  for(const eliminated_node &removed_node: sim.eliminated_nodes) {
+    voltages.push_back(voltage[removed_node.index]);
+  }
+  return voltages;
+}
+
+// Merging of series and parallel elements, before the RC reduction.
+//    series:    two resistors that are the only components of a node become one, R = R1 + R2
+//    parallel:  resistors, capacitors or inductors of the same kind between the same two nodes become one,
+//               R = 1/(1/R1 + 1/R2), C = C1 + C2, L = 1/(1/L1 + 1/L2)
+//    dangling:  a resistor, capacitor or inductor that is the only component of a node carries no current and is removed
+// Probed nodes are never removed. The voltage of a removed node is the weighted sum of its neighbours' voltages (the voltage
+// divider of the two resistors, or the voltage at the other end of a dangling element), so it is written to the output like the
+// nodes of the RC reduction. The current of a merged component is a fixed fraction of the current of the element it was merged
+// into: the whole current in series, the share of the conductance (1/R, C or 1/L) in parallel, with the sign of its orientation.
+
+// Share of a parallel element in the current of the merged element
+static double parallel_admittance(const component &cmp) {
+  return cmp.component_name[0] == 'C' ? cmp.component_value[0] : 1.0/cmp.component_value[0];
+}
+
+// Replaces the components in merged_from by one element between a and b, named <type><n>.MRG
+static int add_merged_element(reduction_graph &graph, const vector<int> &merged_from, int a, int b, double value) {
+  component merged = graph.components[merged_from[0]];
+  graph.added++;
+  merged.component_name = string(1, merged.component_name[0]) + to_string(graph.added) + ".MRG";
+  merged.component_value[0] = value;
+  merged.connected_terminals = {node(a), node(b)};
+  for(int c: merged_from) {
+    graph.removed[c] = true;
+  }
+  graph.components.push_back(merged);
+  graph.removed.push_back(false);
+  graph.attached[a].push_back(graph.components.size()-1);
+  graph.attached[b].push_back(graph.components.size()-1);
+  return graph.components.size()-1;
+}
+
+static void record_merge(network_simulation &sim, const component &cmp, const component &into, double factor) {
+  merged_element element;
+  element.name = cmp.component_name;
+  element.into = into.component_name;
+  element.factor = cmp.connected_terminals[0].index == into.connected_terminals[0].index ? factor : -factor;
+  sim.merged_elements.push_back(element);
+}
+
+int merge_series_parallel(network_simulation &sim) {
+  reduction_graph graph;
+  graph.components = sim.network_components;
+  graph.removed = vector<bool>(graph.components.size(), false);
+  for(int c = 0; c < graph.components.size(); c++) {
+    graph.attached[graph.components[c].connected_terminals[0].index].push_back(c);
+    graph.attached[graph.components[c].connected_terminals[1].index].push_back(c);
+  }
+  for(const component &cmp: sim.network_components) {
+    sim.original_components.push_back(cmp.component_name);
+  }
+  set<int> probed(sim.probed_nodes.begin(), sim.probed_nodes.end());
+  int merged = 0;
+
+  // Every merge can make another one possible (parallel resistors in series, ...), so repeat until nothing changes
+  bool changed = true;
+  while(changed) {
+    changed = false;
+
+    // Parallel elements, by kind and node pair. Elements merged in this pass are only looked at again in the next one.
+    map<tuple<char,int,int>, int> elements;
+    int count = graph.components.size();
+    for(int c = 0; c < count; c++) {
+      char type = graph.components[c].component_name[0];
+      int a = graph.components[c].connected_terminals[0].index;
+      int b = graph.components[c].connected_terminals[1].index;
+      if(graph.removed[c] || a == b || (type != 'R' && type != 'C' && type != 'L')) {
+        continue;
+      }
+      tuple<char,int,int> key(type, min(a, b), max(a, b));
+      if(!elements.count(key)) {
+        elements[key] = c;
+        continue;
+      }
+      int first = elements[key];
+      double share_first = parallel_admittance(graph.components[first]);
+      double share = parallel_admittance(graph.components[c]);
+      double total = share_first + share;
+      int m = add_merged_element(graph, {first, c}, graph.components[first].connected_terminals[0].index,
+                                 graph.components[first].connected_terminals[1].index, type == 'C' ? total : 1.0/total);
+      record_merge(sim, graph.components[first], graph.components[m], share_first / total);
+      record_merge(sim, graph.components[c], graph.components[m], share / total);
+      elements[key] = m;
+      merged++;
+      changed = true;
+    }
+
+    for(const node &candidate: sim.network_nodes) {
+      int n = candidate.index;
+      if(n == 0 || probed.count(n)) {
+        continue;
+      }
+      vector<int> cmps = active_components(graph, n);
+
+      // Dangling element: the node follows the other end
+      if(cmps.size() == 1) {
+        const component &cmp = graph.components[cmps[0]];
+        char type = cmp.component_name[0];
+        int other = other_terminal(cmp, n);
+        if(other == n || (type != 'R' && type != 'C' && type != 'L')) {
+          continue;
+        }
+        graph.removed[cmps[0]] = true;
+        merged_element element;
+        element.name = cmp.component_name;
+        element.factor = 0.0;
+        sim.merged_elements.push_back(element);
+        eliminated_node removed_node;
+        removed_node.index = n;
+        removed_node.neighbours = {other};
+        removed_node.weights = {1.0};
+        sim.eliminated_nodes.push_back(removed_node);
+        merged++;
+        changed = true;
+        continue;
+      }
+
+      // Series resistors: the node divides the voltage between the far ends a and b
+      if(cmps.size() != 2 || graph.components[cmps[0]].component_name[0] != 'R' || graph.components[cmps[1]].component_name[0] != 'R') {
+        continue;
+      }
+      int a = other_terminal(graph.components[cmps[0]], n);
+      int b = other_terminal(graph.components[cmps[1]], n);
+      if(a == n || b == n || a == b) {
+        continue;
+      }
+      double R_a = graph.components[cmps[0]].component_value[0];
+      double R_b = graph.components[cmps[1]].component_value[0];
+      int m = add_merged_element(graph, cmps, a, b, R_a + R_b);
+      // The merged resistor's current flows from a to b, through the first resistor into n and out through the second
+      for(int k = 0; k < 2; k++) {
+        const component &cmp = graph.components[cmps[k]];
+        merged_element element;
+        element.name = cmp.component_name;
+        element.into = graph.components[m].component_name;
+        bool towards_b = (k == 0) == (cmp.connected_terminals[1].index == n);
+        element.factor = towards_b ? 1.0 : -1.0;
+        sim.merged_elements.push_back(element);
+      }
+      eliminated_node removed_node;
+      removed_node.index = n;
+      removed_node.neighbours = {a, b};
+      removed_node.weights = {R_b / (R_a + R_b), R_a / (R_a + R_b)};
+      sim.eliminated_nodes.push_back(removed_node);
+      merged++;
+      changed = true;
+    }
+  }
+
+  sim.network_components.clear();
+  for(int i = 0; i < graph.components.size(); i++) {
+    if(!graph.removed[i]) {
+      sim.network_components.push_back(graph.components[i]);
+    }
+  }
+  rebuild_network_nodes(sim);
+  sim.merged_components = sim.network_components;
+  return merged;
+}
+
+// Name of a component's current column, after capacitors and inductors became sources
+static string current_column_name(string name) {
+  if(name[0] == 'C') {
+    return "V_" + name;
+  }
+  if(name[0] == 'L') {
+    return "I_" + name;
+  }
+  return name;
+}
+
+vector<string> map_merged_currents(network_simulation &sim, const vector<string> &voltage_columns) {
+  // Where the current of every merged component comes from, following merged elements that were merged again
+  map<string, pair<string,double>> sources;
+  for(const merged_element &element: sim.merged_elements) {
+    sources[element.name] = make_pair(element.into, element.factor);
+  }
+  map<string,int> columns;
+  for(int c = 0; c < sim.network_components.size(); c++) {
+    columns[sim.network_components[c].component_name] = c;
+  }
+  // Elements the RC reduction removed after the merging
+  map<string,int> merged_network;
+  for(int c = 0; c < sim.merged_components.size(); c++) {
+    merged_network[sim.merged_components[c].component_name] = c;
+  }
+  auto voltage_column = [&voltage_columns](int node_index) {
+    if(node_index == 0) {
+      return -1;
+    }
+    return int(find(voltage_columns.begin(), voltage_columns.end(), to_string(node_index)) - voltage_columns.begin());
+  };
+
+  vector<string> column_names;
+  sim.current_columns.clear();
+  sim.current_factors.clear();
+  sim.current_voltage_columns.clear();
+  for(const string &name: sim.original_components) {
+    string source = name;
+    double factor = 1.0;
+    while(!source.empty() && sources.count(source)) {
+      factor *= sources[source].second;
+      source = sources[source].first;
+    }
+    column_names.push_back(current_column_name(name));
+    int column = -1;
+    pair<int,int> voltages(-1, -1);
+    map<string,int>::iterator present = source.empty() ? columns.end() : columns.find(current_column_name(source));
+    map<string,int>::iterator removed = source.empty() ? merged_network.end() : merged_network.find(source);
+    if(present != columns.end()) {
+      column = present->second;
+    } else if(removed != merged_network.end() && source[0] == 'R') {
+      // A resistor removed by the RC reduction: (V0 - V1)/R from the written (or reconstructed) node voltages
+      const component &resistor = sim.merged_components[removed->second];
+      factor /= resistor.component_value[0];
+      voltages = make_pair(voltage_column(resistor.connected_terminals[0].index), voltage_column(resistor.connected_terminals[1].index));
+    } else {
+      // Dangling elements, and capacitors removed by the RC reduction (quasi-static nodes carry no capacitor current)
+      factor = 0.0;
+    }
+    sim.current_columns.push_back(column);
+    sim.current_factors.push_back(factor);
+    sim.current_voltage_columns.push_back(voltages);
+  }
+  return column_names;
+}
@@ -0,0 +1,162 @@
+#include "simulator.hpp"
+#include "dependencies.hpp"
+
+#include <thread>
+
+using namespace std;
+using namespace Eigen;
+
+// Parareal: parallel-in-time integration of long transients.
+// The timesteps are split into slices. The state of the circuit at a slice boundary is the vector of C/L states.
+//  - The coarse propagator is the same update with parareal_coarse timesteps per step. It is cheap, so it runs serially over
+//    all slices and predicts the states at their boundaries.
+//  - The fine propagators run the normal timesteps of every slice concurrently, each from the predicted state at its start.
+//  - The prediction is corrected with U[n+1] = Coarse(U_new[n]) + Fine(U_old[n]) - Coarse(U_old[n]), serially again.
+// This repeats until no boundary state changes by more than parareal_tol (relative to the largest state). Slices whose start
+// state did not change are not run again. A slice is final once its fine run started from the fine end state of the final
+// slice before it (the first slice always is), so after k iterations at least the first k slices are final and it ends
+// after at most one iteration per slice. The rows of a final slice are passed on right away and dropped; only the slices
+// that may still be corrected keep theirs, and the remaining ones are passed on after the last iteration.
+// The coarse runs are predictions only: their solves are not checked, counted or traced.
+
+class parareal_slice {
+  public:
+    long first_step, end_step; // timestep numbers, the slice covers [first_step, end_step)
+    vector<double> start_state;
+    vector<double> fine_start_state, fine_end_state; // start and end of the last fine run
+    vector<double> coarse_end_state;
+    bool fine_run = false;
+    vector<pair<double, vector<double>>> rows; // output rows of the last fine run, until they are passed on
+};
+
+// Runs the timesteps [first_step, end_step) from state, stride timesteps at a time. Returns the state at the end.
+static vector<double> propagate(network_simulation &sim, network_solver &solver, vector<node> &Vvector, const vector<double> &state,
+                                long first_step, long end_step, long stride, double time_step, vector<pair<double, vector<double>>> *rows) {
+  write_reactive_states(sim, state);
+  for(long step = first_step; step < end_step; step += stride) {
+    long steps = min(stride, end_step - step);
+    double simulation_progress = step * time_step;
+    vector<double> current_through_cmps = simulate_timestep(sim, solver, Vvector, simulation_progress, steps * time_step);
+    if(rows) {
+      rows->push_back(make_pair(simulation_progress, output_row_values(sim, Vvector, current_through_cmps)));
+    }
+  }
+  return read_reactive_states(sim);
+}
+
+int run_parareal(network_simulation &sim, network_solver &solver, vector<node> &Vvector, double stoptime, double time_step,
+                 function<void(double, const vector<double>&)> row) {
+  // The same number of timesteps as the serial loop
+  long total_steps = 0;
+  for(double simulation_progress = 0; simulation_progress <= stoptime; simulation_progress += time_step) {
+    total_steps++;
+  }
+  int slice_count = max(1L, min<long>(sim.parareal_slices, total_steps));
+  int threads = sim.assembly_threads > 0 ? sim.assembly_threads : max(1u, thread::hardware_concurrency());
+
+  // Every slice has its own copy of the circuit (the C/L states live in its components). The factorised solver is only read.
+  vector<parareal_slice> slices(slice_count);
+  deque<network_simulation> slice_sims;
+  vector<vector<node>> slice_Vvectors(slice_count, Vvector);
+  for(int n = 0; n < slice_count; n++) {
+    slices[n].first_step = total_steps * n / slice_count;
+    slices[n].end_step = total_steps * (n+1) / slice_count;
+    slice_sims.push_back(sim);
+    slice_sims.back().assembly_threads = 1;
+  }
+  network_simulation coarse_sim = sim;
+  coarse_sim.solver_checks = false;
+  vector<node> coarse_Vvector = Vvector;
+
+  // Initial prediction
+  vector<double> state = read_reactive_states(sim);
+  for(parareal_slice &slice: slices) {
+    slice.start_state = state;
+    slice.coarse_end_state = propagate(coarse_sim, solver, coarse_Vvector, state, slice.first_step, slice.end_step, sim.parareal_coarse, time_step, nullptr);
+    state = slice.coarse_end_state;
+  }
+
+  int iteration = 0;
+  int final_slices = 0; // slices [0, final_slices) are final and their rows passed on
+  bool converged = false;
+  while(!converged) {
+    iteration++;
+
+    // Fine runs of all slices whose start state changed, concurrently
+    vector<int> pending;
+    for(int n = final_slices; n < slice_count; n++) {
+      if(!slices[n].fine_run || slices[n].fine_start_state != slices[n].start_state) {
+        pending.push_back(n);
+      }
+    }
+    vector<thread> workers;
+    string *messages = thread_message_capture();
+    for(int worker = 0; worker < min<int>(threads, pending.size()); worker++) {
+      workers.push_back(thread([&, worker]() {
+        thread_message_capture() = messages;
+        for(int p = worker; p < pending.size(); p += threads) {
+          parareal_slice &slice = slices[pending[p]];
+          slice.rows.clear();
+          slice.fine_run = true;
+          slice.fine_start_state = slice.start_state;
+          slice.fine_end_state = propagate(slice_sims[pending[p]], solver, slice_Vvectors[pending[p]], slice.start_state, slice.first_step, slice.end_step, 1, time_step, &slice.rows);
+        }
+      }));
+    }
+    for(thread &worker: workers) {
+      worker.join();
+    }
+    if(solver.failed) {
+      cout << "[ERROR] Parareal stopped in iteration " << iteration << endl;
+      return 1;
+    }
+
+    // Slices that became final
+    while(final_slices < slice_count && (final_slices == 0 || slices[final_slices].fine_start_state == slices[final_slices-1].fine_end_state)) {
+      for(const pair<double, vector<double>> &slice_row: slices[final_slices].rows) {
+        row(slice_row.first, slice_row.second);
+      }
+      vector<pair<double, vector<double>>>().swap(slices[final_slices].rows);
+      final_slices++;
+    }
+    if(final_slices == slice_count) {
+      break;
+    }
+
+    // Serial correction. The slice after a final one starts exactly at its fine end state (the coarse terms of the
+    // correction cancel, but not exactly in floating point).
+    double change = 0.0, scale = 0.0;
+    state = slices[final_slices-1].fine_end_state;
+    for(int n = final_slices; n < slice_count; n++) {
+      parareal_slice &slice = slices[n];
+      for(int s = 0; s < state.size(); s++) {
+        if(!isfinite(state[s])) {
+          cout << "[ERROR] Parareal diverged, the coarse step is too large (lower parareal_coarse)" << endl;
+          return 1;
+        }
+        change = max(change, fabs(state[s] - slice.start_state[s]));
+        scale = max(scale, fabs(state[s]));
+      }
+      slice.start_state = state;
+      vector<double> coarse_end_state = propagate(coarse_sim, solver, coarse_Vvector, state, slice.first_step, slice.end_step, sim.parareal_coarse, time_step, nullptr);
+      for(int s = 0; s < state.size(); s++) {
+        state[s] = coarse_end_state[s] + slice.fine_end_state[s] - slice.coarse_end_state[s];
+      }
+      slice.coarse_end_state = coarse_end_state;
+    }
+    converged = change <= sim.parareal_tolerance * max(scale, 1e-12) || iteration >= slice_count;
+  }
+  if(sim.verbose) {
+    cout << "Parareal: " << slice_count << " slices on " << min(threads, slice_count) << " threads, converged after " << iteration << " iterations" << endl;
+  }
+
+  // The fine runs of the last iteration started from the converged states
+  for(int n = final_slices; n < slice_count; n++) {
+    for(const pair<double, vector<double>> &slice_row: slices[n].rows) {
+      row(slice_row.first, slice_row.second);
+    }
+  }
+  write_reactive_states(sim, slices.back().fine_end_state);
+  Vvector = slice_Vvectors.back();
+  return 0;
+}
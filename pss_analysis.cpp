@@ -0,0 +1,87 @@
+#include "simulator.hpp"
+#include "dependencies.hpp"
+
+using namespace std;
+using namespace Eigen;
+
+// Periodic steady state analysis (shooting method).
+// The state of the circuit is the set of C/L source equivalent values. Simulating one period maps a start state x to phi(x).
+// The periodic solution satisfies phi(x) = x, which is solved with Newton's method:
+//    (J - 1) dx = -(phi(x) - x),  J = d phi / dx  (one perturbed period per state)
+// For the linear circuits of this simulator phi is affine, so a single Newton step lands on the periodic orbit.
+
+static const int pss_max_iterations = 10;
+
+double lowest_sine_frequency(const network_simulation &sim) {
+  double fundamental = 0.0;
+  for(const component &cmp: sim.network_components) {
+    if((cmp.component_name[0] == 'V' || cmp.component_name[0] == 'I') && cmp.component_name[1] != '_') {
+      if(cmp.component_value[1] != 0.0 && cmp.component_value[2] > 0.0 && (fundamental == 0.0 || cmp.component_value[2] < fundamental)) {
+        fundamental = cmp.component_value[2];
+      }
+    }
+  }
+  return fundamental;
+}
+
+// .pss <frequency>, or the lowest frequency of all SINE sources
+static double pss_fundamental(const network_simulation &sim) {
+  if(sim.pss_frequency > 0.0) {
+    return sim.pss_frequency;
+  }
+  return lowest_sine_frequency(sim);
+}
+
+// Runs one period starting from the given C/L states and returns the states at its end
+static VectorXd simulate_period(network_simulation sim, network_solver &solver, vector<node> Vvector, const VectorXd &states, int steps, double time_step) {
+  write_reactive_states(sim, vector<double>(states.data(), states.data() + states.size()));
+  for(int k = 0; k < steps; k++) {
+    simulate_timestep(sim, solver, Vvector, k*time_step, time_step);
+  }
+  vector<double> end_states = read_reactive_states(sim);
+  return Map<VectorXd>(end_states.data(), end_states.size());
+}
+
+double find_periodic_steady_state(network_simulation &sim, network_solver &solver, vector<node> &Vvector) {
+  double fundamental = pss_fundamental(sim);
+  if(fundamental <= 0.0) {
+    cout << "[ERROR] .pss needs a frequency or a SINE source" << endl;
+    return 0.0;
+  }
+  double period = 1.0 / fundamental;
+  int steps = max(1.0, round(period / sim.timestep));
+  double time_step = period / steps;
+
+  vector<double> initial_states = read_reactive_states(sim);
+  VectorXd x = Map<VectorXd>(initial_states.data(), initial_states.size());
+  int n = x.size();
+  int periods_simulated = 0;
+
+  for(int iteration = 0; iteration < pss_max_iterations; iteration++) {
+    VectorXd phi = simulate_period(sim, solver, Vvector, x, steps, time_step);
+    periods_simulated++;
+    VectorXd residual = phi - x;
+    if(residual.norm() <= sim.pss_tolerance * (1.0 + x.norm())) {
+      break;
+    }
+
+    // Jacobian of the period map by perturbing each state
+    MatrixXd J(n, n);
+    for(int j = 0; j < n; j++) {
+      double h = 1e-3 * max(1.0, fabs(x(j)));
+      VectorXd perturbed = x;
+      perturbed(j) += h;
+      J.col(j) = (simulate_period(sim, solver, Vvector, perturbed, steps, time_step) - phi) / h;
+      periods_simulated++;
+    }
+    x += (J - MatrixXd::Identity(n, n)).partialPivLu().solve(-residual);
+
+    if(iteration == pss_max_iterations-1) {
+      cout << "[WARNING] Periodic steady state did not converge" << endl;
+    }
+  }
+
+  write_reactive_states(sim, vector<double>(x.data(), x.data() + x.size()));
+  cout << "Periodic steady state (period " << period << "s) found after " << periods_simulated << " simulated periods" << endl;
+  return period;
+}
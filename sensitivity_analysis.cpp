@@ -0,0 +1,361 @@
+#include "simulator.hpp"
+#include "dependencies.hpp"
+
+using namespace std;
+using namespace Eigen;
+
+// Adjoint sensitivity analysis (.sens).
+// Every timestep of the transient is the MNA system K*z_k = R*x_k + s(t_k) for z = [node voltages; voltage source currents],
+// followed by the forward Euler update x_k+1 = x_k + dt*D*S*z_k of the C/L states x (C: -i/C, L: +v/L).
+// For an output y = c^T z_N (a node voltage at the last timestep) the adjoint runs backwards in time:
+//    K^T nu_k = c (k = N)  or  S^T D^T dt mu_k+1 (k < N)        mu_k = mu_k+1 + R^T nu_k
+// where mu_k = dy/dx_k. The derivatives are then sums over all timesteps:
+//    dy/dR = sum (nu_a - nu_b)(V_a - V_b) / R^2      dy/dC = sum mu_k+1 dt i_k / C^2      dy/dL = -sum mu_k+1 dt v_k / L^2
+// Both systems are solved with the solver the time loop prepared. The forward one is a timestep of the simulator (node voltages
+// from the nodal G, currents by back-substitution). The transposed one is a circuit too: with K = [G_R -B; B^T 0],
+// K^T [nu_v; nu_i] = [w_v; w_i] is K [nu_v; -nu_i] = [w_v; -w_i], i.e. the same circuit with the currents w_v injected
+// into the nodes and the voltage sources set to -w_i, so no transposed factorisation is needed. All outputs are solved at
+// once as columns of one right-hand side. The forward solution is not stored: only the states at every
+// sensitivity_checkpoint-th timestep are kept, and each segment is simulated again just before it is walked backwards.
+// Initial states (zero, or from .pss) are treated as fixed.
+
+static const int sensitivity_checkpoint = 100; // timesteps between stored states
+static const double sensitivity_check_step = 1e-4; // relative perturbation of sens_check
+static const double sensitivity_check_tolerance = 1e-4; // largest relative difference sens_check accepts
+
+// The MNA unknowns of the prepared solver: rows 0..nodes-1 are node voltages, then one row per voltage source
+class sensitivity_model {
+  public:
+    network_solver *solver = nullptr;
+    network_simulation sim; // solver_checks off, the extra solves are not part of the output
+    int nodes = 0;
+    map<int,int> row_of_node;
+    vector<int> branch_row; // per component, -1 if it is not a voltage source
+    vector<int> states; // C/L equivalents, in the order of read_reactive_states
+    vector<int> injected_column; // per component, its column of solver.source_injection (-1 if none)
+    vector<int> kcl_rows; // per node row, the nodal row that sums its currents (-1 for nodes with a grounded voltage source)
+};
+
+static void build_sensitivity_model(sensitivity_model &model, const network_simulation &sim, network_solver &solver) {
+  model.solver = &solver;
+  model.sim = sim;
+  model.sim.solver_checks = false;
+  if(solver.injected_sources.empty()) {
+    prepare_source_injection(solver, sim);
+  }
+
+  vector<node> Vvector = create_v_matrix(sim);
+  model.nodes = Vvector.size();
+  for(int row = 0; row < Vvector.size(); row++) {
+    model.row_of_node[Vvector[row].index] = row;
+  }
+  model.branch_row.assign(sim.network_components.size(), -1);
+  for(int k = 0; k < solver.branch_components.size(); k++) {
+    model.branch_row[solver.branch_components[k]] = model.nodes + k;
+  }
+  model.injected_column.assign(sim.network_components.size(), -1);
+  for(int s = 0; s < solver.injected_sources.size(); s++) {
+    model.injected_column[solver.injected_sources[s]] = s;
+  }
+  for(int c = 0; c < sim.network_components.size(); c++) {
+    if(sim.network_components[c].component_name[1] == '_') {
+      model.states.push_back(c);
+    }
+  }
+
+  // The rows of create_i_matrix: a node with a grounded voltage source has no current row, and the currents of both nodes
+  // of a supernode are summed in the row of its second node
+  model.kcl_rows.resize(model.nodes);
+  node reference_node(0);
+  for(int row = 0; row < Vvector.size(); row++) {
+    model.kcl_rows[row] = is_a_node_voltage_known(Vvector[row], reference_node) ? -1 : row;
+  }
+  for(const pair<node,node> &supernode: supernode_separation(sim.network_components, reference_node)) {
+    int first = model.row_of_node.at(supernode.first.index);
+    int second = model.row_of_node.at(supernode.second.index);
+    model.kcl_rows[first] = second;
+  }
+}
+
+// Row of terminal t of component c, -1 for ground
+static int terminal_row(const sensitivity_model &model, int c, int t) {
+  return model.solver->terminal_rows[2*c+t];
+}
+
+// z_k for the states x at time t
+static VectorXd solve_forward_step(sensitivity_model &model, const VectorXd &x, double t) {
+  const network_solver &solver = *model.solver;
+  vector<double> state_value(model.sim.network_components.size(), 0.0);
+  for(int s = 0; s < model.states.size(); s++) {
+    state_value[model.states[s]] = x(s);
+  }
+  VectorXd values(solver.injected_sources.size());
+  for(int s = 0; s < solver.injected_sources.size(); s++) {
+    int c = solver.injected_sources[s];
+    const component &cmp = model.sim.network_components[c];
+    values(s) = cmp.component_name[1] == '_' ? state_value[c] : source_value(cmp, t);
+  }
+  VectorXd V = solve_prepared_system(*model.solver, model.sim, solver.source_injection * values);
+
+  // Currents leaving every node through resistors and current sources, the voltage source currents carry them away
+  VectorXd leaving = solver.resistor_G * V;
+  for(int s = 0; s < solver.injected_sources.size(); s++) {
+    int c = solver.injected_sources[s];
+    if(model.sim.network_components[c].component_name[0] != 'I') {
+      continue;
+    }
+    if(terminal_row(model, c, 0) != -1) { leaving(terminal_row(model, c, 0)) += values(s); }
+    if(terminal_row(model, c, 1) != -1) { leaving(terminal_row(model, c, 1)) -= values(s); }
+  }
+  VectorXd z(model.nodes + solver.branch_components.size());
+  z << V, back_substitute_branch_currents(solver, leaving);
+  return z;
+}
+
+// [nu_v; nu_i] = K^T \ w, one column per output
+static MatrixXd solve_adjoint_step(sensitivity_model &model, const MatrixXd &w) {
+  const network_solver &solver = *model.solver;
+  int outputs = w.cols();
+  MatrixXd w_v = w.topRows(model.nodes);
+  MatrixXd source_values = MatrixXd::Zero(solver.injected_sources.size(), outputs);
+  for(int k = 0; k < solver.branch_components.size(); k++) {
+    source_values.row(model.injected_column[solver.branch_components[k]]) = -w.row(model.nodes + k);
+  }
+  MatrixXd I = solver.source_injection * source_values;
+  for(int row = 0; row < model.nodes; row++) {
+    if(model.kcl_rows[row] != -1) {
+      I.row(model.kcl_rows[row]) += w_v.row(row);
+    }
+  }
+  MatrixXd nu(w.rows(), outputs);
+  nu.topRows(model.nodes) = solve_prepared_system(*model.solver, model.sim, I);
+  nu.bottomRows(solver.branch_components.size()) = -back_substitute_branch_currents(solver, solver.resistor_G * nu.topRows(model.nodes) - w_v);
+  return nu;
+}
+
+// Voltage across component c from z
+static double voltage_across(const sensitivity_model &model, int c, const VectorXd &z) {
+  int a = terminal_row(model, c, 0);
+  int b = terminal_row(model, c, 1);
+  return (a == -1 ? 0.0 : z(a)) - (b == -1 ? 0.0 : z(b));
+}
+
+// x_k+1 from x_k and z_k, the same forward Euler step as update_source_equivalents
+static VectorXd next_states(const sensitivity_model &model, const VectorXd &x, const VectorXd &z, double time_step) {
+  VectorXd next = x;
+  for(int s = 0; s < model.states.size(); s++) {
+    int c = model.states[s];
+    const component &cmp = model.sim.network_components[c];
+    double value = model.sim.cl_values.at(cmp.component_name);
+    if(cmp.component_name[0] == 'V') {
+      next(s) -= z(model.branch_row[c]) / value * time_step;
+    } else {
+      next(s) += voltage_across(model, c, z) / value * time_step;
+    }
+  }
+  return next;
+}
+
+// The .sens node voltages at the last time point, from the initial states of model.sim
+static VectorXd simulate_outputs(sensitivity_model &model, const vector<double> &times, double time_step, vector<VectorXd> *checkpoints) {
+  vector<double> initial_states = read_reactive_states(model.sim);
+  VectorXd x = Map<VectorXd>(initial_states.data(), initial_states.size());
+  VectorXd outputs(model.sim.sensitivity_nodes.size());
+  for(int k = 0; k < times.size(); k++) {
+    if(checkpoints && k % sensitivity_checkpoint == 0) {
+      checkpoints->push_back(x);
+    }
+    VectorXd z = solve_forward_step(model, x, times[k]);
+    if(k == times.size()-1) {
+      for(int o = 0; o < outputs.size(); o++) {
+        outputs(o) = z(model.row_of_node.at(model.sim.sensitivity_nodes[o]));
+      }
+    }
+    x = next_states(model, x, z, time_step);
+  }
+  return outputs;
+}
+
+// sens_check: every derivative against a central difference of two transients with the component value perturbed.
+// Returns the largest difference, relative to the largest derivative of the same output.
+static double check_sensitivities(const network_simulation &sim, const vector<double> &times, double time_step, const vector<VectorXd> &gradient) {
+  int outputs = sim.sensitivity_nodes.size();
+  VectorXd scale = VectorXd::Zero(outputs);
+  for(const VectorXd &derivatives: gradient) {
+    scale = scale.cwiseMax(derivatives.cwiseAbs());
+  }
+
+  double max_difference = 0.0;
+  for(int c = 0; c < sim.network_components.size(); c++) {
+    const component &cmp = sim.network_components[c];
+    bool reactive = cmp.component_name[1] == '_';
+    if(cmp.component_name[0] != 'R' && !reactive) {
+      continue;
+    }
+    double value = reactive ? sim.cl_values.at(cmp.component_name) : cmp.component_value[0];
+    double step = value * sensitivity_check_step;
+    VectorXd perturbed_outputs[2];
+    for(int side = 0; side < 2; side++) {
+      network_simulation perturbed = sim;
+      perturbed.verbose = false;
+      perturbed.ordering_cache_file = "";
+      double perturbed_value = side == 0 ? value + step : value - step;
+      if(reactive) {
+        perturbed.cl_values[cmp.component_name] = perturbed_value;
+      } else {
+        vector<double> values = cmp.component_value;
+        values[0] = perturbed_value;
+        set_source_values(perturbed, c, values);
+      }
+      network_solver perturbed_solver;
+      prepare_network_solver(perturbed_solver, perturbed);
+      sensitivity_model model;
+      build_sensitivity_model(model, perturbed, perturbed_solver);
+      perturbed_outputs[side] = simulate_outputs(model, times, time_step, nullptr);
+    }
+    VectorXd difference = (perturbed_outputs[0] - perturbed_outputs[1]) / (2*step);
+    for(int o = 0; o < outputs; o++) {
+      if(scale(o) > 0.0) {
+        max_difference = max(max_difference, fabs(difference(o) - gradient[c](o)) / scale(o));
+      }
+    }
+  }
+  return max_difference;
+}
+
+int run_sensitivity_analysis(const network_simulation &sim, network_solver &solver, double stoptime, double time_step, string filename) {
+  sensitivity_model model;
+  build_sensitivity_model(model, sim, solver);
+
+  // Outputs as columns of c
+  int outputs = sim.sensitivity_nodes.size();
+  int size = model.nodes + solver.branch_components.size();
+  MatrixXd c = MatrixXd::Zero(size, outputs);
+  for(int o = 0; o < outputs; o++) {
+    if(model.row_of_node.find(sim.sensitivity_nodes[o]) == model.row_of_node.end()) {
+      cout << "[ERROR] .sens: unknown node N" << sim.sensitivity_nodes[o] << endl;
+      return 2;
+    }
+    c(model.row_of_node[sim.sensitivity_nodes[o]], o) = 1.0;
+  }
+
+  // Same time points as the simulation loop
+  vector<double> times;
+  for(double simulation_progress=0; simulation_progress<=stoptime; simulation_progress+=time_step) {
+    times.push_back(simulation_progress);
+  }
+  int last = times.size()-1;
+  if(last < 0) {
+    return 2;
+  }
+
+  // Forward pass, keeping the states at the checkpoints
+  vector<VectorXd> checkpoints;
+  VectorXd final_values = simulate_outputs(model, times, time_step, &checkpoints);
+
+  // Backward pass, one checkpoint segment at a time
+  vector<VectorXd> gradient(sim.network_components.size(), VectorXd::Zero(outputs));
+  MatrixXd mu = MatrixXd::Zero(model.states.size(), outputs); // dy/dx_k+1
+  for(int segment = checkpoints.size()-1; segment >= 0; segment--) {
+    int first = segment * sensitivity_checkpoint;
+    int end = min(last, first + sensitivity_checkpoint - 1);
+    vector<VectorXd> z_segment;
+    VectorXd x = checkpoints[segment];
+    for(int k = first; k <= end; k++) {
+      z_segment.push_back(solve_forward_step(model, x, times[k]));
+      x = next_states(model, x, z_segment.back(), time_step);
+    }
+
+    for(int k = end; k >= first; k--) {
+      const VectorXd &z = z_segment[k - first];
+
+      // Right-hand side of the adjoint system: the output at the last step, the state update before that
+      MatrixXd w = MatrixXd::Zero(size, outputs);
+      if(k == last) {
+        w = c;
+      } else {
+        for(int s = 0; s < model.states.size(); s++) {
+          int state = model.states[s];
+          double value = sim.cl_values.at(sim.network_components[state].component_name);
+          if(sim.network_components[state].component_name[0] == 'V') {
+            w.row(model.branch_row[state]) -= mu.row(s) * time_step / value;
+            gradient[state] += mu.row(s).transpose() * time_step * z(model.branch_row[state]) / (value*value);
+          } else {
+            int a = terminal_row(model, state, 0);
+            int b = terminal_row(model, state, 1);
+            if(a != -1) { w.row(a) += mu.row(s) * time_step / value; }
+            if(b != -1) { w.row(b) -= mu.row(s) * time_step / value; }
+            gradient[state] -= mu.row(s).transpose() * time_step * voltage_across(model, state, z) / (value*value);
+          }
+        }
+      }
+      MatrixXd nu = solve_adjoint_step(model, w);
+
+      // Resistors enter through K
+      for(int r = 0; r < sim.network_components.size(); r++) {
+        const component &cmp = sim.network_components[r];
+        if(cmp.component_name[0] != 'R') {
+          continue;
+        }
+        int a = terminal_row(model, r, 0);
+        int b = terminal_row(model, r, 1);
+        VectorXd nu_across = VectorXd::Zero(outputs);
+        if(a != -1) { nu_across += nu.row(a).transpose(); }
+        if(b != -1) { nu_across -= nu.row(b).transpose(); }
+        double resistance = cmp.component_value[0];
+        gradient[r] += nu_across * voltage_across(model, r, z) / (resistance*resistance);
+      }
+
+      // mu_k = mu_k+1 + R^T nu_k (the last step's update does not reach the output)
+      if(k == last) {
+        mu.setZero();
+      }
+      for(int s = 0; s < model.states.size(); s++) {
+        int state = model.states[s];
+        if(sim.network_components[state].component_name[0] == 'V') {
+          mu.row(s) += nu.row(model.branch_row[state]);
+        } else {
+          int a = terminal_row(model, state, 0);
+          int b = terminal_row(model, state, 1);
+          if(a != -1) { mu.row(s) -= nu.row(a); }
+          if(b != -1) { mu.row(s) += nu.row(b); }
+        }
+      }
+    }
+  }
+
+  // One row per R/C/L, one column per output
+  ofstream ofs(filename);
+  ofs.precision(10);
+  ofs << "Component,Value";
+  for(int o = 0; o < outputs; o++) {
+    ofs << ",dV(N" << sim.sensitivity_nodes[o] << ")/dp";
+  }
+  ofs << endl;
+  for(int i = 0; i < sim.network_components.size(); i++) {
+    const component &cmp = sim.network_components[i];
+    bool reactive = cmp.component_name[1] == '_';
+    if(cmp.component_name[0] != 'R' && !reactive) {
+      continue;
+    }
+    ofs << (reactive ? cmp.component_name.substr(2) : cmp.component_name) << ",";
+    ofs << (reactive ? sim.cl_values.at(cmp.component_name) : cmp.component_value[0]);
+    for(int o = 0; o < outputs; o++) {
+      ofs << "," << gradient[i](o);
+    }
+    ofs << endl;
+  }
+
+  for(int o = 0; o < outputs; o++) {
+    cout << "Sensitivity: V(N" << sim.sensitivity_nodes[o] << ") = " << final_values(o) << " at t=" << times[last] << endl;
+  }
+
+  if(sim.sensitivity_check) {
+    double difference = check_sensitivities(sim, times, time_step, gradient);
+    cout << "Sensitivity check: largest difference to finite differences " << difference << " (relative to the largest derivative)" << endl;
+    if(difference > sensitivity_check_tolerance) {
+      cout << "[WARNING] .sens derivatives differ from finite differences by " << difference << endl;
+    }
+  }
+  return 0;
+}
@@ -12,6 +12,82 @@ class node;
 class component;
 class independent_v_source;
 
+// A .subckt definition: its port node names and the netlist lines between .subckt and .ends
+class subcircuit {
+  public:
+    vector<string> ports;
+    vector<string> lines;
+};
+
+
+// A node removed by the RC reduction; its voltage is the weighted sum of its neighbours' voltages
+class eliminated_node {
+  public:
+    int index;
+    vector<int> neighbours;
+    vector<double> weights;
+};
+
+// A component merged away by merge_series_parallel; its current is factor times the current of the element it was merged into
+// (which may have been merged again). into is empty for removed dangling elements, which carry no current.
+class merged_element {
+  public:
+    string name;
+    string into;
+    double factor;
+};
+
+// A .meas line, accumulated while the simulation runs
+class measurement {
+  public:
+    string name;
+    string kind; // MAX, MIN, PP, AVG, RMS or WHEN
+    string signal; // V(N003) or I(R1)
+    int column = -1; // position in the output row
+    double from = 0.0;
+    double to = -1.0; // -1: until the end of the simulation
+    double threshold = 0.0; // WHEN
+    int edge = 0; // WHEN: 1 rising, -1 falling, 0 either
+    int occurrence = 1;
+
+    bool found = false;
+    int crossings = 0;
+    double result = 0.0;
+    double maximum = 0.0, minimum = 0.0;
+    double integral = 0.0, square_integral = 0.0, duration = 0.0;
+};
+
+// A .four line: Fourier coefficients over the last period of the simulation, accumulated while it runs
+class fourier_analysis {
+  public:
+    double frequency;
+    int harmonics = 9;
+    vector<string> signals;
+    vector<int> columns;
+    double start, end;
+    double duration = 0.0; // of the window actually integrated, the time loop can end one step short of stoptime
+    vector<vector<double>> cosine_integrals, sine_integrals; // per signal and harmonic (0 is DC)
+};
+
+// A .stimulus line: other values for some of the independent sources. All variants are simulated together with the
+// netlist as written, sharing the factorised conductance matrix.
+class stimulus_variant {
+  public:
+    vector<string> sources;
+    vector<vector<double>> values; // dc offset, amplitude, frequency of each source
+};
+
+// The C/L source equivalents of one kind as parallel arrays, in component order. update_source_equivalents runs one
+// loop over them instead of searching components and nodes. Their values are also stored in the component list and in
+// the copies held by their two nodes (which the I matrix is assembled from).
+class reactive_elements {
+  public:
+    vector<int> components; // component numbers of the I_/V_ equivalents
+    vector<double> values; // inductance or capacitance
+    vector<double> states; // inductor current or capacitor voltage
+    vector<int> rows0, rows1; // Vvector rows of the terminals, Vvector.size() for ground
+    vector<int> nodes0, slots0, nodes1, slots1; // the copies are network_nodes[nodes].connected_components[slots]
+};
 
 class network_simulation {
   public:
@@ -20,6 +96,197 @@ class network_simulation {
     vector<component> network_components;
     vector<node> network_nodes;
     map<string, double> cl_values; // maps source equivalent name to originl inductance/capacitance
+    reactive_elements inductors, capacitors; // built on the first update, the circuit no longer changes then
+    bool reactive_elements_built = false;
+    vector<string> analysis_directives; // .tran/.options/... lines as written in the netlist, replayed when loading from the cache
+
+    // Solver settings, changed through .options in the netlist
+    string solver_mode = "direct"; // direct: Cholesky/LDLT/LU factorisation; iterative: preconditioned CG/BiCGSTAB
+    string precision = "double"; // mixed: the direct solver factorises in float and refines the solution in double
+    string preconditioner = "ilu"; // ilu (incomplete Cholesky for symmetric systems) or jacobi
+    double solver_tolerance = 1e-10; // relative residual at which the iterative solver stops
+    int solver_max_iterations = 1000;
+    int assembly_threads = 0; // threads used to assemble G and I, 0 uses all cores
+    string ordering_cache_file; // fill-reducing orderings by circuit topology, kept in memory only if empty
+    string result_cache_dir; // rows of earlier runs by hash of circuit and analyses (not used if empty, or with .sens)
+    double result_cache_size = 0.0; // MB, least recently used entries are removed above it; 0 (default) disables the result cache
+    bool results_from_cache = false; // set by run_transient_analysis on a hit
+    double latency_tolerance = 0.0; // blocks whose sources change less than this (relative) are not solved again, 0 disables it
+
+    // Solver health checks (see check_solution): every solver_check_interval-th solve has its residual computed (0 leaves
+    // only the NaN/Inf check). With solver_abort the run stops at a singular matrix, a non-finite solution or a residual
+    // above max_residual; otherwise a warning is printed once.
+    int solver_check_interval = 1;
+    double max_residual = 1e-6;
+    bool solver_abort = true;
+    bool solver_trace = false; // keeps the residual of every timestep, written to solver_trace.csv
+    bool solver_checks = true; // false for runs that are not part of the output (the parareal coarse propagator): not checked, counted or traced
+
+    // Multirate: capacitors with a time constant far above multirate_steps*timestep only take one step every multirate_steps timesteps
+    int multirate_steps = 1;
+    vector<int> state_rates; // per component: 0 every timestep, 1 slow, 2 slow and interpolated (input of a fast block)
+    vector<double> slow_start_values, slow_end_values; // per component: C equivalent voltage at the start and end of the macro step
+
+    // Output settings, changed through .options in the netlist
+    bool write_waveforms = true; // false: no output.csv, only the .meas/.four results
+    bool verbose = true; // progress messages on cout (RC reduction, multirate); errors and warnings are always printed
+    double output_interval = 0.0; // time between written rows, 0 writes every timestep
+    double output_abstol = 0.0; // rows are skipped while no signal changes by more than abstol + reltol*|value|
+    double output_reltol = 0.0;
+    bool waveform_index = false; // also write a time/offset index and min/max pyramids of the CSV rows to output.csv.idx
+    vector<int> probed_nodes; // nodes from .probe lines, never removed by network reductions
+
+    // Parareal: the timesteps are split into parareal_slices slices (0 disables it), simulated concurrently and corrected
+    // by a coarse propagator with parareal_coarse timesteps per step until the slice boundary states change by less than parareal_tol
+    int parareal_slices = 0;
+    int parareal_coarse = 10;
+    double parareal_tolerance = 1e-9;
+
+    // Periodic steady state analysis: -1 disabled, 0 uses the lowest SINE frequency
+    double pss_frequency = -1.0;
+    double pss_tolerance = 1e-9; // relative change of the C/L states over one period
+
+    // Harmonic balance: -1 disabled, 0 uses the lowest SINE frequency as the fundamental; harmonics 0 ... hb_harmonics are solved
+    double hb_frequency = -1.0;
+    int hb_harmonics = 8;
+
+    // .sens: nodes whose voltage at the end of the simulation is differentiated with respect to every R, C and L
+    vector<int> sensitivity_nodes;
+    bool sensitivity_check = false; // sens_check: compare the derivatives with finite differences
+
+    // .meas and .four, computed from the output rows while the simulation runs
+    vector<measurement> measurements;
+    vector<fourier_analysis> fourier_analyses;
+    bool has_previous_measurement_row = false;
+    double previous_measurement_time;
+    vector<double> previous_measurement_row;
+
+    // .stimulus lines, simulated in one batch with the netlist (variant 0). Their .meas/.four results are copied here at the end.
+    vector<stimulus_variant> stimulus_variants;
+    vector<vector<measurement>> variant_measurements;
+    vector<vector<fourier_analysis>> variant_fourier_analyses;
+
+    // RC reduction: nodes with a time constant below rc_reduction_tol*timestep are eliminated (0 disables it)
+    double rc_reduction_tol = 0.0;
+    vector<eliminated_node> eliminated_nodes; // in the order they were removed (also the nodes removed by the merging)
+
+    // Series/parallel merging and removal of dangling elements before the RC reduction (.options merge_elements=1)
+    bool merge_elements = false;
+    vector<merged_element> merged_elements;
+    vector<string> original_components; // component names before the merging, the current columns of the output
+    vector<component> merged_components; // the network after the merging, before the RC reduction
+    // Per original component: the reduced component its current comes from (times the factor), or -1. Without a component the
+    // current is factor * (V0 - V1) from the two output voltage columns (-1 for ground), for resistors removed by the RC reduction.
+    vector<int> current_columns;
+    vector<double> current_factors;
+    vector<pair<int,int>> current_voltage_columns;
+
+    // Hierarchical netlists
+    map<string, subcircuit> subcircuits; // .subckt definitions by name
+    map<string, MatrixXd> subcircuit_reductions; // port admittance of purely resistive subcircuits, computed once per definition
+    vector<string> subcircuit_instances; // X lines, expanded once the whole netlist is read
+    int subcircuit_errors = 0; // instances that could not be expanded, the netlist is not simulated
+    string open_subcircuit; // name of the .subckt currently being read, empty outside of definitions
+    int next_internal_node = 1000; // netlist nodes are N000-N999, internal subcircuit nodes are numbered from here
+};
+
+// A connected component of the conductance matrix, solved on its own when latency is enabled.
+// Its right-hand side only depends on the sources at its nodes, so while they don't change the last solution still holds.
+class solver_block {
+  public:
+    vector<int> rows;
+    vector<int> sources; // components whose values enter the right-hand side of the rows
+    vector<int> source_columns; // their columns of network_solver::source_injection
+    SparseMatrix<double, RowMajor> injection; // right-hand side of the rows = injection * (values of sources)
+    SparseMatrix<double> G;
+    SparseMatrix<double, RowMajor> known_columns; // rows of network_solver::known_columns belonging to the block
+    bool use_llt = false;
+    SimplicialLLT<SparseMatrix<double>> llt;
+    SparseLU<SparseMatrix<double>, COLAMDOrdering<int>> lu;
+    bool solved = false;
+    vector<double> solved_inputs; // source values at the last solve
+};
+
+// LU of a conductance matrix with up to 16 unknowns, in fixed-size matrices of its exact size (see matrix_solver.cpp)
+class fixed_size_lu {
+  public:
+    virtual ~fixed_size_lu() {}
+    virtual MatrixXd solve(const MatrixXd &Imatrix) const = 0;
+};
+
+// Keeps the factorised/preconditioned conductance matrix and the last solution between timesteps.
+// The conductance matrix does not change during the simulation (C/L are sources), so it is prepared once.
+class network_solver {
+  public:
+    SparseMatrix<double> G; // without the columns of known nodes, see known_columns
+    SparseMatrix<double> known_columns; // G entries in the columns of known nodes, moved to the right-hand side
+    vector<int> known_rows; // rows that only say V_k = I_k (nodes with a grounded voltage source)
+    bool symmetric = false; // symmetric systems use Cholesky or conjugate gradient
+    string method; // which of the solvers below is prepared
+    VectorXd previous_solution; // warm start for the next timestep
+    long total_iterations = 0;
+    long unconverged_solves = 0; // iterative solves that stopped at solver_max_iterations
+
+    // Numerical health. rcond (reciprocal condition number estimate, 1-norm) and pivot_growth (largest pivot or entry of U
+    // over the largest entry of G) describe the factorisation, -1 where they are not available (sparse LU pivot growth,
+    // latency blocks, iterative solvers). Residuals are relative: |G x - I| / (|G| |x| + |I|), infinity norms.
+    double rcond = -1.0;
+    double pivot_growth = -1.0;
+    double G_norm = 0.0; // infinity norm of G
+    long total_solves = 0;
+    long checked_solves = 0;
+    double max_residual = 0.0;
+    long nonfinite_solves = 0;
+    bool failed = false; // a check failed with sim.solver_abort set, the run stops
+    bool failure_reported = false;
+    vector<pair<double,double>> residual_trace; // time and residual of every timestep, with sim.solver_trace
+    mutex telemetry_mutex; // parareal solves concurrently with one solver
+
+    // Branch currents of the voltage sources, the second block row of the MNA system (see prepare_branch_currents)
+    vector<int> terminal_rows; // solution row of terminal 0 and 1 of every component, -1 for ground
+    vector<int> branch_components; // component of each branch current unknown
+    SparseMatrix<double> resistor_G; // nodal conductance matrix of the resistors alone
+    vector<int> branch_order; // branch current unknowns, leaves of the voltage source forest first
+    vector<int> branch_child_rows, branch_parent_rows; // per branch_order entry, the parent is -1 for ground
+
+    // Direct solvers
+    MatrixXd G_dense;
+    unique_ptr<fixed_size_lu> fixed_lu; // method "fixed_size", up to 16 unknowns
+    LLT<MatrixXd> dense_llt;
+    LDLT<MatrixXd> dense_ldlt;
+    PartialPivLU<MatrixXd> dense_lu;
+    // Sparse factorisations of G permuted by ordering: P G P^T for LLT/LDLT (AMD), G Q for LU (COLAMD)
+    PermutationMatrix<Dynamic, Dynamic, int> ordering;
+    bool ordering_from_cache = false;
+    SimplicialLLT<SparseMatrix<double>, Lower, NaturalOrdering<int>> sparse_llt;
+    SimplicialLDLT<SparseMatrix<double>, Lower, NaturalOrdering<int>> sparse_ldlt;
+    SparseLU<SparseMatrix<double>, NaturalOrdering<int>> sparse_lu;
+    // Mixed precision (precision=mixed): dense_llt, dense_lu, sparse_llt or sparse_lu factorised in single precision and
+    // refined in double. The double factorisation above is only computed if refinement does not converge (double_factorised).
+    bool mixed_precision = false;
+    atomic<bool> double_factorised{false};
+    atomic<long> refinement_steps{0};
+    LLT<MatrixXf> dense_llt_float;
+    PartialPivLU<MatrixXf> dense_lu_float;
+    SimplicialLLT<SparseMatrix<float>, Lower, NaturalOrdering<int>> sparse_llt_float;
+    SparseLU<SparseMatrix<float>, NaturalOrdering<int>> sparse_lu_float;
+
+    // Latency (method "latency_blocks"): known rows come first, so their voltages are ready for the other blocks
+    deque<solver_block> blocks;
+    VectorXd block_solution;
+    long block_solves = 0;
+    long skipped_block_solves = 0;
+
+    // The right-hand side is linear in the source values, I = source_injection * (values of injected_sources)
+    // (stimulus batches and latency blocks, see prepare_source_injection)
+    vector<int> injected_sources;
+    SparseMatrix<double> source_injection;
+
+    // Iterative solvers
+    ConjugateGradient<SparseMatrix<double>, Lower|Upper, IncompleteCholesky<double>> cg_ic;
+    ConjugateGradient<SparseMatrix<double>, Lower|Upper, DiagonalPreconditioner<double>> cg_jacobi;
+    BiCGSTAB<SparseMatrix<double>, IncompleteLUT<double>> bicgstab_ilu;
+    BiCGSTAB<SparseMatrix<double>, DiagonalPreconditioner<double>> bicgstab_jacobi;
 };
 
 
@@ -149,9 +416,140 @@ double suffix_parser(string prefix_value);
 // This converts a raw node name from the netlist to the pure node index (int)
 int parse_node_name_to_index(string node_name);
 
+// Reads and parses a netlist file. A binary cache of the parsed circuit is kept next to it (<file>.cache)
+// and used instead of parsing as long as the file content is unchanged. Returns 0 on success, 2 if the file can't be read.
+int load_netlist(network_simulation &netlist_network, string filename);
+
+// Hash of the circuit graph: node order, and type and terminals of every component (values are left out)
+uint64_t hash_circuit_topology(const network_simulation &sim);
+
+// Fill-reducing orderings of sparse factorisations, cached by circuit topology and method ("amd", "colamd") in memory
+// and in cache_file (skipped if it is empty). find_cached_ordering returns false if there is none of the given size.
+bool find_cached_ordering(string cache_file, uint64_t topology_hash, string method, int size, vector<int> &ordering);
+void store_cached_ordering(string cache_file, uint64_t topology_hash, string method, const vector<int> &ordering);
+
+// Changes with every release that changes simulation results; result cache entries of other versions are never used
+const char *const simulator_version = "1.4";
+
+// Result cache (see netlist_cache.cpp). The key is a hash of the parsed circuit, the analysis directives, simulator_version
+// and the build time.
+uint64_t hash_simulation_inputs(const network_simulation &sim);
+// Replays a stored run: columns (with the stop time of the run, which .pss shortens) once, then all rows in their
+// original order. Returns false without calling either if cache_dir has no valid entry for key. The rows are not
+// replayed if columns returns non-zero.
+bool replay_cached_result(string cache_dir, uint64_t key, function<int(const vector<string>&, double)> columns,
+                          function<void(int, double, const vector<double>&)> row);
+// A run being recorded. It only becomes an entry with finish_cached_result, which also evicts the least recently
+// used entries (never the new one) until the directory holds at most max_bytes. Recording stops, and the partial entry is
+// deleted, as soon as the entry itself grows beyond max_bytes.
+class result_cache_entry {
+  public:
+    string cache_dir, file_name, temporary_name;
+    ofstream out;
+    uint64_t rows = 0;
+    uint64_t bytes = 0, row_bytes = 0, max_bytes = 0;
+    ~result_cache_entry();
+};
+bool begin_cached_result(result_cache_entry &entry, string cache_dir, uint64_t key, const vector<string> &column_names, uint64_t max_bytes);
+void add_cached_result_row(result_cache_entry &entry, int variant, double simulation_progress, const vector<double> &values);
+void finish_cached_result(result_cache_entry &entry, double stoptime, uint64_t max_bytes);
+
+// Parses a whole netlist held in memory, line by line. Lines that can't be parsed are ignored with a warning.
+// Returns 0 on success, 2 if a subcircuit instance could not be expanded.
+int parse_netlist_text(network_simulation &netlist_network, const string &text);
+
 // Takes a netlist line and processes it
 int parse_netlist_line(network_simulation &netlist_network, string netlist_line);
 
+// Applies a single key=value pair of an .options line. Returns 0 on success, 2 for unknown options.
+int parse_simulation_option(network_simulation &netlist_network, string option);
+
+// Replaces all X instances by the elements of their subcircuits.
+// Purely resistive subcircuits are reduced to resistors between their ports (computed once per definition).
+// Called at .end and after the last line of a netlist text. Returns 0 on success, 2 on error.
+int expand_subcircuit_instances(network_simulation &netlist_network);
+
+// Eliminates quick RC nodes (TICER) before C/L are converted to sources. Returns the number of removed nodes.
+int reduce_rc_network(network_simulation &sim);
+
+// Merges series resistors and parallel R, C and L, and removes dangling elements (see network_reduction.cpp).
+// Returns the number of merges and removals.
+int merge_series_parallel(network_simulation &sim);
+
+// After the C/L conversion: the output current columns of the components as written, and where their currents come from
+vector<string> map_merged_currents(network_simulation &sim, const vector<string> &voltage_columns);
+
+// Rebuilds network_nodes (and their connected components) from network_components
+void rebuild_network_nodes(network_simulation &sim);
+
+// Voltages of the nodes removed by reduce_rc_network, in the order of sim.eliminated_nodes
+vector<double> reconstruct_eliminated_voltages(const network_simulation &sim, const vector<node> &Vvector);
+
+// Prepares the solver selected by sim.solver_mode, before the first timestep
+void prepare_network_solver(network_solver &solver, const network_simulation &sim);
+
+// Adjoint sensitivity analysis: writes the derivatives of the .sens node voltages at the last timestep
+// with respect to every R, C and L to filename, solving with the solver prepared for the time loop. Returns 0 on success, 2 on error.
+int run_sensitivity_analysis(const network_simulation &sim, network_solver &solver, double stoptime, double time_step, string filename);
+
+// Parses a .stimulus line. Returns 0 on success, 2 on error.
+int parse_stimulus_variant(network_simulation &sim, string netlist_line);
+
+// Parses a .meas or .four line. Returns 0 on success, 2 on error.
+int parse_measurement(network_simulation &sim, string netlist_line);
+
+// Finds the output columns of the measured signals. Returns 0 on success, 2 if a signal does not exist.
+int prepare_measurements(network_simulation &sim, const vector<string> &column_names, double stoptime);
+
+// Adds one output row (the values of one timestep) to all measurements
+void accumulate_measurements(network_simulation &sim, double simulation_progress, const vector<double> &values);
+
+// Result of a .meas line, false if it could not be measured (e.g. WHEN never crossed)
+bool measurement_value(const measurement &meas, double &value);
+
+// Prints the .meas results and the .four tables, of every .stimulus variant too
+void report_measurements(const network_simulation &sim);
+
+// Sorts the capacitors into slow and fast ones for multirate integration. Needs the latency blocks of the direct solver.
+// Returns the number of slow capacitors.
+int prepare_multirate(network_simulation &sim, const network_solver &solver);
+
+// The whole transient analysis of a parsed netlist: RC reduction, C/L conversion, solver preparation, multirate, .pss, .sens,
+// the time loop and the .meas/.four accumulation. columns gets the output column names once, row the values of every timestep
+// and variant (0 is the netlist as written, k the k-th .stimulus line).
+// The .sens results are written to sensitivity_file_name (skipped if it is empty). Returns 0 on success, 1 on failure.
+int run_transient_analysis(network_simulation &sim, network_solver &solver, string sensitivity_file_name,
+                           function<void(const vector<string>&)> columns, function<void(int, double, const vector<double>&)> row);
+
+// Where cout goes on this thread during a library call (nullptr: stdout). Threads started by a simulation set it to the
+// value of the thread that started them, so their messages end up in the same results (see circuit_simulator.cpp).
+string *&thread_message_capture();
+
+// Solves the network at simulation_progress, updates Vvector and the C/L source equivalents. Returns the component currents.
+vector<double> simulate_timestep(network_simulation &sim, network_solver &solver, vector<node> &Vvector, double simulation_progress, double time_step);
+
+// Output row of a timestep: node voltages, voltages of nodes removed by the RC reduction, component currents
+vector<double> output_row_values(const network_simulation &sim, const vector<node> &Vvector, const vector<double> &current_through_cmps);
+
+// Parareal: simulates the timesteps up to stoptime in parallel time slices (see parareal.cpp) and passes the rows on in order.
+// Needs a direct solver without latency. Returns 0 on success, 1 if the iteration diverged.
+int run_parareal(network_simulation &sim, network_solver &solver, vector<node> &Vvector, double stoptime, double time_step,
+                 function<void(double, const vector<double>&)> row);
+
+// Shooting method: sets the C/L states to the periodic steady state. Returns the period, or 0 on failure.
+double find_periodic_steady_state(network_simulation &sim, network_solver &solver, vector<node> &Vvector);
+
+// Lowest frequency of all SINE sources (0 if there is none), the default fundamental of .pss and .hb
+double lowest_sine_frequency(const network_simulation &sim);
+
+// Harmonic balance (see harmonic_balance.cpp): writes amplitude and phase of every node voltage and component current at
+// the harmonics of the .hb fundamental. Needs the circuit before the C/L conversion. Returns 0 on success, 1 on failure.
+int run_harmonic_balance(const network_simulation &sim, string filename);
+
+// Values of all C/L source equivalents (the circuit state), in component order
+vector<double> read_reactive_states(const network_simulation &sim);
+void write_reactive_states(network_simulation &sim, const vector<double> &states);
+
 // Adds nodes to a network, if they don't exist already
 void push_nodes_with_component(network_simulation &netlist_network, vector<node> new_nodes, component new_cmp);
 
@@ -165,38 +563,85 @@ double calculate_conductance_between_nodes(node nodeinput1, node nodeinput2);
 double sum_conductance(vector<component> components);
 
 // The v column, consists of all the voltage nodes in the circuit, excluding the 0 reference node.
-vector<node> create_v_matrix(network_simulation A);
+vector<node> create_v_matrix(const network_simulation &A);
 
 // Returns vector of pairs of two regular nodes, which together form a supernode.
-vector<pair<node,node>> supernode_separation(vector<component> components, node reference_node);
+vector<pair<node,node>> supernode_separation(const vector<component> &components, const node &reference_node);
 
 // This function sums all the known currents (from current sources) at at node. Positive for net outflow, negative for net inflow.
-double sum_known_currents(node input, double simulation_progress);
+double sum_known_currents(const node &input, double simulation_progress);
 
 
 /// ^^^^^tested until here^^^^^
 
-bool is_a_node_voltage_known(node input, node reference_node);
+bool is_a_node_voltage_known(const node &input, const node &reference_node);
+
+bool r_two_nodes_supernodes(const component &cmp, const node &reference_node);
+
+MatrixXd create_i_matrix(const network_simulation &A, double current_time);
+
+int which_is_the_node(const vector<node> &nodes_wo_ref, const node &input);
+
+MatrixXd create_G_matrix(const network_simulation &A);
 
-bool r_two_nodes_supernodes(component cmp, node reference_node);
+// Same matrix as create_G_matrix, but assembled by stamping each resistor once into a sparse matrix.
+SparseMatrix<double> create_G_sparse_matrix(const network_simulation &A);
 
-MatrixXd create_i_matrix(network_simulation A, double current_time);
+// Solves G*V = I directly. Systems of up to 16 unknowns use a fixed-size LU selected from a precompiled table.
+MatrixXd solve_direct(const MatrixXd &Gmatrix, const MatrixXd &Imatrix);
 
-int which_is_the_node(vector<node> nodes_wo_ref, node input);
+// Factorises the conductance matrix once: Cholesky (LLT) if it is symmetric positive definite, else LDLT or LU.
+void prepare_direct_solver(network_solver &solver, const network_simulation &sim);
 
-MatrixXd create_G_matrix(network_simulation A);
+// Solves G*V = I with the factorisation from prepare_direct_solver. Every column of I is a separate right-hand side.
+MatrixXd solve_prepared_direct(network_solver &solver, const network_simulation &sim, const MatrixXd &Imatrix);
 
-double tell_currents(component input, vector<node> Vvector, double simulation_progress);
+// Records the right-hand side as I = source_injection * (values of injected_sources), for stimulus batches and latency blocks.
+void prepare_source_injection(network_solver &solver, const network_simulation &sim);
 
-vector<double> calculate_current_through_component(vector<component> network_component, vector<node> Vvector, double current_time);
+// Solves G*V = I (one right-hand side per column) with whatever prepare_network_solver set up, for analyses that need other
+// right-hand sides than the time loop (.sens). Latency blocks are all solved, the iterative solvers keep the initial guess
+// of the time loop. Pass a sim with solver_checks off to keep the solves out of the solver checks and counters.
+MatrixXd solve_prepared_system(network_solver &solver, const network_simulation &sim, const MatrixXd &Imatrix);
 
-double calculate_current_through_R(component R, vector<node> Vvector);
+// Solves G*V = I block by block, skipping the assembly and solve of blocks whose sources did not change (latency).
+MatrixXd solve_latency_blocks(network_solver &solver, const network_simulation &sim, double simulation_progress);
+
+// Assembles and preconditions the conductance matrix for the iterative solver.
+void prepare_iterative_solver(network_solver &solver, const network_simulation &sim);
+
+// Relative residual of the last checked solve on the calling thread (0 if it was not checked)
+double last_solve_residual();
+
+// Solves G*V = I iteratively, starting from the solution of the previous timestep.
+MatrixXd solve_iterative(network_solver &solver, const network_simulation &sim, const MatrixXd &Imatrix);
+
+// Prepares the branch current block of the MNA system: the order in which the voltage source currents are back-substituted.
+// Returns 1 (and sets solver.failed) if voltage sources form a loop.
+int prepare_branch_currents(network_solver &solver, const network_simulation &sim);
+
+// Solves B*i = G_R*V + J for the voltage source currents, given the node voltages V (J: current source currents leaving each node)
+VectorXd solve_branch_currents(const network_solver &solver, const network_simulation &sim, const VectorXd &V, double simulation_progress);
+
+// Solves B*i = leaving for the voltage source currents, one right-hand side per column (leaving: the currents leaving every
+// node through anything but voltage sources)
+MatrixXd back_substitute_branch_currents(const network_solver &solver, MatrixXd leaving);
+
+// Value of an independent source (dc offset + amplitude*sin(2*pi*frequency*t))
+double source_value(const component &source, double simulation_progress);
+
+// Currents through all components, in component order, from the MNA solution [node voltages; branch currents].
+// A voltage source current flows out of terminal 0 into the circuit, a current source current from terminal 0 to terminal 1.
+vector<double> calculate_current_through_component(const network_simulation &sim, const network_solver &solver, const VectorXd &solution, double simulation_progress);
 
 void convert_CLs_to_sources(network_simulation &sim);
 
-void update_source_equivalents(network_simulation &sim, vector<node> Vvector, vector<double> current_through_components, double simulation_progress, double timestep);
+void update_source_equivalents(network_simulation &sim, const vector<node> &Vvector, const vector<double> &current_through_components, double simulation_progress, double timestep);
+
+int which_is_cmp(const vector<component> &networkcmp, const component &input);
 
-int which_is_cmp(vector<component> networkcmp, component input);
+int which_is_cmp1(const vector<component> &networkcmp, const component &input);
 
-int which_is_cmp1(vector<component> networkcmp, component input);
+// Sets dc offset, amplitude and frequency of an independent source, also in the copies held by its nodes
+void set_source_values(network_simulation &sim, int component_number, vector<double> values);
 #endif
@@ -6,6 +6,248 @@
 using namespace std;
 using namespace Eigen;
 
+// Solver checks.
+// The solver paths that restructure the system (latency blocks, source injection, branch current back-substitution, .sens)
+// are compared with the plain computation they replace, on small circuits with grounded, floating and chained sources.
+// main prints [PASS]/[FAIL] per check and returns the number of failures.
+
+static int failed_checks = 0;
+
+static void report_check(string name, double difference, double tolerance) {
+  bool passed = difference <= tolerance;
+  cout << (passed ? "[PASS] " : "[FAIL] ") << name << ": largest difference " << difference << endl;
+  if(!passed) {
+    failed_checks++;
+  }
+}
+
+// Grounded sources and capacitors split it into several latency blocks, V2/C2 make floating supernodes
+static const string latency_netlist =
+  ".tran 0 5ms 0 10us\n"
+  "V1 N001 0 SINE(0 1 1k)\n"
+  "R1 N001 N002 100\n"
+  "C1 N002 0 1u\n"
+  "V2 N010 0 5\n"
+  "R2 N010 N011 100\n"
+  "R3 N011 N012 100\n"
+  "C2 N012 N011 10u\n"
+  "R4 N012 0 1k\n"
+  "C3 N013 N012 1u\n"
+  "R5 N013 0 50\n"
+  "I1 0 N013 SINE(0.01 0.01 300)\n";
+
+// A tree of voltage sources: grounded, floating, and a grounded capacitor, plus current sources and an inductor
+static const string branch_netlist =
+  ".tran 0 20ms 0 0.1ms\n"
+  "R1 N001 0 10\n"
+  "R2 N003 N002 10\n"
+  "V1 N003 0 SINE(10 5 20)\n"
+  "L1 N002 N001 5\n"
+  "R3 N004 0 10\n"
+  "R4 N003 N005 10\n"
+  "C1 N005 N004 0.01\n"
+  "V2 N006 N007 SINE(1 2 30)\n"
+  "R5 N006 N005 20\n"
+  "R6 N007 0 30\n"
+  "I1 N002 N006 SINE(0.1 0.05 10)\n"
+  "R7 N006 0 50\n";
+
+// Voltage sources in chains (N001-N002-N003 from ground, N005-N006-N007 floating), only the right-hand side is checked
+static const string chain_netlist =
+  ".tran 0 1ms 0 10us\n"
+  "V1 N001 0 5\n"
+  "V2 N002 N001 SINE(0 1 1k)\n"
+  "V3 N003 N002 2\n"
+  "R1 N003 0 10\n"
+  "R2 N002 0 10\n"
+  "C1 N004 0 1u\n"
+  "R3 N004 N003 1\n"
+  "I1 N003 N004 0.1\n"
+  "V4 N005 N006 3\n"
+  "V5 N006 N007 SINE(1 1 500)\n"
+  "R4 N005 0 10\n"
+  "R5 N007 N004 10\n"
+  "I2 0 N006 SINE(0 0.2 700)\n";
+
+static network_simulation parse_check_netlist(const string &netlist) {
+  network_simulation sim;
+  sim.verbose = false;
+  parse_netlist_text(sim, netlist);
+  return sim;
+}
+
+// Output rows of a transient (variant 0), the way the library runs it
+static vector<vector<double>> run_check_transient(const string &netlist, vector<string> &column_names, string sensitivity_file_name = "") {
+  network_simulation sim = parse_check_netlist(netlist);
+  network_solver solver;
+  vector<vector<double>> rows;
+  run_transient_analysis(sim, solver, sensitivity_file_name,
+    [&](const vector<string> &names) { column_names = names; },
+    [&](int variant, double simulation_progress, const vector<double> &row_values) {
+      if(variant == 0) {
+        rows.push_back(row_values);
+      }
+    });
+  return rows;
+}
+
+// Latency blocks with a tolerance far below rounding must give the solution of the whole G (latency_tol=0)
+static void check_latency_blocks() {
+  vector<string> names;
+  vector<vector<double>> plain = run_check_transient(latency_netlist, names);
+  vector<vector<double>> blocks = run_check_transient(latency_netlist + ".options latency_tol=1e-14\n", names);
+  double difference = plain.size() == blocks.size() && !plain.empty() ? 0.0 : numeric_limits<double>::infinity();
+  double scale = 0.0;
+  for(int r = 0; r < plain.size() && r < blocks.size(); r++) {
+    for(int c = 0; c < plain[r].size(); c++) {
+      difference = max(difference, fabs(plain[r][c] - blocks[r][c]));
+      scale = max(scale, fabs(plain[r][c]));
+    }
+  }
+  report_check("latency blocks vs latency_tol=0", difference / scale, 1e-10);
+}
+
+// source_injection * (source values) must reproduce create_i_matrix exactly, whatever the probes grouped together
+static void check_source_injection(string name, const string &netlist) {
+  network_simulation sim = parse_check_netlist(netlist);
+  convert_CLs_to_sources(sim);
+  network_solver solver;
+  prepare_source_injection(solver, sim);
+  double difference = 0.0;
+  for(double t: {0.0, 1.3e-4, 7.7e-4}) {
+    VectorXd values(solver.injected_sources.size());
+    for(int s = 0; s < solver.injected_sources.size(); s++) {
+      values(s) = source_value(sim.network_components[solver.injected_sources[s]], t);
+    }
+    MatrixXd I = create_i_matrix(sim, t);
+    difference = max(difference, (solver.source_injection * values - I).cwiseAbs().maxCoeff());
+  }
+  report_check("source injection vs create_i_matrix (" + name + ")", difference, 1e-12);
+}
+
+// The back-substituted currents must solve the first block row of the MNA system like the least squares B^T B solve did
+static void check_branch_currents(string name, const string &netlist) {
+  network_simulation sim = parse_check_netlist(netlist);
+  convert_CLs_to_sources(sim);
+  network_solver solver;
+  prepare_network_solver(solver, sim);
+  vector<node> Vvector = create_v_matrix(sim);
+  map<int,int> row_of_node;
+  for(int row = 0; row < Vvector.size(); row++) {
+    row_of_node[Vvector[row].index] = row;
+  }
+  auto row_of = [&](const node &terminal) { return terminal.index == 0 ? -1 : row_of_node[terminal.index]; };
+
+  double difference = 0.0, scale = 0.0;
+  for(double t: {0.0, 3.1e-3, 1.7e-2}) {
+    VectorXd V = solve_prepared_system(solver, sim, create_i_matrix(sim, t));
+    VectorXd currents = solve_branch_currents(solver, sim, V, t);
+
+    // B (+1 at terminal 0, -1 at terminal 1 of every voltage source) and the currents leaving every node otherwise
+    vector<int> sources;
+    VectorXd leaving = VectorXd::Zero(Vvector.size());
+    for(int c = 0; c < sim.network_components.size(); c++) {
+      const component &cmp = sim.network_components[c];
+      int a = row_of(cmp.connected_terminals[0]), b = row_of(cmp.connected_terminals[1]);
+      double across = (a == -1 ? 0.0 : V(a)) - (b == -1 ? 0.0 : V(b));
+      double current = cmp.component_name[0] == 'R' ? across / cmp.component_value[0] : cmp.component_name[0] == 'I' ? source_value(cmp, t) : 0.0;
+      if(cmp.component_name[0] == 'V') {
+        sources.push_back(c);
+      } else if(current != 0.0) {
+        if(a != -1) { leaving(a) += current; }
+        if(b != -1) { leaving(b) -= current; }
+      }
+    }
+    MatrixXd B = MatrixXd::Zero(Vvector.size(), sources.size());
+    for(int k = 0; k < sources.size(); k++) {
+      const component &cmp = sim.network_components[sources[k]];
+      int a = row_of(cmp.connected_terminals[0]), b = row_of(cmp.connected_terminals[1]);
+      if(a != -1) { B(a, k) = 1.0; }
+      if(b != -1) { B(b, k) = -1.0; }
+    }
+    VectorXd least_squares = (B.transpose() * B).ldlt().solve(B.transpose() * leaving);
+    if(currents.size() != least_squares.size()) {
+      difference = numeric_limits<double>::infinity();
+      break;
+    }
+    difference = max(difference, (currents - least_squares).cwiseAbs().maxCoeff());
+    scale = max(scale, least_squares.cwiseAbs().maxCoeff());
+  }
+  report_check("branch currents vs B^T B solve (" + name + ")", difference / scale, 1e-10);
+}
+
+// Netlist with the value (last token) of one component scaled
+static string scale_component(const string &netlist, string name, double factor) {
+  stringstream lines(netlist), scaled;
+  string line;
+  while(getline(lines, line)) {
+    if(line.compare(0, name.size()+1, name + " ") == 0) {
+      string value = line.substr(line.rfind(' ')+1);
+      stringstream replaced;
+      replaced.precision(17);
+      replaced << suffix_parser(value) * factor;
+      line = line.substr(0, line.rfind(' ')+1) + replaced.str();
+    }
+    scaled << line << "\n";
+  }
+  return scaled.str();
+}
+
+// .sens derivatives against central differences of whole transients, with every R, C and L perturbed by 0.01%
+static void check_sensitivities() {
+  const string netlist = branch_netlist + ".sens V(N005) V(N002) V(N007)\n";
+  const string sensitivity_file_name = "sandbox_sensitivity.csv";
+  vector<string> names;
+  run_check_transient(netlist, names, sensitivity_file_name);
+
+  ifstream sensitivity_file(sensitivity_file_name);
+  string line;
+  getline(sensitivity_file, line);
+  vector<string> outputs = {"5", "2", "7"};
+  vector<vector<double>> adjoint, finite_difference;
+  while(getline(sensitivity_file, line)) {
+    stringstream fields(line);
+    string name, value;
+    getline(fields, name, ',');
+    getline(fields, value, ',');
+    vector<double> derivatives;
+    for(string derivative; getline(fields, derivative, ',');) {
+      derivatives.push_back(stod(derivative));
+    }
+    adjoint.push_back(derivatives);
+
+    const double step = 1e-4;
+    vector<double> final_values[2];
+    for(int side = 0; side < 2; side++) {
+      vector<string> perturbed_names;
+      vector<vector<double>> rows = run_check_transient(scale_component(netlist, name, side == 0 ? 1+step : 1-step), perturbed_names);
+      for(string output: outputs) {
+        int column = find(perturbed_names.begin(), perturbed_names.end(), output) - perturbed_names.begin();
+        final_values[side].push_back(rows.back()[column]);
+      }
+    }
+    vector<double> differences;
+    for(int o = 0; o < outputs.size(); o++) {
+      differences.push_back((final_values[0][o] - final_values[1][o]) / (2*step*stod(value)));
+    }
+    finite_difference.push_back(differences);
+  }
+  remove(sensitivity_file_name.c_str());
+
+  // Relative to the largest derivative of each output
+  double difference = adjoint.empty() ? numeric_limits<double>::infinity() : 0.0;
+  for(int o = 0; o < outputs.size(); o++) {
+    double scale = 0.0;
+    for(const vector<double> &derivatives: adjoint) {
+      scale = max(scale, fabs(derivatives[o]));
+    }
+    for(int p = 0; p < adjoint.size() && scale > 0.0; p++) {
+      difference = max(difference, fabs(adjoint[p][o] - finite_difference[p][o]) / scale);
+    }
+  }
+  report_check(".sens vs finite differences", difference, 1e-5);
+}
+
 int main() {
     //cout << suffix_parser("") << endl;
     network_simulation sim;
@@ -56,6 +298,14 @@ int main() {
   	MatrixXd I = create_i_matrix(sim, 5.0);
   	cout << endl << endl << "I_matrix:" << endl << I << endl << endl;
 
+    check_latency_blocks();
+    check_source_injection("latency circuit", latency_netlist);
+    check_source_injection("voltage source tree", branch_netlist);
+    check_source_injection("chained voltage sources", chain_netlist);
+    check_branch_currents("latency circuit", latency_netlist);
+    check_branch_currents("voltage source tree", branch_netlist);
+    check_sensitivities();
+    return failed_checks;
 }
 
 
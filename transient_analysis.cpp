@@ -0,0 +1,451 @@
+#include "simulator.hpp"
+#include "dependencies.hpp"
+
+using namespace std;
+using namespace Eigen;
+
+// One timestep of the transient simulation, shared by the main loop and the other analyses.
+
+string *&thread_message_capture() {
+  // Only library calls set it (see circuit_simulator.cpp), the command line program always prints to stdout
+  static thread_local string *capture = nullptr;
+  return capture;
+}
+
+void prepare_network_solver(network_solver &solver, const network_simulation &sim) {
+  // The conductance matrix does not change over time, so it is factorised (or preconditioned) once
+  if(sim.solver_mode == "iterative") {
+    if(sim.latency_tolerance > 0.0) {
+      cout << "[WARNING] latency_tol is only used by the direct solver" << endl;
+    }
+    prepare_iterative_solver(solver, sim);
+  } else {
+    prepare_direct_solver(solver, sim);
+  }
+  prepare_branch_currents(solver, sim);
+}
+
+// Everything after the solve: node voltages, branch and component currents, and the C/L update for the next timestep
+static vector<double> apply_timestep_solution(network_simulation &sim, const network_solver &solver, vector<node> &Vvector, const VectorXd &voltages, double simulation_progress, double time_step) {
+  for(int i = 0 ; i < Vvector.size() ; i++){
+    // Updating node_voltage values in Vvector
+    Vvector[i].node_voltage = voltages(i);
+  }
+
+  // 2 Solve for the voltage source currents, the remaining unknowns of the MNA solution [V; i], and read off all component currents
+  VectorXd branch_currents = solve_branch_currents(solver, sim, voltages, simulation_progress);
+  VectorXd solution(voltages.size() + branch_currents.size());
+  solution << voltages, branch_currents;
+  vector<double> current_through_cmps = calculate_current_through_component(sim, solver, solution, simulation_progress);
+
+  // 3 Update the source equivalents for inductors and capacitors (for the next timestep)
+  update_source_equivalents(sim, Vvector, current_through_cmps, simulation_progress, time_step);
+
+  return current_through_cmps;
+}
+
+static void record_solver_trace(const network_simulation &sim, network_solver &solver, double simulation_progress) {
+  if(sim.solver_trace && sim.solver_checks) {
+    lock_guard<mutex> lock(solver.telemetry_mutex);
+    solver.residual_trace.push_back(make_pair(simulation_progress, last_solve_residual()));
+  }
+}
+
+vector<double> simulate_timestep(network_simulation &sim, network_solver &solver, vector<node> &Vvector, double simulation_progress, double time_step) {
+
+  // 1 Solve the matrix equation
+  MatrixXd Vmatrix;
+  if(solver.method == "latency_blocks") {
+    // Assembles the right-hand side itself, only for the blocks that changed
+    Vmatrix = solve_latency_blocks(solver, sim, simulation_progress);
+  } else if(sim.solver_mode == "iterative") {
+    Vmatrix = solve_iterative(solver, sim, create_i_matrix(sim, simulation_progress));
+  } else {
+    Vmatrix = solve_prepared_direct(solver, sim, create_i_matrix(sim, simulation_progress));
+  }
+  record_solver_trace(sim, solver, simulation_progress);
+
+  return apply_timestep_solution(sim, solver, Vvector, Vmatrix.col(0), simulation_progress, time_step);
+}
+
+// Stimulus batch: the variants only differ in their source values (and therefore in their C/L states), never in G.
+// The right-hand side is linear in the source values (see prepare_source_injection), so the right-hand sides of all variants
+// are a single product with the matrix of their source values, solved with the one factorisation in a blocked substitution.
+static vector<vector<double>> simulate_batch_timestep(const vector<network_simulation*> &variants, network_solver &solver, vector<vector<node>> &Vvectors, double simulation_progress, double time_step) {
+  MatrixXd source_values(solver.injected_sources.size(), variants.size());
+  for(int k = 0; k < variants.size(); k++) {
+    for(int s = 0; s < solver.injected_sources.size(); s++) {
+      source_values(s, k) = source_value(variants[k]->network_components[solver.injected_sources[s]], simulation_progress);
+    }
+  }
+  MatrixXd Vmatrix = solve_prepared_direct(solver, *variants[0], solver.source_injection * source_values);
+  record_solver_trace(*variants[0], solver, simulation_progress);
+
+  vector<vector<double>> currents(variants.size());
+  for(int k = 0; k < variants.size(); k++) {
+    currents[k] = apply_timestep_solution(*variants[k], solver, Vvectors[k], Vmatrix.col(k), simulation_progress, time_step);
+  }
+  return currents;
+}
+
+// The copies of the circuit simulated for the .stimulus lines, with their source values replaced
+static int create_stimulus_variants(const network_simulation &sim, deque<network_simulation> &variant_sims) {
+  for(const stimulus_variant &variant: sim.stimulus_variants) {
+    variant_sims.push_back(sim);
+    network_simulation &variant_sim = variant_sims.back();
+    variant_sim.stimulus_variants.clear();
+    for(int s = 0; s < variant.sources.size(); s++) {
+      int c = 0;
+      while(c < variant_sim.network_components.size() && variant_sim.network_components[c].component_name != variant.sources[s]) {
+        c++;
+      }
+      if(c == variant_sim.network_components.size()) {
+        cout << "[ERROR] .stimulus: unknown source " << variant.sources[s] << endl;
+        return 1;
+      }
+      set_source_values(variant_sim, c, variant.values[s]);
+    }
+  }
+  return 0;
+}
+
+// Multirate integration.
+// A capacitor is slow when its time constant, estimated from the conductances at its nodes, is at least
+// slow_time_constant_ratio macro steps (multirate_steps*timestep). Slow capacitors take one forward Euler step per macro step.
+// Blocks of the latency solver that only see slow capacitors and constant sources then don't change between macro steps,
+// so they are neither assembled nor solved. Slow capacitors that feed a fast block (one with a fast capacitor, an inductor
+// or a SINE source) are interpolated over the macro step instead, so the fast block sees a smooth interface waveform.
+
+static const double slow_time_constant_ratio = 10.0;
+
+int prepare_multirate(network_simulation &sim, const network_solver &solver) {
+  sim.state_rates.clear();
+  if(sim.multirate_steps <= 1) {
+    return 0;
+  }
+  if(solver.method != "latency_blocks") {
+    cout << "[WARNING] multirate is only used by the direct solver" << endl;
+    return 0;
+  }
+
+  map<int,double> conductance_at_node;
+  map<int,int> v_sources_at_node;
+  set<int> inductor_nodes;
+  for(const component &cmp: sim.network_components) {
+    for(const node &terminal: cmp.connected_terminals) {
+      if(cmp.component_name[0] == 'R') {
+        conductance_at_node[terminal.index] += 1.0/cmp.component_value[0];
+      }
+      if(cmp.component_name[0] == 'V') {
+        v_sources_at_node[terminal.index]++;
+      }
+      if(cmp.component_name.compare(0, 2, "I_") == 0) {
+        inductor_nodes.insert(terminal.index);
+      }
+    }
+  }
+
+  // The resistance seen by a capacitor is at least the parallel resistance at each of its nodes
+  // (0 at ground or at another voltage source), so the estimated time constant errs towards fast.
+  // A node without resistors gives no estimate at all, and a capacitor next to an inductor is part of an LC resonance
+  // whose period has nothing to do with an RC time constant: both stay fast.
+  int slow = 0;
+  double macro_step = sim.multirate_steps * sim.timestep;
+  sim.state_rates.assign(sim.network_components.size(), 0);
+  for(int i = 0; i < sim.network_components.size(); i++) {
+    const component &cmp = sim.network_components[i];
+    if(cmp.component_name.compare(0, 2, "V_") != 0) {
+      continue;
+    }
+    double resistance = 0.0;
+    bool estimated = true;
+    for(const node &terminal: cmp.connected_terminals) {
+      if(terminal.index == 0 || v_sources_at_node[terminal.index] > 1) {
+        continue;
+      }
+      if(conductance_at_node[terminal.index] <= 0.0 || inductor_nodes.count(terminal.index)) {
+        estimated = false;
+        break;
+      }
+      resistance += 1.0/conductance_at_node[terminal.index];
+    }
+    if(estimated && sim.cl_values[cmp.component_name] * resistance >= slow_time_constant_ratio * macro_step) {
+      sim.state_rates[i] = 1;
+      slow++;
+    }
+  }
+
+  for(const solver_block &block: solver.blocks) {
+    bool fast = false;
+    for(int c: block.sources) {
+      const component &cmp = sim.network_components[c];
+      if(cmp.component_name[1] == '_' ? sim.state_rates[c] == 0 : cmp.component_value[1] != 0.0) {
+        fast = true;
+      }
+    }
+    for(int c: block.sources) {
+      if(fast && sim.state_rates[c] == 1) {
+        sim.state_rates[c] = 2;
+      }
+    }
+  }
+
+  sim.slow_start_values.assign(sim.network_components.size(), 0.0);
+  sim.slow_end_values.assign(sim.network_components.size(), 0.0);
+  return slow;
+}
+
+vector<double> output_row_values(const network_simulation &sim, const vector<node> &Vvector, const vector<double> &current_through_cmps) {
+  vector<double> row_values;
+  for(int i = 0 ; i < Vvector.size() ; i++){
+    row_values.push_back(Vvector[i].node_voltage);
+  }
+  if(!sim.eliminated_nodes.empty()) {
+    vector<double> eliminated_voltages = reconstruct_eliminated_voltages(sim, Vvector);
+    row_values.insert(row_values.end(), eliminated_voltages.begin(), eliminated_voltages.end());
+  }
+  if(sim.current_columns.empty()) {
+    row_values.insert(row_values.end(), current_through_cmps.begin(), current_through_cmps.end());
+    return row_values;
+  }
+  // Currents of the components as written, from the merged elements
+  for(int c = 0; c < sim.current_columns.size(); c++) {
+    if(sim.current_columns[c] != -1) {
+      row_values.push_back(sim.current_factors[c] * current_through_cmps[sim.current_columns[c]]);
+    } else {
+      const pair<int,int> &columns = sim.current_voltage_columns[c];
+      double voltage = (columns.first == -1 ? 0.0 : row_values[columns.first]) - (columns.second == -1 ? 0.0 : row_values[columns.second]);
+      row_values.push_back(sim.current_factors[c] * voltage);
+    }
+  }
+  return row_values;
+}
+
+// The .meas/.four results of the .stimulus variants
+static void collect_variant_results(network_simulation &sim, const deque<network_simulation> &variant_sims) {
+  sim.variant_measurements.clear();
+  sim.variant_fourier_analyses.clear();
+  for(const network_simulation &variant_sim: variant_sims) {
+    sim.variant_measurements.push_back(variant_sim.measurements);
+    sim.variant_fourier_analyses.push_back(variant_sim.fourier_analyses);
+  }
+}
+
+int run_transient_analysis(network_simulation &sim, network_solver &solver, string sensitivity_file_name,
+                           function<void(const vector<string>&)> columns, function<void(int, double, const vector<double>&)> row) {
+  double time_step = sim.timestep;
+  double stoptime = sim.stop_time;
+
+  // A stimulus batch needs one factorisation of the whole G, shared by all variants
+  bool batch = !sim.stimulus_variants.empty();
+  if(batch) {
+    if(sim.pss_frequency >= 0.0) {
+      cout << "[ERROR] .stimulus can't be combined with .pss" << endl;
+      return 1;
+    }
+    if(sim.solver_mode != "direct" || sim.latency_tolerance > 0.0 || sim.multirate_steps > 1) {
+      cout << "[WARNING] .stimulus batches always use the direct solver without latency and multirate" << endl;
+      sim.solver_mode = "direct";
+      sim.latency_tolerance = 0.0;
+      sim.multirate_steps = 1;
+    }
+  }
+
+  // Parareal runs slices of the same circuit concurrently on one shared factorisation
+  bool parareal = sim.parareal_slices > 1;
+  if(parareal && batch) {
+    cout << "[WARNING] parareal is not used for .stimulus batches" << endl;
+    parareal = false;
+  }
+  if(parareal && (sim.solver_mode != "direct" || sim.latency_tolerance > 0.0 || sim.multirate_steps > 1)) {
+    cout << "[WARNING] parareal always uses the direct solver without latency and multirate" << endl;
+    sim.solver_mode = "direct";
+    sim.latency_tolerance = 0.0;
+    sim.multirate_steps = 1;
+  }
+
+  // Result cache (opt-in with result_cache_size): the rows of an earlier run of the same circuit and analyses are replayed
+  // instead of simulated. .sens writes its own file and is always simulated.
+  bool cache_results = !sim.result_cache_dir.empty() && sim.result_cache_size > 0.0 && sim.sensitivity_nodes.empty();
+  uint64_t result_key = cache_results ? hash_simulation_inputs(sim) : 0;
+  if(cache_results) {
+    deque<network_simulation> cached_variant_sims;
+    int status = 0;
+    bool hit = replay_cached_result(sim.result_cache_dir, result_key,
+      [&](const vector<string> &column_names, double cached_stoptime) {
+        columns(column_names);
+        if(prepare_measurements(sim, column_names, cached_stoptime) != 0 || create_stimulus_variants(sim, cached_variant_sims) != 0) {
+          status = 1;
+        }
+        return status;
+      },
+      [&](int variant, double simulation_progress, const vector<double> &row_values) {
+        row(variant, simulation_progress, row_values);
+        accumulate_measurements(variant == 0 ? sim : cached_variant_sims[variant-1], simulation_progress, row_values);
+      });
+    if(hit) {
+      sim.results_from_cache = true;
+      collect_variant_results(sim, cached_variant_sims);
+      return status;
+    }
+  }
+  result_cache_entry cache_entry;
+  uint64_t result_cache_bytes = sim.result_cache_size * 1024 * 1024;
+  if(cache_results) {
+    function<void(const vector<string>&)> write_columns = columns;
+    function<void(int, double, const vector<double>&)> write_row = row;
+    columns = [&, write_columns](const vector<string> &column_names) {
+      write_columns(column_names);
+      begin_cached_result(cache_entry, sim.result_cache_dir, result_key, column_names, result_cache_bytes);
+    };
+    row = [&, write_row](int variant, double simulation_progress, const vector<double> &row_values) {
+      write_row(variant, simulation_progress, row_values);
+      add_cached_result_row(cache_entry, variant, simulation_progress, row_values);
+    };
+  }
+
+  // Merging series and parallel elements, the output still has the nodes and components as written
+  if(sim.merge_elements) {
+    if(!sim.sensitivity_nodes.empty()) {
+      cout << "[WARNING] merge_elements is ignored with .sens, the sensitivities are per component as written" << endl;
+    } else {
+      int total_components = sim.network_components.size();
+      int merged = merge_series_parallel(sim);
+      if(sim.verbose) {
+        cout << "Merging series/parallel elements left " << sim.network_components.size() << " of " << total_components
+             << " components (" << merged << " merges and removals)" << endl;
+      }
+    }
+  }
+
+  // Removing quick RC nodes, their voltages are reconstructed for the output
+  if(sim.rc_reduction_tol > 0.0) {
+    if(!sim.sensitivity_nodes.empty()) {
+      cout << "[WARNING] rc_reduction_tol is ignored with .sens, the sensitivities are per component as written" << endl;
+    } else {
+      int total_nodes = sim.network_nodes.size();
+      int eliminated = reduce_rc_network(sim);
+      if(sim.verbose) {
+        cout << "RC reduction removed " << eliminated << " of " << total_nodes << " nodes" << endl;
+      }
+    }
+  }
+
+  // Converting conductors and capacitors to their source equivalents
+  convert_CLs_to_sources(sim);
+
+  // The voltage vector containing unknown voltage nodes
+  vector<node> Vvector = create_v_matrix(sim);
+
+  // Output columns: node voltages, voltages of nodes removed by the RC reduction, component currents
+  vector<string> column_names;
+  for(const node &nd: Vvector) {
+    column_names.push_back(to_string(nd.index));
+  }
+  for(const eliminated_node &removed_node: sim.eliminated_nodes) {
+    column_names.push_back(to_string(removed_node.index));
+  }
+  if(sim.original_components.empty()) {
+    for(const component &cmp: sim.network_components) {
+      column_names.push_back(cmp.component_name);
+    }
+  } else {
+    vector<string> current_names = map_merged_currents(sim, column_names);
+    column_names.insert(column_names.end(), current_names.begin(), current_names.end());
+  }
+  columns(column_names);
+
+  prepare_network_solver(solver, sim);
+  if(solver.failed) {
+    return 1;
+  }
+
+  // Multirate: slow capacitors only take every multirate_steps-th step
+  if(sim.multirate_steps > 1) {
+    int slow = prepare_multirate(sim, solver);
+    if(sim.verbose) {
+      cout << "Multirate: " << slow << " slow capacitors, macro step " << sim.multirate_steps*sim.timestep << endl;
+    }
+  }
+
+  // Periodic steady state: start from the periodic state and only simulate one period
+  if(sim.pss_frequency >= 0.0) {
+    double period = find_periodic_steady_state(sim, solver, Vvector);
+    if(period <= 0.0) {
+      return 1;
+    }
+    stoptime = period;
+    time_step = period / round(period / time_step);
+  }
+
+  // Sensitivities of the .sens outputs, before the simulation loop changes the C/L states
+  if(!sim.sensitivity_nodes.empty() && !sensitivity_file_name.empty()) {
+    if(run_sensitivity_analysis(sim, solver, stoptime, time_step, sensitivity_file_name) != 0) {
+      return 1;
+    }
+  }
+
+  // Measurements refer to the output columns
+  if(prepare_measurements(sim, column_names, stoptime) != 0) {
+    return 1;
+  }
+
+  // Variant 0 is the netlist as written, the others are copies with the .stimulus source values
+  deque<network_simulation> variant_sims;
+  if(create_stimulus_variants(sim, variant_sims) != 0) {
+    return 1;
+  }
+  vector<network_simulation*> variants = {&sim};
+  for(network_simulation &variant_sim: variant_sims) {
+    variants.push_back(&variant_sim);
+  }
+  vector<vector<node>> Vvectors(variants.size(), Vvector);
+  if(batch) {
+    prepare_source_injection(solver, sim);
+  }
+
+  /*
+    Simulation Loop
+      1 Solve the matrix equation (all variants at once in a stimulus batch)
+      2 Calculate currents through components
+      3 Update the source equivalents for inductors and capacitors
+      4 Pass the calculated voltages and currents on (CSV file, in-memory results) and to the measurements
+  */
+  if(parareal) {
+    int status = run_parareal(sim, solver, Vvectors[0], stoptime, time_step, [&](double simulation_progress, const vector<double> &row_values) {
+      row(0, simulation_progress, row_values);
+      accumulate_measurements(sim, simulation_progress, row_values);
+    });
+    if(status == 0 && cache_results) {
+      finish_cached_result(cache_entry, stoptime, result_cache_bytes);
+    }
+    return status;
+  }
+  for(double simulation_progress=0; simulation_progress<=stoptime; simulation_progress+=time_step) {
+
+    // 1-3 Solve, calculate currents and update the source equivalents
+    vector<vector<double>> current_through_cmps;
+    if(batch) {
+      current_through_cmps = simulate_batch_timestep(variants, solver, Vvectors, simulation_progress, time_step);
+    } else {
+      current_through_cmps = {simulate_timestep(sim, solver, Vvectors[0], simulation_progress, time_step)};
+    }
+    if(solver.failed) {
+      cout << "[ERROR] Simulation stopped at t=" << simulation_progress << endl;
+      return 1;
+    }
+
+    // 4 Output rows
+    for(int k = 0; k < variants.size(); k++) {
+      vector<double> row_values = output_row_values(*variants[k], Vvectors[k], current_through_cmps[k]);
+      row(k, simulation_progress, row_values);
+      accumulate_measurements(*variants[k], simulation_progress, row_values);
+    }
+  }
+
+  collect_variant_results(sim, variant_sims);
+  if(cache_results) {
+    finish_cached_result(cache_entry, stoptime, result_cache_bytes);
+  }
+  return 0;
+}
@@ -8,56 +8,326 @@ using namespace Eigen;
 string input_file_name = "netlist.txt";
 // The csv output file path
 string output_file_name = "output.csv";
+// The .sens results file path
+string sensitivity_file_name = "sensitivity.csv";
+// The .hb spectrum file path
+string harmonic_balance_file_name = "hb.csv";
+// Residual of every solve, with .options solver_trace=1
+string solver_trace_file_name = "solver_trace.csv";
+// Fill-reducing orderings of sparse factorisations, reused by later runs of the same circuit topology
+string ordering_cache_file_name = input_file_name + ".ordering.cache";
+// Rows of earlier runs, by hash of the parsed circuit and its analyses, shared by all netlists simulated in this directory
+string result_cache_directory = "result_cache";
+// Appended to the name of every CSV file for its waveform index, with .options waveform_index=1
+string waveform_index_suffix = ".idx";
+
+
+// Returns the size of the file, which is where the first row starts
+long write_csv_column_specifiers(ofstream &ofs, const vector<string> &column_names) {
+
+	//this function writes the node_index and component names at the top of each column of a freshly opened CSV file
+	ofs << "Time" << "," ;
+	for(int c = 0; c < column_names.size() ; c++){
+		ofs << column_names[c];
+		if(c < column_names.size()-1){
+			ofs << "," ;
+		}
+	}
 
+	ofs << '\n';
+	return ofs.tellp();
+}
 
-void write_csv_column_specifiers(string filename, vector<node> nodes, vector<component> network_component) {
+// This function writes one row: the time, then the node voltages, then the component currents. Returns the size of the file.
+// The stream stays open for the whole simulation and is only flushed by its buffer.
+long write_csv_row(ofstream &ofs, double simulation_progress, const vector<double> &values){
+	ofs << simulation_progress << "," ; // write the time
+	for(int i = 0 ; i < values.size(); i++){
+		ofs << values[i];
+		if(i < values.size()-1){
+			ofs << "," ;
+		}
+	}
 
-	//this function writes a CSV file with node_index and component names at the top of each column
-	ofstream ofs;
-	ofs.open(filename);
+	ofs << '\n';
+	return ofs.tellp();
+}
 
-	ofs << "Time" << "," ;
-	for(node nd: nodes){
-		ofs <<  nd.index << "," ;
+// Waveform index, a binary sidecar of a CSV file that lets a viewer read any time window at any zoom level without scanning the CSV.
+// The rows are grouped into blocks of waveform_index_block_rows rows (level 0), and every level above merges two blocks of the
+// level below, up to one block for the whole file. Every block is one fixed-size record:
+//    double first time, double last time, uint64 byte offset of its first row in the CSV, uint64 index of its first row,
+//    uint64 number of rows, then float min and float max of every signal (in the order of the CSV columns)
+// The records of a level are sorted by time, so a window is found with a binary search. The file starts with a header:
+//    char[8] "WAVEIDX1", uint32 signals, uint32 rows per level 0 block, uint32 number of levels, uint32 record size,
+//    uint64 number of rows, then for each of waveform_index_max_levels levels: uint64 file offset of its first record, uint64 records
+// All values are in the byte order of the machine that wrote the file.
+static const int waveform_index_block_rows = 64;
+static const int waveform_index_max_levels = 48;
+static const char waveform_index_magic[8] = {'W', 'A', 'V', 'E', 'I', 'D', 'X', '1'};
+
+class waveform_index_record {
+	public:
+		double first_time;
+		double last_time;
+		uint64_t offset;
+		uint64_t first_row;
+		uint64_t rows = 0;
+		vector<float> minmax; // min and max of every signal
+};
+
+class waveform_index {
+	public:
+		bool enabled = false;
+		fstream file;
+		int signals = 0;
+		long csv_size = 0; // end of the CSV file, where the next row starts
+		uint64_t rows = 0;
+		waveform_index_record block; // level 0 block being filled
+		uint64_t level0_records = 0;
+};
+
+static size_t index_record_size(int signals) {
+	return 5*8 + 2*sizeof(float)*signals;
+}
+
+static void write_index_record(fstream &file, const waveform_index_record &record) {
+	file.write((const char*)&record.first_time, sizeof(double));
+	file.write((const char*)&record.last_time, sizeof(double));
+	file.write((const char*)&record.offset, sizeof(uint64_t));
+	file.write((const char*)&record.first_row, sizeof(uint64_t));
+	file.write((const char*)&record.rows, sizeof(uint64_t));
+	file.write((const char*)record.minmax.data(), sizeof(float)*record.minmax.size());
+}
+
+static void read_index_record(fstream &file, waveform_index_record &record) {
+	file.read((char*)&record.first_time, sizeof(double));
+	file.read((char*)&record.last_time, sizeof(double));
+	file.read((char*)&record.offset, sizeof(uint64_t));
+	file.read((char*)&record.first_row, sizeof(uint64_t));
+	file.read((char*)&record.rows, sizeof(uint64_t));
+	file.read((char*)record.minmax.data(), sizeof(float)*record.minmax.size());
+}
+
+// Adds the rows of record to merged, which starts where record starts if it is empty
+static void merge_index_record(waveform_index_record &merged, const waveform_index_record &record) {
+	if(merged.rows == 0) {
+		merged = record;
+		return;
 	}
-	for(int c = 0; c < network_component.size() ; c++){
-		ofs << network_component[c].component_name;
-		if(c < network_component.size()-1){
-			ofs << "," ;
-		}
+	merged.last_time = record.last_time;
+	merged.rows += record.rows;
+	for(int i = 0; i < merged.minmax.size(); i += 2) {
+		merged.minmax[i] = min(merged.minmax[i], record.minmax[i]);
+		merged.minmax[i+1] = max(merged.minmax[i+1], record.minmax[i+1]);
 	}
+}
 
-	ofs << endl;
+// Level 0 is written while the simulation runs, the header is filled in by finish_waveform_index
+static void begin_waveform_index(waveform_index &index, string filename, int signals, long csv_size) {
+	index.file.open(filename, ios::in | ios::out | ios::trunc | ios::binary);
+	if(!index.file) {
+		cout << "[WARNING] Could not write the waveform index " << filename << endl;
+		return;
+	}
+	index.enabled = true;
+	index.signals = signals;
+	index.csv_size = csv_size;
+	vector<char> header(8 + 4*4 + 8 + 16*waveform_index_max_levels, 0);
+	index.file.write(header.data(), header.size());
 }
 
-// This functin writes the node voltages values at other rows
-void write_csv_voltage_row(string filename, double simulation_progress, vector<node> nodes){
-	ofstream ofs;
-	ofs.open(filename, ios_base::app);
+static void add_index_row(waveform_index &index, double time, const vector<double> &values, long csv_size) {
+	waveform_index_record &block = index.block;
+	if(block.rows == 0) {
+		block.first_time = time;
+		block.offset = index.csv_size;
+		block.first_row = index.rows;
+		block.minmax.assign(2*index.signals, NAN);
+	}
+	block.last_time = time;
+	block.rows++;
+	// NaN rows (a failed solve) don't widen the range
+	for(int i = 0; i < index.signals; i++) {
+		float value = values[i];
+		if(!(value >= block.minmax[2*i])) { block.minmax[2*i] = value; }
+		if(!(value <= block.minmax[2*i+1])) { block.minmax[2*i+1] = value; }
+	}
+	index.rows++;
+	index.csv_size = csv_size;
+	if(block.rows == waveform_index_block_rows) {
+		write_index_record(index.file, block);
+		index.level0_records++;
+		block.rows = 0;
+	}
+}
 
+// Builds every level above 0 from the level below it, read back from the file, then writes the header
+static void finish_waveform_index(waveform_index &index) {
+	if(!index.enabled) {
+		return;
+	}
+	if(index.block.rows > 0) {
+		write_index_record(index.file, index.block);
+		index.level0_records++;
+		index.block.rows = 0;
+	}
+	size_t record_size = index_record_size(index.signals);
+	vector<pair<uint64_t,uint64_t>> levels; // file offset and number of records
+	levels.push_back(make_pair(uint64_t(8 + 4*4 + 8 + 16*waveform_index_max_levels), index.level0_records));
+	while(levels.back().second > 1 && levels.size() < waveform_index_max_levels) {
+		uint64_t below = levels.back().first;
+		uint64_t below_records = levels.back().second;
+		uint64_t start = below + below_records*record_size;
+		waveform_index_record record, merged;
+		record.minmax.resize(2*index.signals);
+		for(uint64_t r = 0; r < below_records; r += 2) {
+			merged.rows = 0;
+			for(uint64_t k = r; k < min(r+2, below_records); k++) {
+				index.file.seekg(below + k*record_size);
+				read_index_record(index.file, record);
+				merge_index_record(merged, record);
+			}
+			index.file.seekp(start + r/2*record_size);
+			write_index_record(index.file, merged);
+		}
+		levels.push_back(make_pair(start, (below_records+1)/2));
+	}
 
-	ofs << simulation_progress << "," ; // write the time
-	//write the node voltages
-	for(int i = 0 ; i < nodes.size(); i++){
-		ofs << nodes[i].node_voltage << "," ;
+	index.file.seekp(0);
+	index.file.write(waveform_index_magic, sizeof(waveform_index_magic));
+	uint32_t fields[4] = {uint32_t(index.signals), uint32_t(waveform_index_block_rows), uint32_t(levels.size()), uint32_t(record_size)};
+	index.file.write((const char*)fields, sizeof(fields));
+	index.file.write((const char*)&index.rows, sizeof(uint64_t));
+	for(const pair<uint64_t,uint64_t> &level: levels) {
+		index.file.write((const char*)&level.first, sizeof(uint64_t));
+		index.file.write((const char*)&level.second, sizeof(uint64_t));
 	}
+	index.file.close();
+}
 
+// Decides which rows are written to the CSV file. Without output options every timestep is written.
+// output_interval: rows are interpolated at multiples of the interval instead of being written at every timestep.
+// output_abstol/output_reltol: a row is only written when a signal moved by more than the tolerance since the last written row,
+// or when the row before it was a corner (a straight line from the last written row misses it by more than the tolerance).
+class output_decimator {
+	public:
+		string filename;
+		ofstream file; // open from the column names to finish_output
+		double interval = 0.0;
+		double abstol = 0.0;
+		double reltol = 0.0;
+		long rows_written = 0;
+
+		// Last written row
+		bool has_written = false;
+		double written_time;
+		vector<double> written_values;
+		// Last row that passed the interval stage, but was not written (yet)
+		bool has_pending = false;
+		double pending_time;
+		vector<double> pending_values;
+		// Last solver timestep, used for interpolation
+		bool has_step = false;
+		double step_time;
+		vector<double> step_values;
+		long next_output_index = 0;
+
+		waveform_index index;
+};
+
+static void emit_row(output_decimator &output, double time, const vector<double> &values) {
+	long csv_size = write_csv_row(output.file, time, values);
+	if(output.index.enabled) {
+		add_index_row(output.index, time, values, csv_size);
+	}
+	output.rows_written++;
+	output.has_written = true;
+	output.written_time = time;
+	output.written_values = values;
 }
 
-void write_csv_current_row(string filename, vector<double> current_cmps){
-	ofstream ofs;
-	ofs.open(filename, ios_base::app);
+// Tolerance stage
+static void offer_row(output_decimator &output, double time, const vector<double> &values) {
+	if((output.abstol <= 0.0 && output.reltol <= 0.0) || !output.has_written) {
+		emit_row(output, time, values);
+		return;
+	}
 
+	// The pending row is a corner if the line from the last written row to this one does not pass through it
+	if(output.has_pending) {
+		double fraction = (output.pending_time - output.written_time) / (time - output.written_time);
+		for(int i = 0; i < values.size(); i++) {
+			double predicted = output.written_values[i] + (values[i] - output.written_values[i]) * fraction;
+			if(fabs(predicted - output.pending_values[i]) > output.abstol + output.reltol*fabs(output.pending_values[i])) {
+				emit_row(output, output.pending_time, output.pending_values);
+				break;
+			}
+		}
+	}
 
-	for(int i = 0 ; i < current_cmps.size(); i++){
-		ofs << current_cmps[i];
-		if(i < current_cmps.size()-1){
-			ofs << "," ;
+	for(int i = 0; i < values.size(); i++) {
+		if(fabs(values[i] - output.written_values[i]) > output.abstol + output.reltol*fabs(output.written_values[i])) {
+			emit_row(output, time, values);
+			output.has_pending = false;
+			return;
 		}
 	}
+	output.has_pending = true;
+	output.pending_time = time;
+	output.pending_values = values;
+}
 
-	ofs << endl;
+// Interval stage, called once per solver timestep
+void push_output_timestep(output_decimator &output, double simulation_progress, const vector<double> &values) {
+	if(output.interval <= 0.0) {
+		offer_row(output, simulation_progress, values);
+		return;
+	}
+
+	// Rows at multiples of the interval, linearly interpolated between the last and this timestep
+	double output_time = output.next_output_index * output.interval;
+	while(output_time <= simulation_progress + 1e-9*output.interval) {
+		if(!output.has_step || output_time >= simulation_progress) {
+			offer_row(output, output_time, values);
+		} else {
+			double fraction = (output_time - output.step_time) / (simulation_progress - output.step_time);
+			vector<double> interpolated(values.size());
+			for(int i = 0; i < values.size(); i++) {
+				interpolated[i] = output.step_values[i] + (values[i] - output.step_values[i]) * fraction;
+			}
+			offer_row(output, output_time, interpolated);
+		}
+		output.next_output_index++;
+		output_time = output.next_output_index * output.interval;
+	}
+	output.has_step = true;
+	output.step_time = simulation_progress;
+	output.step_values = values;
+}
+
+// Writes the last timestep if it falls between two interval rows, and the row that was held back by the tolerance stage,
+// so the waveform always ends at the last point
+void finish_output(output_decimator &output) {
+	if(output.interval > 0.0 && output.has_step &&
+	   output.step_time > (output.next_output_index-1) * output.interval + 1e-9*output.interval) {
+		offer_row(output, output.step_time, output.step_values);
+	}
+	if(output.has_pending) {
+		emit_row(output, output.pending_time, output.pending_values);
+		output.has_pending = false;
+	}
+	finish_waveform_index(output.index);
+	output.file.close();
+}
 
+// Output file of a .stimulus variant: output.csv => output_1.csv, output_2.csv, ...
+string variant_file_name(string filename, int variant) {
+	if(variant == 0) {
+		return filename;
+	}
+	size_t extension = filename.rfind('.');
+	return filename.substr(0, extension) + "_" + to_string(variant) + (extension == string::npos ? "" : filename.substr(extension));
 }
 
 int main(){
@@ -67,15 +337,25 @@ int main(){
 	cout << "Netlist input: " << input_file_name << endl << "CSV Output: " << output_file_name << endl;
 	network_simulation sim;
 
-	fstream newfile;
-	newfile.open(input_file_name, ios::in);
-	if (newfile.is_open()){
-		string tp;
-		while(getline(newfile, tp)){
-			parse_netlist_line(sim, tp);
+	// Parses the netlist, or loads it from netlist.txt.cache if the netlist did not change since the last run
+	if(load_netlist(sim, input_file_name) != 0) {
+		return 1;
+	}
+	sim.ordering_cache_file = ordering_cache_file_name;
+	sim.result_cache_dir = result_cache_directory;
+
+	// Harmonic balance needs no time stepping, a netlist without .tran only runs it
+	if(sim.hb_frequency >= 0.0) {
+		if(run_harmonic_balance(sim, harmonic_balance_file_name) != 0) {
+			return 1;
 		}
-		newfile.close();
-    }
+		cout << "📄 Harmonic balance spectrum written to: " << harmonic_balance_file_name << endl;
+		bool transient = find_if(sim.analysis_directives.begin(), sim.analysis_directives.end(), [](const string &directive) { return directive.compare(0, 5, ".tran") == 0; }) != sim.analysis_directives.end();
+		if(!transient) {
+			cout << "✅ Simulation Complete ✅" << endl << endl;
+			return 0;
+		}
+	}
 	cout << "🔄 Netlist parsing complete. Running simulation with following paramters: ";
 
 	double time_step = sim.timestep;
@@ -84,57 +364,95 @@ int main(){
 	cout << "time_step=" << time_step << "; stoptime=" << stoptime << endl << endl;
 
 
-	// Converting conductors and capacitors to their source equivalents
-	convert_CLs_to_sources(sim);
-
-	// The voltage vector containing unknown voltage nodes
-	vector<node> Vvector = create_v_matrix(sim);
-
-	// Writing the column names into the CSV file; This happens before C/L are converted to sources.
-	write_csv_column_specifiers(output_file_name, Vvector, sim.network_components);
-
-
-  //find the equivalent sources in sim.network_components
-	//find their connected nodes.
-	//add the equivalent sources in to the vector of components in sim.network_nodes
-
-	/*
-		Simulation Loop
-			1 Solve the matrix equation
-			2 Write the calculated voltages to CSV
-			3 Calculate currents through components
-			4 Write currents to CSV
-			5 Update the source equivalents for inductors and capacitors
-	*/
-
-	for(double simulation_progress=0; simulation_progress<=stoptime; simulation_progress+=time_step) {
+	network_solver solver;
+	// One output file per variant, variant 0 is the netlist as written
+	vector<output_decimator> outputs(1 + sim.stimulus_variants.size());
+	for(int k = 0; k < outputs.size(); k++) {
+		outputs[k].filename = variant_file_name(output_file_name, k);
+		outputs[k].interval = sim.output_interval;
+		outputs[k].abstol = sim.output_abstol;
+		outputs[k].reltol = sim.output_reltol;
+	}
 
-		// 1 Solve the matrix equation
-		MatrixXd Imatrix = create_i_matrix(sim,simulation_progress);
-		MatrixXd Gmatrix = create_G_matrix(sim);
-		Gmatrix = Gmatrix.inverse();
-		MatrixXd Vmatrix = Gmatrix * Imatrix;
+	// Runs the simulation; the CSV files get the column names first, then the voltages and currents of every timestep (or decimated)
+	int status = run_transient_analysis(sim, solver, sensitivity_file_name,
+		[&](const vector<string> &column_names) {
+			if(sim.write_waveforms) {
+				for(output_decimator &output: outputs) {
+					output.file.open(output.filename);
+					long csv_size = write_csv_column_specifiers(output.file, column_names);
+					if(sim.waveform_index) {
+						begin_waveform_index(output.index, output.filename + waveform_index_suffix, column_names.size(), csv_size);
+					}
+				}
+			}
+		},
+		[&](int variant, double simulation_progress, const vector<double> &row_values) {
+			if(sim.write_waveforms) {
+				push_output_timestep(outputs[variant], simulation_progress, row_values);
+			}
+		});
+	if(status != 0) {
+		return 1;
+	}
+	for(output_decimator &output: outputs) {
+		finish_output(output);
+	}
+	if(!sim.sensitivity_nodes.empty()) {
+		cout << "📄 Sensitivities written to: " << sensitivity_file_name << endl;
+	}
 
-		for(int i = 0 ; i < Vvector.size() ; i++){
-			// Updating node_voltage values in Vvector
-			Vvector[i].node_voltage = Vmatrix(i,0);
+	if(sim.results_from_cache) {
+		cout << "Results replayed from the result cache: " << result_cache_directory << endl;
+	} else if(sim.solver_mode == "iterative") {
+		cout << "Iterative solver (" << solver.method << ") used " << solver.total_iterations << " iterations in total" << endl;
+		if(solver.unconverged_solves > 0) {
+			cout << "[WARNING] Iterative solver did not converge in " << solver.unconverged_solves << " solves" << endl;
 		}
+	} else {
+		cout << "Direct solver: " << solver.method << endl;
+		if(solver.mixed_precision) {
+			cout << "Mixed precision: " << solver.refinement_steps << " refinement steps in total" << (solver.double_factorised ? ", refactorised in double precision" : "") << endl;
+		}
+		if(solver.method.compare(0, 7, "sparse_") == 0) {
+			cout << "Fill-reducing ordering: " << (solver.ordering_from_cache ? "reused from " + sim.ordering_cache_file : "computed") << endl;
+		}
+	}
+	// Nothing was solved for replayed results
+	if(!sim.results_from_cache) {
+		cout << "Solver health: rcond=" << solver.rcond << ", pivot growth=" << solver.pivot_growth << ", max residual=" << solver.max_residual
+			<< " over " << solver.checked_solves << " checked solves, " << solver.nonfinite_solves << " non-finite solutions" << endl;
+		if(sim.solver_trace) {
+			// Parareal slices finish out of order
+			sort(solver.residual_trace.begin(), solver.residual_trace.end());
+			ofstream ofs(solver_trace_file_name);
+			ofs << "Time,Residual" << endl;
+			for(const pair<double,double> &entry: solver.residual_trace) {
+				ofs << entry.first << "," << entry.second << endl;
+			}
+			cout << "📄 Solver trace written to: " << solver_trace_file_name << endl;
+		}
+		if(solver.method == "latency_blocks") {
+			cout << "Latency: " << solver.blocks.size() << " blocks, " << solver.skipped_block_solves << " of " << solver.block_solves + solver.skipped_block_solves << " block solves skipped" << endl;
+		}
+	}
 
-		
-		// 2 Write the calculated voltages to CSV
-		write_csv_voltage_row(output_file_name, simulation_progress, Vvector);
-
-		// 3 Calculate currents through components
-		vector<double> current_through_cmps = calculate_current_through_component(sim.network_components, Vvector, simulation_progress);
-
-		// 4 Write currents to CSV
-		write_csv_current_row(output_file_name, current_through_cmps);
+	if(sim.output_interval > 0.0 || sim.output_abstol > 0.0 || sim.output_reltol > 0.0) {
+		cout << "Output decimation wrote " << outputs[0].rows_written << " rows" << endl;
+	}
 
-		// 5 Update the source equivalents for inductors and capacitors
-		update_source_equivalents(sim, Vvector, current_through_cmps, simulation_progress, time_step);
+	report_measurements(sim);
 
+	cout << "✅ Simulation Complete ✅" << endl;
+	if(sim.write_waveforms) {
+		cout << "📄 Outputs written to: " << output_file_name << endl;
+		if(!sim.stimulus_variants.empty()) {
+			cout << "📄 Stimulus variants written to: " << variant_file_name(output_file_name, 1) << " ... " << variant_file_name(output_file_name, sim.stimulus_variants.size()) << endl;
+		}
+		if(outputs[0].index.enabled) {
+			cout << "📄 Waveform index written to: " << output_file_name + waveform_index_suffix << endl;
+		}
 	}
-
-	cout << "✅ Simulation Complete ✅" << endl << "📄 Outputs written to: " << output_file_name << endl << endl;
+	cout << endl;
 	return 0;
 }